@@ -0,0 +1,147 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+namespace fdeep {
+namespace internal {
+
+    // Number of consecutive rows (i.e., output channels or units) forming one block.
+    // Corresponds to pruning the Keras kernels with a block size of (1, 8).
+    const std::size_t sparse_block_height = 8;
+
+    // Weight matrices with a smaller fraction of all-zero blocks are not stored sparse,
+    // because not even matrix-vector products would get faster.
+    const float_type sparse_min_zero_block_fraction = static_cast<float_type>(0.7);
+
+    // Eigen's GEMM kernels make much better use of the SIMD registers
+    // than the sparse kernel, so matrix-matrix products (e.g., of convolutions)
+    // are only done sparse if at least this fraction of the blocks is all zero.
+    const float_type sparse_gemm_min_zero_block_fraction = static_cast<float_type>(0.9);
+
+    // A (rows x cols) matrix of which only the blocks of sparse_block_height
+    // vertically adjacent values containing at least one non-zero are stored.
+    // The blocks of each block row are stored one after another (as in CSR),
+    // with the values of the last block row padded with zeros.
+    struct block_sparse_matrix {
+        std::size_t rows_;
+        std::size_t cols_;
+        // Index of the first block of every block row, plus the total block count.
+        std::vector<std::size_t> block_row_starts_;
+        std::vector<std::size_t> block_cols_;
+        float_vec block_values_;
+    };
+
+    inline float_type zero_block_fraction(const block_sparse_matrix& m)
+    {
+        const std::size_t block_rows = m.block_row_starts_.size() - 1;
+        const std::size_t all_blocks = block_rows * m.cols_;
+        return all_blocks == 0
+            ? static_cast<float_type>(0)
+            : static_cast<float_type>(all_blocks - m.block_cols_.size()) / static_cast<float_type>(all_blocks);
+    }
+
+    // Stores the column-major matrix the values point to (with the given distance between columns)
+    // in blocked-sparse format, if enough of its blocks are all zero.
+    inline fplus::maybe<block_sparse_matrix> create_block_sparse_matrix(
+        const float_type* values,
+        std::size_t rows,
+        std::size_t cols,
+        std::size_t col_stride)
+    {
+        const std::size_t block_rows = (rows + sparse_block_height - 1) / sparse_block_height;
+        block_sparse_matrix result = { rows, cols, { 0 }, {}, {} };
+        for (std::size_t block_row = 0; block_row < block_rows; ++block_row) {
+            const std::size_t row_begin = block_row * sparse_block_height;
+            const std::size_t height = std::min(sparse_block_height, rows - row_begin);
+            for (std::size_t col = 0; col < cols; ++col) {
+                const float_type* block = values + col * col_stride + row_begin;
+                if (std::all_of(block, block + height, [](float_type x) { return x == 0; })) {
+                    continue;
+                }
+                result.block_cols_.push_back(col);
+                result.block_values_.insert(result.block_values_.end(), block, block + height);
+                result.block_values_.resize(result.block_values_.size() + sparse_block_height - height, 0);
+            }
+            result.block_row_starts_.push_back(result.block_cols_.size());
+        }
+        if (zero_block_fraction(result) < sparse_min_zero_block_fraction) {
+            return fplus::nothing<block_sparse_matrix>();
+        }
+        return result;
+    }
+
+    // Whether a matrix-matrix product with a is expected to be faster sparse than dense.
+    // Matrix-vector products always are, once a is stored sparse.
+    inline bool prefer_block_sparse_gemm(const block_sparse_matrix& a)
+    {
+        return zero_block_fraction(a) >= sparse_gemm_min_zero_block_fraction;
+    }
+
+    // Number of output columns computed together, so every block is loaded only once for them.
+    const std::size_t sparse_column_group = 8;
+
+    // out += a * b, with b being a column-major (a.cols_ x n) matrix
+    // and out a column-major (a.rows_ x n) matrix, both with the given distances between columns.
+    // Only the stored blocks of a are multiplied,
+    // and every output column is computed in the same order of operations,
+    // no matter how many columns are computed at once.
+    inline void block_sparse_multiply_add(
+        const block_sparse_matrix& a,
+        const float_type* b,
+        std::size_t b_col_stride,
+        std::size_t n,
+        float_type* out,
+        std::size_t out_col_stride)
+    {
+        typedef Eigen::Matrix<float_type, static_cast<EigenIndex>(sparse_block_height), 1> block_vec;
+        const std::size_t block_rows = a.block_row_starts_.size() - 1;
+        // The few columns of b stay in the L1 cache while all blocks are applied to them.
+        const auto add_columns = [&](std::size_t col_begin, auto col_count) {
+            for (std::size_t block_row = 0; block_row < block_rows; ++block_row) {
+                block_vec acc[decltype(col_count)::value];
+                for (auto& x : acc) {
+                    x.setZero();
+                }
+                for (std::size_t i = a.block_row_starts_[block_row]; i < a.block_row_starts_[block_row + 1]; ++i) {
+                    const Eigen::Map<const block_vec, Eigen::Unaligned> block(a.block_values_.data() + i * sparse_block_height);
+                    const float_type* b_row = b + a.block_cols_[i];
+                    for (std::size_t c = 0; c < decltype(col_count)::value; ++c) {
+                        acc[c] += block * b_row[(col_begin + c) * b_col_stride];
+                    }
+                }
+                const std::size_t row_begin = block_row * sparse_block_height;
+                const std::size_t height = std::min(sparse_block_height, a.rows_ - row_begin);
+                for (std::size_t c = 0; c < decltype(col_count)::value; ++c) {
+                    float_type* out_block = out + (col_begin + c) * out_col_stride + row_begin;
+                    if (height == sparse_block_height) {
+                        Eigen::Map<block_vec, Eigen::Unaligned>(out_block) += acc[c];
+                    } else {
+                        for (std::size_t r = 0; r < height; ++r) {
+                            out_block[r] += acc[c](static_cast<EigenIndex>(r));
+                        }
+                    }
+                }
+            }
+        };
+        std::size_t col = 0;
+        for (; col + sparse_column_group <= n; col += sparse_column_group) {
+            add_columns(col, std::integral_constant<std::size_t, sparse_column_group>());
+        }
+        for (; col < n; ++col) {
+            add_columns(col, std::integral_constant<std::size_t, 1>());
+        }
+    }
+
+}
+}
@@ -0,0 +1,89 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+
+namespace fdeep {
+namespace internal {
+
+    // Thrown by a prediction whose cancellation token has been cancelled.
+    class prediction_cancelled : public std::runtime_error {
+    public:
+        prediction_cancelled()
+            : std::runtime_error("prediction cancelled")
+        {
+        }
+    };
+
+    // Lets another thread stop a running prediction.
+    // All copies of a token share their state.
+    class cancellation_token {
+    public:
+        cancellation_token()
+            : cancelled_(std::make_shared<std::atomic<bool>>(false))
+        {
+        }
+
+        void cancel() const
+        {
+            *cancelled_ = true;
+        }
+
+        bool is_cancelled() const
+        {
+            return *cancelled_;
+        }
+
+    private:
+        std::shared_ptr<std::atomic<bool>> cancelled_;
+    };
+
+    // The token of the prediction the current thread is running, nullptr if none.
+    inline const cancellation_token*& current_cancellation_token()
+    {
+        static thread_local const cancellation_token* token = nullptr;
+        return token;
+    }
+
+    // Makes the token the one of the current thread during its lifetime.
+    class cancellation_scope {
+    public:
+        explicit cancellation_scope(const cancellation_token& token)
+            : token_(token)
+            , previous_(current_cancellation_token())
+        {
+            current_cancellation_token() = &token_;
+        }
+        ~cancellation_scope()
+        {
+            current_cancellation_token() = previous_;
+        }
+        cancellation_scope(const cancellation_scope&) = delete;
+        cancellation_scope& operator=(const cancellation_scope&) = delete;
+
+    private:
+        cancellation_token token_;
+        const cancellation_token* previous_;
+    };
+
+    // Called before every layer, so a cancelled prediction
+    // stops at the latest after the layer running when it was cancelled.
+    inline void throw_if_cancelled()
+    {
+        const auto token = current_cancellation_token();
+        if (token != nullptr && token->is_cancelled()) {
+            throw prediction_cancelled();
+        }
+    }
+
+}
+}
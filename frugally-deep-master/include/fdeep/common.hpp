@@ -28,6 +28,8 @@
 #pragma GCC diagnostic pop
 #endif
 
+#include "fdeep/memory_accounting.hpp"
+
 #include <fplus/fplus.hpp>
 
 #include <cmath>
@@ -36,6 +38,39 @@
 #include <string>
 #include <vector>
 
+// Hot loops are compiled for several instruction sets with the target attribute,
+// which GCC and clang support for every object format (unlike target_clones),
+// and the best one the CPU supports is selected via a function pointer
+// when the kernel is used for the first time.
+// Define FDEEP_NO_MULTIVERSIONING to compile them only once.
+#if !defined(FDEEP_NO_MULTIVERSIONING) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define FDEEP_MULTIVERSIONING_ENABLED 1
+#define FDEEP_TARGET_AVX512F __attribute__((target("avx512f,avx2,fma")))
+#define FDEEP_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define FDEEP_TARGET_SSE42 __attribute__((target("sse4.2")))
+#define FDEEP_FORCE_INLINE __attribute__((always_inline)) inline
+#else
+#define FDEEP_MULTIVERSIONING_ENABLED 0
+#define FDEEP_FORCE_INLINE inline
+#endif
+
+// Defines the variants name_baseline, name_sse42, name_avx2 and name_avx512f
+// of a kernel, which all inline name_kernel, so it is compiled for every instruction set.
+// FDEEP_SELECT_KERNEL returns the one for the CPU the program is running on.
+#if FDEEP_MULTIVERSIONING_ENABLED
+#define FDEEP_KERNEL_VARIANTS(TEMPLATE, RET, NAME, PARAMS, ARGS) \
+    TEMPLATE inline RET NAME##_baseline PARAMS { return NAME##_kernel ARGS; } \
+    TEMPLATE FDEEP_TARGET_SSE42 inline RET NAME##_sse42 PARAMS { return NAME##_kernel ARGS; } \
+    TEMPLATE FDEEP_TARGET_AVX2 inline RET NAME##_avx2 PARAMS { return NAME##_kernel ARGS; } \
+    TEMPLATE FDEEP_TARGET_AVX512F inline RET NAME##_avx512f PARAMS { return NAME##_kernel ARGS; }
+#define FDEEP_SELECT_KERNEL(TYPE, NAME) \
+    ::fdeep::internal::select_kernel<TYPE>(&NAME##_baseline, &NAME##_sse42, &NAME##_avx2, &NAME##_avx512f)
+#else
+#define FDEEP_KERNEL_VARIANTS(TEMPLATE, RET, NAME, PARAMS, ARGS) \
+    TEMPLATE inline RET NAME##_baseline PARAMS { return NAME##_kernel ARGS; }
+#define FDEEP_SELECT_KERNEL(TYPE, NAME) static_cast<TYPE>(&NAME##_baseline)
+#endif
+
 namespace fdeep {
 namespace internal {
 
@@ -71,7 +106,7 @@ namespace internal {
     typedef std::vector<float_type> float_vec_unaligned;
 
     template <typename T>
-    using aligned_vector = std::vector<T, Eigen::aligned_allocator<T>>;
+    using aligned_vector = std::vector<T, accounting_allocator<T>>;
 
     typedef aligned_vector<float_type> float_vec;
     typedef fplus::shared_ref<float_vec> shared_float_vec;
@@ -8,11 +8,14 @@
 
 #include "fdeep/common.hpp"
 
+#include "fdeep/block_sparse.hpp"
 #include "fdeep/filter.hpp"
 
 #include <algorithm>
 #include <cassert>
 #include <cstddef>
+#include <string>
+#include <utility>
 #include <vector>
 
 namespace fdeep {
@@ -24,11 +27,49 @@ namespace internal {
         float_vec biases_;
         bool use_bias_;
         tensor filter_mats_;
+        // Applied while gathering the input, so the filters stay undilated.
+        shape2 dilation_rate_;
+        // The (out_depth x f_width * f_depth) matrix of every filter row in blocked-sparse format,
+        // if the filters are pruned enough (and not dilated horizontally), otherwise empty.
+        std::vector<block_sparse_matrix> sparse_filter_mats_;
     };
 
+    inline shape2 dilated_filter_size(
+        const convolution_filter_matrices& filter_mat)
+    {
+        return shape2(
+            (filter_mat.filter_shape_.height_ - 1) * filter_mat.dilation_rate_.height_ + 1,
+            (filter_mat.filter_shape_.width_ - 1) * filter_mat.dilation_rate_.width_ + 1);
+    }
+
+    inline std::vector<block_sparse_matrix> create_sparse_filter_matrices(
+        const tensor& filter_mats,
+        const tensor_shape& filter_shape,
+        std::size_t filter_count,
+        const shape2& dilation_rate)
+    {
+        if (dilation_rate.width_ != 1) {
+            return {};
+        }
+        std::vector<block_sparse_matrix> result;
+        for (std::size_t y_filt = 0; y_filt < filter_shape.height_; ++y_filt) {
+            const auto sparse = create_block_sparse_matrix(
+                &filter_mats.get_ref_ignore_rank(tensor_pos(0, y_filt, 0, 0, 0)),
+                filter_count, filter_shape.width_ * filter_shape.depth_, filter_count);
+            if (sparse.is_nothing()) {
+                return {};
+            }
+            result.push_back(sparse.unsafe_get_just());
+        }
+        return result;
+    }
+
     inline convolution_filter_matrices generate_im2col_filter_matrix(
-        const std::vector<filter>& filters)
+        const std::vector<filter>& filters,
+        const shape2& dilation_rate = shape2(1, 1))
     {
+        assertion(dilation_rate.height_ >= 1 && dilation_rate.width_ >= 1,
+            "invalid dilation rate");
         assertion(fplus::all_the_same_on(
                       fplus_c_mem_fn_t(filter, shape, tensor_shape), filters),
             "all filters must have the same shape");
@@ -56,7 +97,8 @@ namespace internal {
             }
         }
 
-        return { shape, filters.size(), biases, use_bias, filter_mats };
+        return { shape, filters.size(), biases, use_bias, filter_mats, dilation_rate,
+            create_sparse_filter_matrices(filter_mats, shape, filters.size(), dilation_rate) };
     }
 
     inline tensor init_conv_output_tensor(
@@ -90,18 +132,30 @@ namespace internal {
         std::size_t strides_x,
         std::size_t out_width,
         std::size_t y,
-        std::size_t y_filt)
+        std::size_t y_filt,
+        std::size_t x = 0)
     {
         // To avoid using too much RAM, the input tensor is not materializezd
         // as an actual im2col matrix, but instead the too-small outer stride
         // of the matrix mapping is utilized to achieve the overlap the receptive fields.
         return Eigen::Map<ColMajorMatrixXf, Eigen::Unaligned, Eigen::OuterStride<>>(
-            const_cast<float_type*>(&in.get_ref_ignore_rank(tensor_pos(0, 0, y + y_filt, 0, 0))),
+            const_cast<float_type*>(&in.get_ref_ignore_rank(tensor_pos(0, 0, y + y_filt, x, 0))),
             static_cast<EigenIndex>(f_width * f_depth),
             static_cast<EigenIndex>(out_width),
             Eigen::OuterStride<>(static_cast<EigenIndex>(f_depth * strides_x)));
     }
 
+    // The same im2col matrix for gemm_accumulate, which only needs its first value,
+    // because the distance between its columns is (f_depth * strides_x).
+    inline const float_type* get_im2col_start(
+        const tensor& in,
+        std::size_t y,
+        std::size_t y_filt,
+        std::size_t x = 0)
+    {
+        return &in.get_ref_ignore_rank(tensor_pos(0, 0, y + y_filt, x, 0));
+    }
+
     // Special version for convolution with strides_x == 1 and strides_y == 1.
     // Reduces the forward-pass runtime of VGG19 about 15%, by using fewer but larger GEMMs.
     inline tensor convolve_accumulative_s1x1(
@@ -115,15 +169,18 @@ namespace internal {
         const auto f_width = filter_mat.filter_shape_.width_;
         const auto f_depth = filter_mat.filter_shape_.depth_;
         const auto out_depth = filter_mat.filter_count_;
+        const auto dilation_y = filter_mat.dilation_rate_.height_;
+        const auto dilation_x = filter_mat.dilation_rate_.width_;
+        const auto f_width_dilated = dilated_filter_size(filter_mat).width_;
 
         assertion(f_depth == in.shape().depth_, "filter depth does not match input");
         assertion(filter_mats.shape().size_dim_4_ == f_height, "incorrect number of filter levels in y direction");
-        assertion(out_width == (in.shape().width_ - f_width) + 1, "output width does not match");
+        assertion(out_width == (in.shape().width_ - f_width_dilated) + 1, "output width does not match");
         assertion(out_depth == filter_mat.biases_.size(), "invlid bias count");
 
         tensor output = init_conv_output_tensor(out_height, out_width, out_depth, in.shape().rank(), filter_mat);
 
-        const std::size_t out_width_temp = out_width + f_width - 1;
+        const std::size_t out_width_temp = out_width + f_width_dilated - 1;
         tensor output_temp(tensor_shape_with_changed_rank(
                                tensor_shape(out_height, out_width_temp, out_depth),
                                in.shape().rank()),
@@ -131,20 +188,24 @@ namespace internal {
 
         const auto mapping_width = out_width_temp * (out_height - 1) + out_width;
 
-        for (std::size_t y_filt = 0; y_filt < f_height; ++y_filt) {
-            const Eigen::Map<ColMajorMatrixXf, Eigen::Unaligned>
-                filter(const_cast<float_type*>(&filter_mats.get_ref_ignore_rank(tensor_pos(0, y_filt, 0, 0, 0))),
-                    static_cast<EigenIndex>(out_depth),
-                    static_cast<EigenIndex>(f_width * f_depth));
-
-            const auto input = get_im2col_mapping(in, f_width, f_depth, 1, mapping_width, 0, y_filt);
-
-            Eigen::Map<Eigen::Matrix<float_type, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned>
-                output_temp_map(&output_temp.get_ref_ignore_rank(tensor_pos(0, 0, 0, 0, 0)),
-                    static_cast<EigenIndex>(out_depth),
-                    static_cast<EigenIndex>(mapping_width));
+        float_type* output_temp_ptr = &output_temp.get_ref_ignore_rank(tensor_pos(0, 0, 0, 0, 0));
 
-            output_temp_map.noalias() += filter * input;
+        for (std::size_t y_filt = 0; y_filt < f_height; ++y_filt) {
+            const float_type* filter_ptr = &filter_mats.get_ref_ignore_rank(tensor_pos(0, y_filt, 0, 0, 0));
+            if (dilation_x == 1) {
+                gemm_accumulate(out_depth, mapping_width, f_width * f_depth,
+                    filter_ptr, out_depth, get_im2col_start(in, 0, y_filt * dilation_y), f_depth,
+                    output_temp_ptr, out_depth);
+            } else {
+                // The filter columns are not adjacent in the input,
+                // so every one of them gets its own (smaller) GEMM.
+                for (std::size_t x_filt = 0; x_filt < f_width; ++x_filt) {
+                    gemm_accumulate(out_depth, mapping_width, f_depth,
+                        filter_ptr + x_filt * f_depth * out_depth, out_depth,
+                        get_im2col_start(in, 0, y_filt * dilation_y, x_filt * dilation_x), f_depth,
+                        output_temp_ptr, out_depth);
+                }
+            }
         }
 
         // Dropping the superfluous results from "between" the rows.
@@ -159,13 +220,141 @@ namespace internal {
         return output;
     }
 
-    inline tensor convolve_accumulative(
+    // Whether the convolution can be done by convolve_pointwise.
+    inline bool is_pointwise_convolution(
+        const convolution_filter_matrices& filter_mat, const shape2& strides)
+    {
+        return filter_mat.filter_shape_.height_ == 1 && filter_mat.filter_shape_.width_ == 1
+            && strides == shape2(1, 1);
+    }
+
+    // Convolution with a 1x1 filter and strides of 1, which never needs padding,
+    // as a single (filters x depth) * (depth x pixels) GEMM directly into the output,
+    // followed by adding the biases.
+    // The results equal the ones of convolve_accumulative_s1x1 up to float rounding.
+    inline tensor convolve_pointwise(
+        const convolution_filter_matrices& filter_mat,
+        const tensor& in)
+    {
+        const auto f_depth = filter_mat.filter_shape_.depth_;
+        const auto out_depth = filter_mat.filter_count_;
+        assertion(f_depth == in.shape().depth_, "filter depth does not match input");
+        assertion(out_depth == filter_mat.biases_.size(), "invlid bias count");
+
+        const auto pixels = static_cast<EigenIndex>(in.shape().height_ * in.shape().width_);
+        tensor output(tensor_shape_with_changed_rank(
+                          tensor_shape(in.shape().height_, in.shape().width_, out_depth),
+                          in.shape().rank()),
+            static_cast<float_type>(0));
+
+        gemm_accumulate(out_depth, static_cast<std::size_t>(pixels), f_depth,
+            filter_mat.filter_mats_.as_vector()->data(), out_depth,
+            in.as_vector()->data(), f_depth,
+            output.as_vector()->data(), out_depth);
+
+        if (filter_mat.use_bias_) {
+            Eigen::Map<ColMajorMatrixXf, Eigen::Unaligned>
+                output_map(output.as_vector()->data(),
+                    static_cast<EigenIndex>(out_depth), pixels);
+            const Eigen::Map<const Eigen::Matrix<float_type, Eigen::Dynamic, 1>, Eigen::Unaligned>
+                biases(filter_mat.biases_.data(), static_cast<EigenIndex>(out_depth));
+            output_map.colwise() += biases;
+        }
+        return output;
+    }
+
+    // Whether the filters are pruned so much, that the automatic kernel is the sparse one.
+    // This only depends on the filters, so tiled execution uses the same kernel.
+    inline bool prefer_sparse_convolution(const convolution_filter_matrices& filter_mat)
+    {
+        return !filter_mat.sparse_filter_mats_.empty()
+            && fplus::all_by(prefer_block_sparse_gemm, filter_mat.sparse_filter_mats_);
+    }
+
+    // Special version for filters stored in blocked-sparse format,
+    // skipping the all-zero blocks with one sparse product per output row and filter row.
+    // Works for all strides, and every output value only depends on its own inputs.
+    inline tensor convolve_accumulative_sparse(
         std::size_t out_height,
         std::size_t out_width,
         std::size_t strides_y,
         std::size_t strides_x,
         const convolution_filter_matrices& filter_mat,
         const tensor& in)
+    {
+        const auto f_height = filter_mat.filter_shape_.height_;
+        const auto f_depth = filter_mat.filter_shape_.depth_;
+        const auto out_depth = filter_mat.filter_count_;
+        const auto dilation_y = filter_mat.dilation_rate_.height_;
+
+        assertion(f_depth == in.shape().depth_, "filter depth does not match input");
+        assertion(filter_mat.sparse_filter_mats_.size() == f_height, "filters are not stored sparse");
+        assertion(out_depth == filter_mat.biases_.size(), "invlid bias count");
+
+        tensor output = init_conv_output_tensor(out_height, out_width, out_depth, in.shape().rank(), filter_mat);
+
+        for (std::size_t y_out = 0; y_out < out_height; ++y_out) {
+            for (std::size_t y_filt = 0; y_filt < f_height; ++y_filt) {
+                const std::size_t y = y_out * strides_y + y_filt * dilation_y;
+                block_sparse_multiply_add(filter_mat.sparse_filter_mats_[y_filt],
+                    &in.get_ref_ignore_rank(tensor_pos(0, 0, y, 0, 0)), f_depth * strides_x, out_width,
+                    &output.get_ref_ignore_rank(tensor_pos(0, 0, y_out, 0, 0)), out_depth);
+            }
+        }
+
+        return output;
+    }
+
+    // The implementations convolve can use.
+    // rows: one GEMM per output row and filter row, works for all strides.
+    // s1x1: one larger GEMM per filter row, only for strides of 1.
+    // pointwise: convolve_pointwise, only for 1x1 filters with strides of 1.
+    // sparse: convolve_accumulative_sparse, only for filters stored in blocked-sparse format.
+    // automatic: sparse for heavily pruned filters, otherwise pointwise or s1x1 whenever possible.
+    enum class conv_kernel { automatic,
+        rows,
+        s1x1,
+        pointwise,
+        sparse };
+
+    inline std::string show_conv_kernel(conv_kernel kernel)
+    {
+        if (kernel == conv_kernel::rows) {
+            return "rows";
+        }
+        if (kernel == conv_kernel::s1x1) {
+            return "s1x1";
+        }
+        if (kernel == conv_kernel::pointwise) {
+            return "pointwise";
+        }
+        if (kernel == conv_kernel::sparse) {
+            return "sparse";
+        }
+        return "automatic";
+    }
+
+    inline conv_kernel create_conv_kernel(const std::string& name)
+    {
+        return fplus::throw_on_nothing(error("unknown convolution kernel: " + name),
+            fplus::choose<std::string, conv_kernel>({
+                                                        { std::string("automatic"), conv_kernel::automatic },
+                                                        { std::string("rows"), conv_kernel::rows },
+                                                        { std::string("s1x1"), conv_kernel::s1x1 },
+                                                        { std::string("pointwise"), conv_kernel::pointwise },
+                                                        { std::string("sparse"), conv_kernel::sparse },
+                                                    },
+                name));
+    }
+
+    inline tensor convolve_accumulative(
+        std::size_t out_height,
+        std::size_t out_width,
+        std::size_t strides_y,
+        std::size_t strides_x,
+        const convolution_filter_matrices& filter_mat,
+        const tensor& in,
+        conv_kernel kernel = conv_kernel::automatic)
     {
         // Using the im2col method, the convolution is expressed as GEMMs for performance.
         // https://stackoverflow.com/questions/16798888/2-d-convolution-as-a-matrix-matrix-multiplication
@@ -176,31 +365,45 @@ namespace internal {
         const auto f_width = filter_mat.filter_shape_.width_;
         const auto f_depth = filter_mat.filter_shape_.depth_;
         const auto out_depth = filter_mat.filter_count_;
+        const auto dilation_y = filter_mat.dilation_rate_.height_;
+        const auto dilation_x = filter_mat.dilation_rate_.width_;
+        const auto f_size_dilated = dilated_filter_size(filter_mat);
 
         assertion(f_depth == in.shape().depth_, "filter depth does not match input");
         assertion(filter_mats.shape().size_dim_4_ == f_height, "incorrect number of filter levels in y direction");
-        assertion(out_width == (in.shape().width_ - f_width) / strides_x + 1, "output width does not match");
+        assertion(out_width == (in.shape().width_ - f_size_dilated.width_) / strides_x + 1, "output width does not match");
         assertion(out_depth == filter_mat.biases_.size(), "invlid bias count");
 
-        if (strides_x == 1 && strides_y == 1) {
+        assertion(kernel != conv_kernel::sparse || !filter_mat.sparse_filter_mats_.empty(),
+            "sparse convolution kernel needs filters stored in blocked-sparse format");
+        if (kernel == conv_kernel::sparse || (kernel == conv_kernel::automatic && prefer_sparse_convolution(filter_mat))) {
+            return convolve_accumulative_sparse(out_height, out_width, strides_y, strides_x, filter_mat, in);
+        }
+
+        const bool unit_strides = strides_x == 1 && strides_y == 1;
+        assertion(kernel != conv_kernel::s1x1 || unit_strides, "s1x1 convolution kernel needs strides of 1");
+        if (kernel == conv_kernel::s1x1 || (kernel == conv_kernel::automatic && unit_strides)) {
             return convolve_accumulative_s1x1(out_height, out_width, filter_mat, in);
         }
 
         tensor output = init_conv_output_tensor(out_height, out_width, out_depth, in.shape().rank(), filter_mat);
 
         for (std::size_t y_filt = 0; y_filt < f_height; ++y_filt) {
-            const Eigen::Map<ColMajorMatrixXf, Eigen::Unaligned>
-                filter(const_cast<float_type*>(&filter_mats.get_ref_ignore_rank(tensor_pos(0, y_filt, 0, 0, 0))),
-                    static_cast<EigenIndex>(out_depth),
-                    static_cast<EigenIndex>(f_width * f_depth));
-            for (std::size_t y = 0, y_out = 0; y < in.shape().height_ + 1 - f_height; y += strides_y, ++y_out) {
-                const auto input = get_im2col_mapping(in, f_width, f_depth, strides_x, out_width, y, y_filt);
-                Eigen::Map<ColMajorMatrixXf, Eigen::Unaligned>
-                    output_map(&output.get_ref_ignore_rank(tensor_pos(0, 0, y_out, 0, 0)),
-                        static_cast<EigenIndex>(out_depth),
-                        static_cast<EigenIndex>(out_width));
-
-                output_map.noalias() += filter * input;
+            const float_type* filter_ptr = &filter_mats.get_ref_ignore_rank(tensor_pos(0, y_filt, 0, 0, 0));
+            for (std::size_t y = 0, y_out = 0; y < in.shape().height_ + 1 - f_size_dilated.height_; y += strides_y, ++y_out) {
+                float_type* output_ptr = &output.get_ref_ignore_rank(tensor_pos(0, 0, y_out, 0, 0));
+                if (dilation_x == 1) {
+                    gemm_accumulate(out_depth, out_width, f_width * f_depth,
+                        filter_ptr, out_depth, get_im2col_start(in, y, y_filt * dilation_y), f_depth * strides_x,
+                        output_ptr, out_depth);
+                } else {
+                    for (std::size_t x_filt = 0; x_filt < f_width; ++x_filt) {
+                        gemm_accumulate(out_depth, out_width, f_depth,
+                            filter_ptr + x_filt * f_depth * out_depth, out_depth,
+                            get_im2col_start(in, y, y_filt * dilation_y, x_filt * dilation_x), f_depth * strides_x,
+                            output_ptr, out_depth);
+                    }
+                }
             }
         }
 
@@ -302,13 +505,22 @@ namespace internal {
         const shape2& strides,
         const padding& pad_type,
         const convolution_filter_matrices& filter_mat,
-        const tensor& input)
+        const tensor& input,
+        conv_kernel kernel = conv_kernel::automatic)
     {
         assertion(filter_mat.filter_shape_.depth_ == input.shape().depth_,
             "invalid filter depth");
 
+        assertion(kernel != conv_kernel::pointwise || is_pointwise_convolution(filter_mat, strides),
+            "pointwise convolution kernel needs a 1x1 filter and strides of 1");
+        if (kernel == conv_kernel::pointwise
+            || (kernel == conv_kernel::automatic && is_pointwise_convolution(filter_mat, strides)
+                && !prefer_sparse_convolution(filter_mat))) {
+            return convolve_pointwise(filter_mat, input);
+        }
+
         const auto conv_cfg = preprocess_convolution(
-            filter_mat.filter_shape_.without_depth(),
+            dilated_filter_size(filter_mat),
             strides, pad_type, input.shape().height_, input.shape().width_, false);
 
         // The padding step usually (on a VGG19 net) only takes about 1% of the overall runtime.
@@ -322,9 +534,116 @@ namespace internal {
             conv_cfg.out_height_, conv_cfg.out_width_,
             strides.height_, strides.width_,
             filter_mat,
-            in_padded);
+            in_padded,
+            kernel);
+    }
+
+    // Padding at the top and output height of a convolution
+    // on an input with the given number of rows.
+    inline std::pair<std::size_t, std::size_t> preprocess_convolution_rows(
+        const shape2& filter_shape,
+        const shape2& strides,
+        padding pad_type,
+        std::size_t input_shape_height)
+    {
+        // The width is irrelevant for the vertical results, any valid one will do.
+        const auto conv_cfg = preprocess_convolution(filter_shape, strides, pad_type,
+            input_shape_height, filter_shape.width_, false);
+        return std::make_pair(conv_cfg.pad_top_, conv_cfg.out_height_);
     }
 
+    // Pads a band of input rows (the ones the output rows [out_begin, out_end)
+    // depend on, clipped to the input) for a convolution without further padding.
+    // Zero rows are only added where the band reaches beyond the input borders,
+    // and the columns are padded as for the whole input.
+    inline tensor pad_row_band(const convolution_config& conv_cfg,
+        std::size_t filter_height, std::size_t strides_y,
+        std::size_t out_begin, std::size_t out_end,
+        const tensor& in_rows)
+    {
+        const std::size_t first_row = out_begin * strides_y;
+        const std::size_t padded_height = (out_end - 1 - out_begin) * strides_y + filter_height;
+        const std::size_t pad_top = conv_cfg.pad_top_ > first_row ? conv_cfg.pad_top_ - first_row : 0;
+        assertion(pad_top + in_rows.shape().height_ <= padded_height, "invalid number of input rows");
+        const std::size_t pad_bottom = padded_height - pad_top - in_rows.shape().height_;
+        return pad_tensor(0, 0, 0,
+            pad_top, pad_bottom, conv_cfg.pad_left_, conv_cfg.pad_right_,
+            in_rows);
+    }
+
+    // The output rows [out_begin, out_end) of convolve on an input with in_height rows,
+    // computed from only the input rows they depend on.
+    inline tensor convolve_rows(
+        const shape2& strides,
+        const padding& pad_type,
+        const convolution_filter_matrices& filter_mat,
+        const tensor& in_rows,
+        std::size_t in_height,
+        std::size_t out_begin,
+        std::size_t out_end,
+        conv_kernel kernel = conv_kernel::automatic)
+    {
+        assertion(filter_mat.filter_shape_.depth_ == in_rows.shape().depth_,
+            "invalid filter depth");
+
+        if (kernel == conv_kernel::pointwise
+            || (kernel == conv_kernel::automatic && is_pointwise_convolution(filter_mat, strides))) {
+            // Every output row only depends on the input row at the same position.
+            assertion(in_rows.shape().height_ == out_end - out_begin, "invalid number of input rows");
+            return convolve(strides, pad_type, filter_mat, in_rows, kernel);
+        }
+
+        const auto filter_size = dilated_filter_size(filter_mat);
+        const auto conv_cfg = preprocess_convolution(
+            filter_size, strides, pad_type, in_height, in_rows.shape().width_, false);
+
+        return convolve_accumulative(
+            out_end - out_begin, conv_cfg.out_width_,
+            strides.height_, strides.width_,
+            filter_mat,
+            pad_row_band(conv_cfg, filter_size.height_, strides.height_, out_begin, out_end, in_rows),
+            kernel);
+    }
+
+    // Returns filters that give the same result on x
+    // as the original filters give on (scale * x + offset),
+    // with scale and offset given per input channel (or once for all channels).
+    // Only valid if no zero padding is applied to x, unless all offsets are zero.
+    inline convolution_filter_matrices fold_input_affine_into_filter_matrices(
+        const convolution_filter_matrices& filter_mat,
+        const float_vec& scale, const float_vec& offset)
+    {
+        const auto f_depth = filter_mat.filter_shape_.depth_;
+        const auto out_depth = filter_mat.filter_count_;
+        assertion(scale.size() == offset.size() && (scale.size() == 1 || scale.size() == f_depth),
+            "invalid number of channels for folding an affine transformation into filters");
+
+        tensor filter_mats(filter_mat.filter_mats_.shape(), static_cast<float_type>(0));
+        float_vec biases = filter_mat.biases_;
+        const float_type* src = filter_mat.filter_mats_.as_vector()->data();
+        float_type* dst = filter_mats.as_vector()->data();
+        const std::size_t taps = filter_mat.filter_shape_.height_ * filter_mat.filter_shape_.width_;
+        for (std::size_t tap = 0; tap < taps; ++tap) {
+            for (std::size_t z = 0; z < f_depth; ++z) {
+                const float_type s = scale.size() == 1 ? scale.front() : scale[z];
+                const float_type o = offset.size() == 1 ? offset.front() : offset[z];
+                for (std::size_t n = 0; n < out_depth; ++n) {
+                    const std::size_t idx = (tap * f_depth + z) * out_depth + n;
+                    dst[idx] = src[idx] * s;
+                    biases[n] += src[idx] * o;
+                }
+            }
+        }
+
+        // The offset always ends up in the biases, even if it cancels out.
+        return { filter_mat.filter_shape_, out_depth, biases, true, filter_mats, filter_mat.dilation_rate_,
+            create_sparse_filter_matrices(filter_mats, filter_mat.filter_shape_, out_depth, filter_mat.dilation_rate_) };
+    }
+
+    // The transposed convolution is computed directly, i.e.,
+    // without inserting (strides - 1) zeros between the input values first.
+    // Every filter tap is one GEMM over all input pixels,
+    // and its results are scattered (col2im) into the output.
     inline tensor convolve_transposed(
         const shape2& strides,
         const padding& pad_type,
@@ -333,23 +652,89 @@ namespace internal {
     {
         assertion(filter_mat.filter_shape_.depth_ == input.shape().depth_,
             "invalid filter depth");
+        assertion(input.shape().rank() <= 3, "invalid rank for transposed convolution");
+        assertion(pad_type != padding::causal, "causal padding not supported for transposed convolution");
 
-        const auto input_dilated = dilate_tensor(strides, input, pad_type == padding::same);
+        const tensor& filter_mats = filter_mat.filter_mats_;
+        const auto f_height = filter_mat.filter_shape_.height_;
+        const auto f_width = filter_mat.filter_shape_.width_;
+        const auto f_depth = filter_mat.filter_shape_.depth_;
+        const auto out_depth = filter_mat.filter_count_;
+        const auto dilation_y = filter_mat.dilation_rate_.height_;
+        const auto dilation_x = filter_mat.dilation_rate_.width_;
+        const auto f_size_dilated = dilated_filter_size(filter_mat);
+        const std::size_t in_height = input.shape().height_;
+        const std::size_t in_width = input.shape().width_;
+        const std::size_t strides_y = strides.height_;
+        const std::size_t strides_x = strides.width_;
+
+        // Size and leading zeros the input would have when dilated with the strides.
+        const bool trailing_zeros = pad_type == padding::same;
+        const std::size_t expansion_y = trailing_zeros ? strides_y - 1 : 0;
+        const std::size_t expansion_x = trailing_zeros ? strides_x - 1 : 0;
+        const std::size_t in_height_dilated = (in_height - 1) * strides_y + 1 + expansion_y;
+        const std::size_t in_width_dilated = (in_width - 1) * strides_x + 1 + expansion_x;
 
         const auto conv_cfg = preprocess_convolution(
-            filter_mat.filter_shape_.without_depth(),
-            shape2(1, 1), pad_type, input_dilated.shape().height_, input_dilated.shape().width_,
-            true);
+            f_size_dilated, shape2(1, 1), pad_type,
+            in_height_dilated, in_width_dilated, true);
 
-        const auto in_padded = pad_tensor(0, 0, 0,
-            conv_cfg.pad_top_, conv_cfg.pad_bottom_, conv_cfg.pad_left_, conv_cfg.pad_right_,
-            input_dilated);
+        const std::size_t out_height = conv_cfg.out_height_;
+        const std::size_t out_width = conv_cfg.out_width_;
 
-        return convolve_accumulative(
-            conv_cfg.out_height_, conv_cfg.out_width_,
-            1, 1,
-            filter_mat,
-            in_padded);
+        // Input pixel (y, x) contributes with filter tap (y_filt, x_filt) to
+        // output pixel (y * strides_y + y_filt * dilation_y + offset_y, ...).
+        const int offset_y = static_cast<int>(conv_cfg.pad_top_ + expansion_y - expansion_y / 2)
+            - static_cast<int>(f_size_dilated.height_ - 1);
+        const int offset_x = static_cast<int>(conv_cfg.pad_left_ + expansion_x - expansion_x / 2)
+            - static_cast<int>(f_size_dilated.width_ - 1);
+
+        tensor output = init_conv_output_tensor(out_height, out_width, out_depth, input.shape().rank(), filter_mat);
+
+        ColMajorMatrixXf tap_result(static_cast<EigenIndex>(out_depth),
+            static_cast<EigenIndex>(in_height * in_width));
+
+        for (std::size_t y_filt = 0; y_filt < f_height; ++y_filt) {
+            for (std::size_t x_filt = 0; x_filt < f_width; ++x_filt) {
+                tap_result.setZero();
+                gemm_accumulate(out_depth, in_height * in_width, f_depth,
+                    &filter_mats.get_ref_ignore_rank(tensor_pos(0, y_filt, x_filt, 0, 0)), out_depth,
+                    input.as_vector()->data(), f_depth, tap_result.data(), out_depth);
+
+                const int shift_y = static_cast<int>(y_filt * dilation_y) + offset_y;
+                const int shift_x = static_cast<int>(x_filt * dilation_x) + offset_x;
+                const int s_x = static_cast<int>(strides_x);
+
+                // Range of input columns landing inside the output.
+                const int x_begin = shift_x < 0 ? (-shift_x + s_x - 1) / s_x : 0;
+                const int x_end = static_cast<int>(out_width) - shift_x <= 0
+                    ? 0
+                    : std::min(static_cast<int>(in_width),
+                        (static_cast<int>(out_width) - 1 - shift_x) / s_x + 1);
+                if (x_begin >= x_end) {
+                    continue;
+                }
+
+                for (std::size_t y = 0; y < in_height; ++y) {
+                    const int y_out = static_cast<int>(y * strides_y) + shift_y;
+                    if (y_out < 0 || y_out >= static_cast<int>(out_height)) {
+                        continue;
+                    }
+                    Eigen::Map<ColMajorMatrixXf, Eigen::Unaligned, Eigen::OuterStride<>>
+                        output_map(&output.get_ref_ignore_rank(tensor_pos(0, 0,
+                                       static_cast<std::size_t>(y_out),
+                                       static_cast<std::size_t>(x_begin * s_x + shift_x), 0)),
+                            static_cast<EigenIndex>(out_depth),
+                            static_cast<EigenIndex>(x_end - x_begin),
+                            Eigen::OuterStride<>(static_cast<EigenIndex>(out_depth * strides_x)));
+                    output_map += tap_result.middleCols(
+                        static_cast<EigenIndex>(y * in_width + static_cast<std::size_t>(x_begin)),
+                        static_cast<EigenIndex>(x_end - x_begin));
+                }
+            }
+        }
+
+        return output;
     }
 
 }
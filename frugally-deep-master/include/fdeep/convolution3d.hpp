@@ -8,11 +8,20 @@
 
 #include "fdeep/common.hpp"
 
+#include "fdeep/cancellation.hpp"
 #include "fdeep/filter.hpp"
+#include "fdeep/worker_pool.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <cstddef>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 namespace fdeep {
@@ -115,5 +124,229 @@ namespace internal {
             out_size_d4_size_t, out_height_size_t, out_width_size_t };
     }
 
+    // The number of parts to split slices of a volume into for for_slices_parallelly:
+    // Up to one per thread of the worker pool, but only as many
+    // as there is enough work (in multiply-adds or comparable steps) for.
+    inline std::size_t slice_thread_count(std::size_t slices, std::size_t work_per_slice)
+    {
+        const std::size_t min_work_per_thread = 1 << 22;
+        return std::max<std::size_t>(1,
+            std::min({ current_or_global_worker_pool().thread_count(), slices,
+                slices * work_per_slice / min_work_per_thread }));
+    }
+
+    // Runs f(slice, part) for all slices in [0, slices), split into the given number
+    // of parts of consecutive slices. Every part runs in one thread,
+    // so f can use per-part buffers.
+    // The calling thread takes parts too, and the others run on the worker pool
+    // of the calling thread (e.g., the one of its NUMA node) or the global one.
+    // Parts are claimed by whoever gets to them first, so this does not wait
+    // for busy pool threads, which also makes it safe to call from a pool thread.
+    // The cancellation token of the calling thread is checked before every slice.
+    inline void for_slices_parallelly(std::size_t slices, std::size_t parts,
+        const std::function<void(std::size_t, std::size_t)>& f)
+    {
+        struct shared_state {
+            std::atomic<std::size_t> next_part_;
+            std::size_t done_parts_;
+            std::exception_ptr error_;
+            std::mutex mutex_;
+            std::condition_variable all_done_;
+        };
+        const auto state = std::make_shared<shared_state>();
+        state->next_part_ = 0;
+        state->done_parts_ = 0;
+        const cancellation_token* token = current_cancellation_token();
+        // Only dereferences token and f while a part is left,
+        // and the calling thread waits for all parts to be done.
+        const auto run_parts = [state, token, &f, slices, parts]() {
+            for (std::size_t part = state->next_part_++; part < parts; part = state->next_part_++) {
+                std::exception_ptr error;
+                try {
+                    for (std::size_t slice = part * slices / parts; slice < (part + 1) * slices / parts; ++slice) {
+                        if (token != nullptr && token->is_cancelled()) {
+                            throw prediction_cancelled();
+                        }
+                        f(slice, part);
+                    }
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(state->mutex_);
+                if (error && !state->error_) {
+                    state->error_ = error;
+                }
+                if (++state->done_parts_ == parts) {
+                    state->all_done_.notify_all();
+                }
+            }
+        };
+        auto& pool = current_or_global_worker_pool();
+        for (std::size_t helper = 1; helper < parts; ++helper) {
+            pool.submit(run_parts);
+        }
+        run_parts();
+        std::unique_lock<std::mutex> lock(state->mutex_);
+        state->all_done_.wait(lock, [&state, parts]() { return state->done_parts_ == parts; });
+        if (state->error_) {
+            std::rethrow_exception(state->error_);
+        }
+    }
+
+    // The filters of a 3D convolution as one (filters x patch volume) column-major matrix,
+    // with a patch ordered like the input (dimension 4, height, width, depth).
+    struct convolution3d_filter_matrix {
+        shape3 filter_size_;
+        shape3 dilation_rate_;
+        std::size_t filter_depth_;
+        std::size_t filter_count_;
+        tensor filter_mat_;
+        bool use_bias_;
+        float_vec biases_;
+    };
+
+    // Weights ordered like the ones of the 2D convolutions,
+    // i.e., (filters, dimension 4, height, width, depth).
+    inline convolution3d_filter_matrix generate_convolution3d_filter_matrix(
+        const shape3& filter_size, const shape3& dilation_rate, std::size_t filter_count,
+        const float_vec& weights, const float_vec& bias)
+    {
+        assertion(filter_count > 0 && filter_size.volume() > 0, "invalid filter size");
+        assertion(weights.size() % (filter_size.volume() * filter_count) == 0, "invalid number of weights");
+        assertion(bias.size() == filter_count, "invalid number of biases");
+        const std::size_t patch_volume = weights.size() / filter_count;
+        float_vec mat(weights.size());
+        for (std::size_t f = 0; f < filter_count; ++f) {
+            for (std::size_t i = 0; i < patch_volume; ++i) {
+                mat[i * filter_count + f] = weights[f * patch_volume + i];
+            }
+        }
+        const bool use_bias = fplus::any_by([](float_type b) { return b != 0; }, bias);
+        return { filter_size, dilation_rate, patch_volume / filter_size.volume(), filter_count,
+            tensor(tensor_shape(mat.size()), std::move(mat)), use_bias, bias };
+    }
+
+    inline shape3 dilated_filter_size_3d(const convolution3d_filter_matrix& filter_mat)
+    {
+        const auto& f = filter_mat.filter_size_;
+        const auto& d = filter_mat.dilation_rate_;
+        return shape3((f.size_dim_4_ - 1) * d.size_dim_4_ + 1,
+            (f.height_ - 1) * d.height_ + 1, (f.width_ - 1) * d.width_ + 1);
+    }
+
+    // Output rows processed by one GEMM are limited to about this patch matrix size.
+    const std::size_t convolution3d_patch_block_floats = 1 << 18;
+
+    // im2col for a block of output rows of one output depth slice,
+    // reading the input directly (no padded copy of the volume),
+    // with the positions outside of the input written as zeros.
+    // So only the patches of the block are ever in memory, not the ones of the whole volume.
+    inline void fill_convolution3d_patches(const convolution3d_filter_matrix& filter_mat,
+        const convolution3d_config& cfg, const shape3& strides, const tensor& in,
+        std::size_t out_d4, std::size_t out_y_begin, std::size_t out_y_end,
+        float_type* patches)
+    {
+        const auto& f = filter_mat.filter_size_;
+        const auto& dil = filter_mat.dilation_rate_;
+        const std::size_t depth = in.shape().depth_;
+        const std::size_t in_d4s = in.shape().size_dim_4_;
+        const std::size_t in_height = in.shape().height_;
+        const std::size_t in_width = in.shape().width_;
+        const std::size_t window_width = f.width_ * depth;
+        const float_type* in_ptr = in.as_vector()->data();
+        const auto in_pos = [&](std::size_t out_idx, std::size_t stride, std::size_t pad,
+                                std::size_t tap, std::size_t dilation) {
+            return static_cast<std::ptrdiff_t>(out_idx * stride + tap * dilation) - static_cast<std::ptrdiff_t>(pad);
+        };
+        const auto inside = [](std::ptrdiff_t pos, std::size_t size) {
+            return pos >= 0 && pos < static_cast<std::ptrdiff_t>(size);
+        };
+        for (std::size_t y = out_y_begin; y < out_y_end; ++y) {
+            for (std::size_t x = 0; x < cfg.out_width_; ++x) {
+                const auto x_first = in_pos(x, strides.width_, cfg.pad_left_, 0, dil.width_);
+                const auto x_last = in_pos(x, strides.width_, cfg.pad_left_, f.width_ - 1, dil.width_);
+                const bool contiguous = dil.width_ == 1 && x_first >= 0 && x_last < static_cast<std::ptrdiff_t>(in_width);
+                for (std::size_t fd = 0; fd < f.size_dim_4_; ++fd) {
+                    const auto d4 = in_pos(out_d4, strides.size_dim_4_, cfg.pad_front_, fd, dil.size_dim_4_);
+                    for (std::size_t fy = 0; fy < f.height_; ++fy, patches += window_width) {
+                        const auto in_y = in_pos(y, strides.height_, cfg.pad_top_, fy, dil.height_);
+                        if (!inside(d4, in_d4s) || !inside(in_y, in_height)) {
+                            std::fill_n(patches, window_width, static_cast<float_type>(0));
+                            continue;
+                        }
+                        const float_type* row_ptr = in_ptr
+                            + (static_cast<std::size_t>(d4) * in_height + static_cast<std::size_t>(in_y)) * in_width * depth;
+                        if (contiguous) {
+                            std::memcpy(patches, row_ptr + static_cast<std::size_t>(x_first) * depth,
+                                window_width * sizeof(float_type));
+                            continue;
+                        }
+                        for (std::size_t fx = 0; fx < f.width_; ++fx) {
+                            const auto in_x = in_pos(x, strides.width_, cfg.pad_left_, fx, dil.width_);
+                            if (inside(in_x, in_width)) {
+                                std::memcpy(patches + fx * depth, row_ptr + static_cast<std::size_t>(in_x) * depth,
+                                    depth * sizeof(float_type));
+                            } else {
+                                std::fill_n(patches + fx * depth, depth, static_cast<float_type>(0));
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Every output depth slice is computed in blocks of rows,
+    // each one a (filters x patch volume) * (patch volume x positions) GEMM
+    // straight into the output.
+    // The slices are distributed among the CPU cores.
+    inline tensor convolve_3d(const shape3& strides, padding pad_type,
+        const convolution3d_filter_matrix& filter_mat, const tensor& in)
+    {
+        assertion(filter_mat.filter_depth_ == in.shape().depth_, "filter depth does not match input");
+        const auto cfg = preprocess_convolution_3d(dilated_filter_size_3d(filter_mat), strides, pad_type,
+            in.shape().size_dim_4_, in.shape().height_, in.shape().width_);
+        const std::size_t filters = filter_mat.filter_count_;
+        const std::size_t patch_volume = filter_mat.filter_size_.volume() * filter_mat.filter_depth_;
+        const std::size_t row_positions = cfg.out_width_;
+        const std::size_t block_rows = std::max<std::size_t>(1,
+            std::min(cfg.out_height_, convolution3d_patch_block_floats / std::max<std::size_t>(1, row_positions * patch_volume)));
+
+        tensor out(tensor_shape_with_changed_rank(
+                       tensor_shape(cfg.out_size_d4_, cfg.out_height_, cfg.out_width_, filters),
+                       in.shape().rank()),
+            static_cast<float_type>(0));
+        float_type* out_ptr = out.as_vector()->data();
+
+        const float_type* filter_ptr = filter_mat.filter_mat_.as_vector()->data();
+        const Eigen::Map<const Eigen::Matrix<float_type, Eigen::Dynamic, 1>, Eigen::Unaligned>
+            biases(filter_mat.biases_.data(), static_cast<EigenIndex>(filters));
+
+        const std::size_t slice_positions = cfg.out_height_ * row_positions;
+        const std::size_t parts = slice_thread_count(cfg.out_size_d4_, slice_positions * patch_volume * filters);
+        // One patch matrix per part.
+        std::vector<float_vec> patch_buffers(parts, float_vec(patch_volume * block_rows * row_positions));
+
+        for_slices_parallelly(cfg.out_size_d4_, parts, [&](std::size_t d4, std::size_t part) {
+            float_type* patches_ptr = patch_buffers[part].data();
+            for (std::size_t y = 0; y < cfg.out_height_; y += block_rows) {
+                const std::size_t y_end = std::min(cfg.out_height_, y + block_rows);
+                const std::size_t positions = (y_end - y) * row_positions;
+                fill_convolution3d_patches(filter_mat, cfg, strides, in, d4, y, y_end, patches_ptr);
+                Eigen::Map<ColMajorMatrixXf, Eigen::Unaligned>
+                    output_map(out_ptr + (d4 * slice_positions + y * row_positions) * filters,
+                        static_cast<EigenIndex>(filters), static_cast<EigenIndex>(positions));
+                if (filter_mat.use_bias_) {
+                    output_map.colwise() = biases;
+                } else {
+                    output_map.setZero();
+                }
+                gemm_accumulate(filters, positions, patch_volume,
+                    filter_ptr, filters, patches_ptr, patch_volume, output_map.data(), filters);
+            }
+        });
+        return out;
+    }
+
 }
 }
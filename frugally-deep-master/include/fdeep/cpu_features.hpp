@@ -0,0 +1,154 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include <cstddef>
+#include <string>
+
+namespace fdeep {
+namespace internal {
+
+    // The instruction sets the dispatched kernels are compiled for.
+    enum class instruction_set { baseline,
+        sse42,
+        avx2,
+        avx512f };
+
+    inline std::string show_instruction_set(instruction_set isa)
+    {
+        if (isa == instruction_set::sse42) {
+            return "sse4.2";
+        }
+        if (isa == instruction_set::avx2) {
+            return "avx2";
+        }
+        if (isa == instruction_set::avx512f) {
+            return "avx512f";
+        }
+        return "default";
+    }
+
+    // The most capable of these instruction sets the CPU supports,
+    // determined only once.
+    inline instruction_set dispatched_instruction_set()
+    {
+#if FDEEP_MULTIVERSIONING_ENABLED
+        static const instruction_set isa = []() {
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f")) {
+                return instruction_set::avx512f;
+            }
+            if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+                return instruction_set::avx2;
+            }
+            if (__builtin_cpu_supports("sse4.2")) {
+                return instruction_set::sse42;
+            }
+            return instruction_set::baseline;
+        }();
+        return isa;
+#else
+        return instruction_set::baseline;
+#endif
+    }
+
+    // The variant of a kernel for the dispatched instruction set.
+    template <typename F>
+    F select_kernel(F baseline, F sse42, F avx2, F avx512f)
+    {
+        switch (dispatched_instruction_set()) {
+        case instruction_set::avx512f:
+            return avx512f;
+        case instruction_set::avx2:
+            return avx2;
+        case instruction_set::sse42:
+            return sse42;
+        default:
+            return baseline;
+        }
+    }
+
+    // Width of the SIMD registers Eigen was compiled for, in bytes.
+    inline std::size_t eigen_vector_bytes()
+    {
+#if defined(EIGEN_VECTORIZE_AVX512)
+        return 64;
+#elif defined(EIGEN_VECTORIZE_AVX)
+        return 32;
+#elif defined(EIGEN_VECTORIZE_SSE) || defined(EIGEN_VECTORIZE_NEON)
+        return 16;
+#else
+        return 0;
+#endif
+    }
+
+    // The instruction set the GEMM kernel is dispatched to (see gemm_accumulate).
+    // Eigen's own GEMM (baseline) is used, unless a variant has wider registers.
+    inline instruction_set dispatched_gemm_instruction_set()
+    {
+        const auto isa = dispatched_instruction_set();
+        if (isa == instruction_set::avx512f && eigen_vector_bytes() < 64) {
+            return instruction_set::avx512f;
+        }
+        if ((isa == instruction_set::avx2 || isa == instruction_set::avx512f) && eigen_vector_bytes() < 32) {
+            return instruction_set::avx2;
+        }
+        return instruction_set::baseline;
+    }
+
+    // The most capable instruction set of the CPU, dispatched to or not.
+    inline std::string best_supported_instruction_set()
+    {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return "avx512f";
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return "avx2";
+        }
+        if (__builtin_cpu_supports("sse4.2")) {
+            return "sse4.2";
+        }
+        return "sse2";
+#else
+        return "unknown";
+#endif
+    }
+
+}
+
+struct simd_info {
+    // Best instruction set of the CPU the program is running on.
+    std::string cpu_;
+    // Instruction sets Eigen was compiled for.
+    std::string eigen_;
+    // Version of the dispatched kernels (elementwise activations,
+    // softmax, resizing) selected for this CPU, or "default" if disabled.
+    std::string multiversioned_kernels_;
+    // Version of the dispatched GEMM kernel used for convolutions and dense layers,
+    // or "eigen" if Eigen's own kernels are at least as wide.
+    std::string gemm_kernels_;
+};
+
+// Tells which SIMD instruction sets the kernels use on this machine.
+inline simd_info get_simd_info()
+{
+    const auto gemm = internal::dispatched_gemm_instruction_set();
+    return { internal::best_supported_instruction_set(), Eigen::SimdInstructionSetsInUse(),
+        internal::show_instruction_set(internal::dispatched_instruction_set()),
+        gemm == internal::instruction_set::baseline ? "eigen" : internal::show_instruction_set(gemm) };
+}
+
+inline std::string show_simd_info(const simd_info& info)
+{
+    return "CPU: " + info.cpu_ + ", Eigen kernels: " + info.eigen_ + ", multiversioned kernels: " + info.multiversioned_kernels_ + ", GEMM kernels: " + info.gemm_kernels_;
+}
+
+}
@@ -31,39 +31,37 @@ namespace internal {
         const auto f_width = filter_mat.filter_shape_.width_;
         const auto filters_count = filter_mat.filter_count_;
         const auto out_depth = filter_mat.filter_count_;
+        const auto dilation_y = filter_mat.dilation_rate_.height_;
+        const auto dilation_x = filter_mat.dilation_rate_.width_;
+        const auto f_size_dilated = dilated_filter_size(filter_mat);
 
         assertion(filter_mat.filter_shape_.depth_ == 1, "filter depth must be 1");
         assertion(filters_count == in.shape().depth_, "filter count must match input depth");
         assertion(out_depth == in.shape().depth_, "number of filters does not match input depth");
         assertion(filter_mats.shape().size_dim_4_ == f_height, "incorrect number of filter levels in y direction");
-        assertion(out_width == (in.shape().width_ - f_width) / strides_x + 1, "output width does not match");
+        assertion(out_width == (in.shape().width_ - f_size_dilated.width_) / strides_x + 1, "output width does not match");
         assertion(out_depth == filter_mat.biases_.size(), "invlid bias count");
 
         tensor output = init_conv_output_tensor(out_height, out_width, out_depth, in.shape().rank(), filter_mat);
 
         for (std::size_t y_filt = 0; y_filt < f_height; ++y_filt) {
-            const auto filter = Eigen::Map<ArrayXf1D, Eigen::Unaligned>(
-                const_cast<float_type*>(&filter_mats.get_ref_ignore_rank(tensor_pos(0, y_filt, 0, 0, 0))),
-                static_cast<EigenIndex>(f_width * filters_count));
-
-            for (std::size_t y = 0, y_out = 0; y < in.shape().height_ + 1 - f_height; y += strides_y, ++y_out) {
-                const auto input = get_im2col_mapping(in, f_width, filters_count, strides_x, out_width, y, y_filt).array();
-
-                // Not materialized to save memory and improve performance.
-                const auto coefficient_wise_product = input.colwise() * filter;
-
+            const float_type* filter_ptr = &filter_mats.get_ref_ignore_rank(tensor_pos(0, y_filt, 0, 0, 0));
+            for (std::size_t y = 0, y_out = 0; y < in.shape().height_ + 1 - f_size_dilated.height_; y += strides_y, ++y_out) {
                 Eigen::Map<ArrayXf, Eigen::Unaligned>
                     output_map(&output.get_ref_ignore_rank(tensor_pos(0, 0, y_out, 0, 0)),
                         static_cast<EigenIndex>(out_depth),
                         static_cast<EigenIndex>(out_width));
 
-                for (EigenIndex x = 0; x < static_cast<EigenIndex>(out_width); ++x) {
-                    const ArrayXf col_materialized = coefficient_wise_product.col(x);
-                    const Eigen::Map<ArrayXf, Eigen::Unaligned>
-                        cwp_reshaped(const_cast<float_type*>(col_materialized.data()),
-                            static_cast<EigenIndex>(filters_count),
-                            static_cast<EigenIndex>(f_width));
-                    output_map.col(x) += cwp_reshaped.rowwise().sum();
+                // One filter column at a time, so every product
+                // is added directly into the output without materializing it.
+                for (std::size_t x_filt = 0; x_filt < f_width; ++x_filt) {
+                    const auto filter = Eigen::Map<ArrayXf1D, Eigen::Unaligned>(
+                        const_cast<float_type*>(filter_ptr + x_filt * filters_count),
+                        static_cast<EigenIndex>(filters_count));
+                    const auto input = get_im2col_mapping(in, 1, filters_count, strides_x, out_width,
+                        y, y_filt * dilation_y, x_filt * dilation_x)
+                                           .array();
+                    output_map += input.colwise() * filter;
                 }
             }
         }
@@ -84,7 +82,7 @@ namespace internal {
             "invalid filter count");
 
         const auto conv_cfg = preprocess_convolution(
-            filter_mat.filter_shape_.without_depth(),
+            dilated_filter_size(filter_mat),
             strides, pad_type, input.shape().height_, input.shape().width_, false);
 
         const auto in_padded = pad_tensor(0, 0, 0,
@@ -98,5 +96,31 @@ namespace internal {
             in_padded);
     }
 
+    // The output rows [out_begin, out_end) of depthwise_convolve
+    // on an input with in_height rows,
+    // computed from only the input rows they depend on.
+    inline tensor depthwise_convolve_rows(
+        const shape2& strides,
+        const padding& pad_type,
+        const convolution_filter_matrices& filter_mat,
+        const tensor& in_rows,
+        std::size_t in_height,
+        std::size_t out_begin,
+        std::size_t out_end)
+    {
+        assertion(filter_mat.filter_count_ == in_rows.shape().depth_,
+            "invalid filter count");
+
+        const auto filter_size = dilated_filter_size(filter_mat);
+        const auto conv_cfg = preprocess_convolution(
+            filter_size, strides, pad_type, in_height, in_rows.shape().width_, false);
+
+        return depthwise_convolve_accumulative(
+            out_end - out_begin, conv_cfg.out_width_,
+            strides.height_, strides.width_,
+            filter_mat,
+            pad_row_band(conv_cfg, filter_size.height_, strides.height_, out_begin, out_end, in_rows));
+    }
+
 }
 }
@@ -8,9 +8,15 @@
 
 #include "fdeep/common.hpp"
 
+#include "fdeep/block_sparse.hpp"
+#include "fdeep/cancellation.hpp"
 #include "fdeep/convolution.hpp"
+#include "fdeep/cpu_features.hpp"
 #include "fdeep/filter.hpp"
+#include "fdeep/kernel_tuning.hpp"
+#include "fdeep/memory_placement.hpp"
 #include "fdeep/node.hpp"
+#include "fdeep/pipeline.hpp"
 #include "fdeep/recurrent_ops.hpp"
 #include "fdeep/shape2.hpp"
 #include "fdeep/shape3.hpp"
@@ -18,7 +24,10 @@
 #include "fdeep/tensor_pos.hpp"
 #include "fdeep/tensor_shape.hpp"
 #include "fdeep/tensor_shape_variable.hpp"
+#include "fdeep/weight_store.hpp"
+#include "fdeep/worker_pool.hpp"
 
 #include "fdeep/import_model.hpp"
 
 #include "fdeep/model.hpp"
+#include "fdeep/numa_model.hpp"
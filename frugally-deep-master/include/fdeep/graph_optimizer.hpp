@@ -0,0 +1,243 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include "fdeep/node.hpp"
+
+#include "fdeep/layers/conv_2d_layer.hpp"
+#include "fdeep/layers/dense_layer.hpp"
+#include "fdeep/layers/flatten_layer.hpp"
+#include "fdeep/layers/layer.hpp"
+#include "fdeep/layers/linear_layer.hpp"
+#include "fdeep/layers/model_layer.hpp"
+#include "fdeep/layers/normalization_layer.hpp"
+#include "fdeep/layers/rescaling_layer.hpp"
+
+#include <fplus/fplus.hpp>
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fdeep {
+namespace internal {
+
+    // Load-time rewrites of the layer graph of one (sub)model.
+    // Every rewrite keeps the results of the model unchanged
+    // (up to floating-point rounding) but saves work during prediction.
+    // The connections of the model outputs are updated in place,
+    // the returned lines describe what was done.
+    class graph_optimizer {
+    public:
+        graph_optimizer(layer_ptrs& layers, node_connections& output_connections)
+            : layers_(layers)
+            , output_connections_(output_connections)
+            , report_()
+        {
+        }
+
+        std::vector<std::string> run()
+        {
+            bool changed = true;
+            while (changed) {
+                changed = false;
+                for (std::size_t i = 0; i < layers_.size() && !changed; ++i) {
+                    const layer_ptr l = layers_[i];
+                    changed = remove_identity(l)
+                        || fold_rescaling_into_rescaling(l)
+                        || fold_affine_into_conv(l)
+                        || fold_flatten_into_dense(l);
+                }
+            }
+            for (const auto& l : layers_) {
+                const auto sub_model = std::dynamic_pointer_cast<model_layer>(l);
+                if (sub_model) {
+                    for (const auto& line : sub_model->graph_rewrites()) {
+                        report_.push_back(sub_model->name_ + "/" + line);
+                    }
+                }
+            }
+            return report_;
+        }
+
+    private:
+        template <typename F>
+        void for_each_connection(F f)
+        {
+            for (const auto& l : layers_) {
+                for (auto& n : l->nodes_) {
+                    auto conns = n.inbound_connections();
+                    for (auto& conn : conns) {
+                        f(conn);
+                    }
+                    n = node(conns);
+                }
+            }
+            for (auto& conn : output_connections_) {
+                f(conn);
+            }
+        }
+
+        std::size_t count_consumers(const std::string& layer_id, std::size_t node_idx) const
+        {
+            const auto is_match = [&](const node_connection& conn) {
+                return conn.layer_id_ == layer_id && conn.node_idx_ == node_idx;
+            };
+            std::size_t count = 0;
+            for (const auto& l : layers_) {
+                for (const auto& n : l->nodes_) {
+                    count += fplus::count_if(is_match, n.inbound_connections());
+                }
+            }
+            return count + fplus::count_if(is_match, output_connections_);
+        }
+
+        // Lets everything that consumed the (single) output
+        // of a node of the layer use the given connection instead.
+        void redirect_consumers(const std::string& layer_id, std::size_t node_idx,
+            const node_connection& replacement)
+        {
+            for_each_connection([&](node_connection& conn) {
+                if (conn.layer_id_ == layer_id && conn.node_idx_ == node_idx) {
+                    assertion(conn.tensor_idx_ == 0, "invalid tensor index");
+                    conn = replacement;
+                }
+            });
+        }
+
+        void remove_layer(const layer_ptr& l)
+        {
+            layers_ = fplus::keep_if([&l](const layer_ptr& other) {
+                return other != l;
+            },
+                layers_);
+        }
+
+        // A single-node layer without activation,
+        // whose one input tensor is consumed by nothing but the returned layer.
+        // Returns nullptr if there is no such consumer.
+        layer_ptr single_consumer(const layer_ptr& l)
+        {
+            if (l->nodes_.size() != 1 || l->has_activation()
+                || l->nodes_.front().inbound_connections().size() != 1
+                || count_consumers(l->name_, 0) != 1) {
+                return nullptr;
+            }
+            for (const auto& other : layers_) {
+                if (other->nodes_.size() == 1
+                    && other->nodes_.front().inbound_connections().size() == 1
+                    && other->nodes_.front().inbound_connections().front().layer_id_ == l->name_) {
+                    return other;
+                }
+            }
+            return nullptr;
+        }
+
+        // Connects the consumer directly to the input of l and drops l.
+        void bypass_into_single_consumer(const layer_ptr& l, const layer_ptr& consumer)
+        {
+            consumer->nodes_ = { node(l->nodes_.front().inbound_connections()) };
+            remove_layer(l);
+        }
+
+        // Dropout, noise and linear activation layers do nothing during prediction.
+        bool remove_identity(const layer_ptr& l)
+        {
+            const auto identity = std::dynamic_pointer_cast<linear_layer>(l);
+            if (!identity || identity->has_activation() || l->nodes_.empty()
+                || !fplus::all(fplus::transform([](const node& n) {
+                       return n.inbound_connections().size() == 1;
+                   },
+                       l->nodes_))) {
+                return false;
+            }
+            for (std::size_t i = 0; i < l->nodes_.size(); ++i) {
+                // Copied, because redirecting rebuilds the nodes.
+                const node_connection replacement = l->nodes_[i].inbound_connections().front();
+                redirect_consumers(l->name_, i, replacement);
+            }
+            remove_layer(l);
+            report_.push_back("removed identity layer " + l->name_);
+            return true;
+        }
+
+        // Consecutive Rescaling layers are composed into one.
+        bool fold_rescaling_into_rescaling(const layer_ptr& l)
+        {
+            const auto rescaling = std::dynamic_pointer_cast<rescaling_layer>(l);
+            if (!rescaling) {
+                return false;
+            }
+            const auto next = std::dynamic_pointer_cast<rescaling_layer>(single_consumer(l));
+            if (!next) {
+                return false;
+            }
+            next->prepend_affine(rescaling->scale(), rescaling->offset());
+            bypass_into_single_consumer(l, next);
+            report_.push_back("folded " + l->name_ + " into " + next->name_);
+            return true;
+        }
+
+        // Rescaling, or Normalization over the channels,
+        // directly in front of a convolution is merged into its weights and biases.
+        bool fold_affine_into_conv(const layer_ptr& l)
+        {
+            float_vec scale;
+            float_vec offset;
+            const auto rescaling = std::dynamic_pointer_cast<rescaling_layer>(l);
+            const auto normalization = std::dynamic_pointer_cast<normalization_layer>(l);
+            if (rescaling) {
+                scale = { rescaling->scale() };
+                offset = { rescaling->offset() };
+            } else if (normalization) {
+                // Conv2D inputs are always of rank 3, so axis 3 is the channel axis too.
+                const auto& axes = normalization->axes();
+                if (!axes.empty() && axes.front() != -1 && axes.front() != 3) {
+                    return false;
+                }
+                scale = normalization->affine_scales();
+                offset = normalization->affine_offsets();
+            } else {
+                return false;
+            }
+            // A convolution with zero padding refuses a nonzero offset,
+            // because its padded zeros would have to be transformed too.
+            const auto conv = std::dynamic_pointer_cast<conv_2d_layer>(single_consumer(l));
+            if (!conv || !conv->fold_input_affine(scale, offset)) {
+                return false;
+            }
+            bypass_into_single_consumer(l, conv);
+            report_.push_back("folded " + l->name_ + " into weights of " + conv->name_);
+            return true;
+        }
+
+        // Flatten only reinterprets the shape, which Dense can do itself.
+        bool fold_flatten_into_dense(const layer_ptr& l)
+        {
+            if (!std::dynamic_pointer_cast<flatten_layer>(l)) {
+                return false;
+            }
+            const auto dense = std::dynamic_pointer_cast<dense_layer>(single_consumer(l));
+            if (!dense) {
+                return false;
+            }
+            dense->set_flatten_input(true);
+            bypass_into_single_consumer(l, dense);
+            report_.push_back("merged " + l->name_ + " into " + dense->name_);
+            return true;
+        }
+
+        layer_ptrs& layers_;
+        node_connections& output_connections_;
+        std::vector<std::string> report_;
+    };
+
+}
+}
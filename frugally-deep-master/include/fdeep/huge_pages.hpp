@@ -0,0 +1,152 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+// Included by memory_accounting.hpp (after Eigen), so it must not include other fdeep headers.
+
+#include <Eigen/Core>
+
+#include <atomic>
+#include <cstddef>
+#include <fstream>
+#include <string>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace fdeep {
+namespace internal {
+
+    // How large tensor buffers (weights and activations) are backed.
+    // none: by the usual allocator.
+    // transparent: by memory the kernel is asked to back with transparent huge pages.
+    // hugetlb: by pages from the reserved huge page pool (vm.nr_hugepages),
+    //     or like transparent if the pool is exhausted.
+    // Only supported on Linux, the other modes are like none elsewhere.
+    enum class huge_page_mode { none,
+        transparent,
+        hugetlb };
+
+    const std::size_t huge_page_size = 2 * 1024 * 1024;
+
+    // Smaller buffers always come from the usual allocator,
+    // because rounding them up to whole huge pages would waste too much memory.
+    const std::size_t huge_page_min_bytes = huge_page_size / 2;
+
+    // Every large buffer is preceded by this header,
+    // so it can be freed correctly even if the mode changed in between.
+    struct large_buffer_header {
+        // nullptr if the buffer is not a mapping of its own.
+        void* mapping_;
+        std::size_t mapping_bytes_;
+    };
+    // Keeps the buffers aligned for every SIMD instruction set.
+    const std::size_t large_buffer_header_bytes = 64;
+
+    inline std::atomic<huge_page_mode>& global_huge_page_mode()
+    {
+        static std::atomic<huge_page_mode> mode(huge_page_mode::none);
+        return mode;
+    }
+
+    // Bytes of all mappings currently used for large buffers.
+    inline std::atomic<std::size_t>& huge_page_mapped_bytes()
+    {
+        static std::atomic<std::size_t> bytes(0);
+        return bytes;
+    }
+
+    // A mapping of at least bytes, aligned to huge_page_size, or nullptr.
+    // The actual size is written to mapping_bytes.
+    inline void* map_huge_pages(std::size_t bytes, huge_page_mode mode, std::size_t& mapping_bytes)
+    {
+#if defined(__linux__)
+        mapping_bytes = (bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+#if defined(MAP_HUGETLB)
+        if (mode == huge_page_mode::hugetlb) {
+            void* mapping = mmap(nullptr, mapping_bytes, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (mapping != MAP_FAILED) {
+                return mapping;
+            }
+        }
+#endif
+        // Transparent huge pages need aligned addresses,
+        // so the unaligned parts of a larger mapping are unmapped again.
+        char* raw = static_cast<char*>(mmap(nullptr, mapping_bytes + huge_page_size,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (raw == MAP_FAILED) {
+            return nullptr;
+        }
+        const std::size_t misalignment = reinterpret_cast<std::size_t>(raw) % huge_page_size;
+        const std::size_t head = misalignment == 0 ? 0 : huge_page_size - misalignment;
+        if (head > 0) {
+            munmap(raw, head);
+        }
+        munmap(raw + head + mapping_bytes, huge_page_size - head);
+#if defined(MADV_HUGEPAGE)
+        madvise(raw + head, mapping_bytes, MADV_HUGEPAGE);
+#endif
+        return raw + head;
+#else
+        (void)bytes;
+        (void)mode;
+        mapping_bytes = 0;
+        return nullptr;
+#endif
+    }
+
+    inline void* allocate_large_buffer(std::size_t bytes)
+    {
+        const std::size_t total = bytes + large_buffer_header_bytes;
+        const auto mode = global_huge_page_mode().load();
+        large_buffer_header header = { nullptr, 0 };
+        char* base = nullptr;
+        if (mode != huge_page_mode::none) {
+            header.mapping_ = map_huge_pages(total, mode, header.mapping_bytes_);
+            base = static_cast<char*>(header.mapping_);
+        }
+        if (base == nullptr) {
+            header.mapping_bytes_ = 0;
+            base = static_cast<char*>(Eigen::internal::aligned_malloc(total));
+        } else {
+            huge_page_mapped_bytes() += header.mapping_bytes_;
+        }
+        *reinterpret_cast<large_buffer_header*>(base) = header;
+        return base + large_buffer_header_bytes;
+    }
+
+    inline void deallocate_large_buffer(void* p)
+    {
+        char* base = static_cast<char*>(p) - large_buffer_header_bytes;
+        const large_buffer_header header = *reinterpret_cast<const large_buffer_header*>(base);
+        if (header.mapping_ == nullptr) {
+            Eigen::internal::aligned_free(base);
+            return;
+        }
+        huge_page_mapped_bytes() -= header.mapping_bytes_;
+#if defined(__linux__)
+        munmap(header.mapping_, header.mapping_bytes_);
+#endif
+    }
+
+    // The value (in kB) of a line of /proc/self/smaps_rollup, 0 if not available.
+    inline std::size_t read_smaps_rollup_kb(const std::string& key)
+    {
+        std::ifstream smaps("/proc/self/smaps_rollup");
+        std::string line;
+        while (std::getline(smaps, line)) {
+            if (line.rfind(key + ":", 0) == 0) {
+                return static_cast<std::size_t>(std::stoull(line.substr(key.size() + 1)));
+            }
+        }
+        return 0;
+    }
+
+}
+}
@@ -27,6 +27,8 @@
 
 #include "fdeep/common.hpp"
 
+#include "fdeep/graph_optimizer.hpp"
+
 #include "fdeep/layers/add_layer.hpp"
 #include "fdeep/layers/additive_attention_layer.hpp"
 #include "fdeep/layers/attention_layer.hpp"
@@ -39,6 +41,7 @@
 #include "fdeep/layers/concatenate_layer.hpp"
 #include "fdeep/layers/conv_2d_layer.hpp"
 #include "fdeep/layers/conv_2d_transpose_layer.hpp"
+#include "fdeep/layers/conv_3d_layer.hpp"
 #include "fdeep/layers/cropping_3d_layer.hpp"
 #include "fdeep/layers/dense_layer.hpp"
 #include "fdeep/layers/depthwise_conv_2d_layer.hpp"
@@ -359,7 +362,7 @@ namespace internal {
             return create_layer(get_prefixed_param, json,
                 custom_layer_creators, prefix);
         };
-        const auto layers = create_vector<layer_ptr>(make_layer,
+        auto layers = create_vector<layer_ptr>(make_layer,
             data["config"]["layers"]);
 
         assertion(data["config"]["input_layers"].is_array(), "no input layers");
@@ -367,10 +370,12 @@ namespace internal {
         const auto inputs = create_vector<node_connection>(
             create_node_connection_model_layer, data["config"]["input_layers"]);
 
-        const auto outputs = create_vector<node_connection>(
+        auto outputs = create_vector<node_connection>(
             create_node_connection_model_layer, data["config"]["output_layers"]);
 
-        return std::make_shared<model_layer>(name, layers, inputs, outputs);
+        const auto graph_rewrites = graph_optimizer(layers, outputs).run();
+
+        return std::make_shared<model_layer>(name, layers, inputs, outputs, graph_rewrites);
     }
 
     inline padding create_padding(const std::string& padding_str)
@@ -414,6 +419,33 @@ namespace internal {
             dilation_rate, weights, bias);
     }
 
+    inline layer_ptr create_conv_3d_layer(const get_param_f& get_param,
+        const nlohmann::json& data,
+        const std::string& name)
+    {
+        const std::string padding_str = data["config"]["padding"];
+        const auto pad_type = create_padding(padding_str);
+
+        const shape3 strides = create_shape3(data["config"]["strides"]);
+        const shape3 dilation_rate = create_shape3(data["config"]["dilation_rate"]);
+
+        const auto filter_count = create_size_t(data["config"]["filters"]);
+        float_vec bias(filter_count, 0);
+        const bool use_bias = data["config"]["use_bias"];
+        if (use_bias)
+            bias = decode_floats(get_param(name, "bias"));
+        assertion(bias.size() == filter_count, "size of bias does not match");
+
+        const float_vec weights = decode_floats(get_param(name, "weights"));
+        const shape3 kernel_size = create_shape3(data["config"]["kernel_size"]);
+        assertion(weights.size() % (kernel_size.volume() * filter_count) == 0,
+            "invalid number of weights");
+
+        return std::make_shared<conv_3d_layer>(name,
+            kernel_size, filter_count, strides, pad_type,
+            dilation_rate, weights, bias);
+    }
+
     inline layer_ptr create_conv_2d_transpose_layer(const get_param_f& get_param,
         const nlohmann::json& data,
         const std::string& name)
@@ -1261,6 +1293,7 @@ namespace internal {
             { "Identity", create_identity_layer },
             { "Conv1D", create_conv_2d_layer },
             { "Conv2D", create_conv_2d_layer },
+            { "Conv3D", create_conv_3d_layer },
             { "Conv1DTranspose", create_conv_2d_transpose_layer },
             { "Conv2DTranspose", create_conv_2d_transpose_layer },
             { "SeparableConv1D", create_separable_conv_2D_layer },
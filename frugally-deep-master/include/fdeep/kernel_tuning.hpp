@@ -0,0 +1,238 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include <fplus/fplus.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fdeep {
+namespace internal {
+
+    // Human-readable name of the CPU the process is running on,
+    // used to not reuse tuning results on different hardware.
+    inline std::string cpu_model_name()
+    {
+        std::ifstream cpuinfo("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(cpuinfo, line)) {
+            if (line.rfind("model name", 0) == 0) {
+                const auto colon = line.find(':');
+                if (colon != std::string::npos && colon + 2 <= line.size()) {
+                    return line.substr(colon + 2);
+                }
+            }
+        }
+        return "unknown";
+    }
+
+    // Whether the current thread may measure kernels for unknown configurations.
+    inline bool& kernel_tuning_enabled()
+    {
+        static thread_local bool enabled = false;
+        return enabled;
+    }
+
+    // Lets the current thread measure kernels during its lifetime.
+    class kernel_tuning_scope {
+    public:
+        kernel_tuning_scope()
+            : previous_(kernel_tuning_enabled())
+        {
+            kernel_tuning_enabled() = true;
+        }
+        ~kernel_tuning_scope()
+        {
+            kernel_tuning_enabled() = previous_;
+        }
+        kernel_tuning_scope(const kernel_tuning_scope&) = delete;
+        kernel_tuning_scope& operator=(const kernel_tuning_scope&) = delete;
+
+    private:
+        bool previous_;
+    };
+
+    // Remembers which of several implementations of a layer is the fastest
+    // for a given configuration (key), e.g., a convolution with a certain
+    // filter and input shape.
+    // If a file path is given, the results are persisted there
+    // (tab-separated lines of model hash, CPU, key and implementation),
+    // so later loads of the same model on the same machine
+    // do not have to repeat the measurements.
+    // New results are only written by flush (or the destructor),
+    // by replacing the file atomically with a merged version.
+    class kernel_tuning_cache {
+    public:
+        kernel_tuning_cache(const std::string& file_path, const std::string& model_hash)
+            : file_path_(file_path)
+            , model_hash_(model_hash)
+            , cpu_(cpu_model_name())
+            , winners_()
+            , dirty_(false)
+            , mutex_()
+        {
+            if (!file_path_.empty()) {
+                winners_ = read_entries(std::ifstream(file_path_)).first;
+            }
+        }
+
+        ~kernel_tuning_cache()
+        {
+            flush();
+        }
+
+        kernel_tuning_cache(const kernel_tuning_cache&) = delete;
+        kernel_tuning_cache& operator=(const kernel_tuning_cache&) = delete;
+
+        std::size_t size() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return winners_.size();
+        }
+
+        // The fastest candidate for key, if it has been measured already.
+        fplus::maybe<std::string> known_winner(const std::string& key) const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return fplus::get_from_map(winners_, key);
+        }
+
+        // Calls f with the name of the fastest candidate for key and returns its result.
+        // If key is not known yet, f is called with the fallback,
+        // unless the current thread is in a kernel_tuning_scope.
+        // Then every candidate is run and timed twice, and the fastest one is recorded.
+        template <typename F>
+        auto run_tuned(const std::string& key,
+            const std::vector<std::string>& candidates, const std::string& fallback, F f)
+        {
+            assertion(!candidates.empty(), "no kernel candidates to tune");
+            std::string known_winner;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                const auto it = winners_.find(key);
+                if (it != winners_.end() && fplus::is_elem_of(it->second, candidates)) {
+                    known_winner = it->second;
+                }
+            }
+            if (!known_winner.empty()) {
+                return f(known_winner);
+            }
+            if (!kernel_tuning_enabled()) {
+                return f(fallback);
+            }
+
+            double best_time = std::numeric_limits<double>::max();
+            std::string best;
+            // Warm-up, so the first candidate does not pay for cold caches.
+            auto result = f(candidates.front());
+            for (const auto& candidate : candidates) {
+                for (std::size_t run = 0; run < 2; ++run) {
+                    const auto start = std::chrono::steady_clock::now();
+                    result = f(candidate);
+                    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                    if (elapsed.count() < best_time) {
+                        best_time = elapsed.count();
+                        best = candidate;
+                    }
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            winners_[key] = best;
+            dirty_ = true;
+            return result;
+        }
+
+        // Writes the results measured since the last flush to the file.
+        // The entries of other models or machines, and the ones written by other
+        // processes in the meantime, are kept. The file is written under
+        // a temporary name and then renamed, so readers never see a partial file.
+        void flush()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (file_path_.empty() || !dirty_) {
+                return;
+            }
+            auto entries = read_entries(std::ifstream(file_path_));
+            for (const auto& entry : winners_) {
+                entries.first[entry.first] = entry.second;
+            }
+            std::ostringstream content;
+            for (const auto& line : entries.second) {
+                content << line << "\n";
+            }
+            for (const auto& entry : entries.first) {
+                content << entry_prefix() << entry.first << "\t" << entry.second << "\n";
+            }
+            const std::string temp_path = file_path_ + ".tmp" + std::to_string(std::random_device()());
+            {
+                std::ofstream out(temp_path, std::ios::trunc);
+                out << content.str();
+                if (!out.good()) {
+                    std::remove(temp_path.c_str());
+                    return;
+                }
+            }
+            if (std::rename(temp_path.c_str(), file_path_.c_str()) != 0) {
+                std::remove(temp_path.c_str());
+                return;
+            }
+            dirty_ = false;
+        }
+
+    private:
+        std::string entry_prefix() const
+        {
+            return model_hash_ + "\t" + cpu_ + "\t";
+        }
+
+        // The entries of this model and CPU, and all other lines.
+        std::pair<std::map<std::string, std::string>, std::vector<std::string>>
+        read_entries(std::istream&& in) const
+        {
+            std::map<std::string, std::string> entries;
+            std::vector<std::string> foreign_lines;
+            std::string line;
+            const std::string prefix = entry_prefix();
+            while (std::getline(in, line)) {
+                if (line.rfind(prefix, 0) == 0) {
+                    const auto rest = line.substr(prefix.size());
+                    const auto tab = rest.find('\t');
+                    if (tab != std::string::npos) {
+                        entries[rest.substr(0, tab)] = rest.substr(tab + 1);
+                    }
+                } else if (!line.empty()) {
+                    foreign_lines.push_back(line);
+                }
+            }
+            return { entries, foreign_lines };
+        }
+
+        std::string file_path_;
+        std::string model_hash_;
+        std::string cpu_;
+        std::map<std::string, std::string> winners_;
+        bool dirty_;
+        mutable std::mutex mutex_;
+    };
+
+}
+}
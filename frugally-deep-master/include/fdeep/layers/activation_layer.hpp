@@ -37,6 +37,11 @@ namespace internal {
 
     protected:
         virtual tensor transform_input(const tensor& input) const = 0;
+        // Most activation functions are applied element-wise.
+        bool is_slice_wise_impl() const override
+        {
+            return true;
+        }
     };
 
     inline tensors apply_activation_layer(
@@ -46,5 +51,10 @@ namespace internal {
         return ptr == nullptr ? input : ptr->apply(input);
     }
 
+    inline bool is_slice_wise_activation_layer(const activation_layer_ptr& ptr)
+    {
+        return ptr == nullptr || ptr->is_slice_wise();
+    }
+
 }
 }
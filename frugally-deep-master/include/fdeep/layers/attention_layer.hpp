@@ -33,21 +33,25 @@ namespace internal {
             const tensor& query = input[0];
             const tensor& value = input[1];
             const tensor& key = input.size() > 2 ? input[2] : value;
-            const tensor scores = score_mode_ == "dot" ? transform_tensor(fplus::multiply_with(scale_),
-                                      dot_product_tensors(query, transpose(key), std::vector<int>({ 2, 1 }), false))
-                                                       :
-                                                       // https://github.com/keras-team/keras/blob/v2.13.1/keras/layers/attention/attention.py
-                transform_tensor(fplus::multiply_with(concat_score_weight_),
-                    reshape(
-                        sum_depth(
-                            transform_tensor(tanh_typed,
-                                transform_tensor(fplus::multiply_with(scale_),
-                                    add_tensors(
-                                        reshape(query, tensor_shape(query.shape().width_, 1, query.shape().depth_)),
-                                        reshape(key, tensor_shape(1, key.shape().width_, key.shape().depth_)))))),
-                        tensor_shape(query.shape().width_, key.shape().width_)));
+            if (score_mode_ == "dot") {
+                tensor output(tensor_shape(query.shape().width_, value.shape().depth_), static_cast<float_type>(0));
+                scaled_dot_product_attention(
+                    rank_2_matrix_view(query), rank_2_matrix_view(key), rank_2_matrix_view(value),
+                    scale_, rank_2_matrix_view(output));
+                return { output };
+            }
+            // https://github.com/keras-team/keras/blob/v2.13.1/keras/layers/attention/attention.py
+            const tensor scores = transform_tensor(fplus::multiply_with(concat_score_weight_),
+                reshape(
+                    sum_depth(
+                        transform_tensor(tanh_typed,
+                            transform_tensor(fplus::multiply_with(scale_),
+                                add_tensors(
+                                    reshape(query, tensor_shape(query.shape().width_, 1, query.shape().depth_)),
+                                    reshape(key, tensor_shape(1, key.shape().width_, key.shape().depth_)))))),
+                    tensor_shape(query.shape().width_, key.shape().width_)));
             const tensor distribution = softmax(scores);
-            return { dot_product_tensors(distribution, value, std::vector<int>({ 2, 1 }), false) };
+            return { matmul_tensors(rank_2_matrix_view(distribution), rank_2_matrix_view(value)) };
         }
         std::string score_mode_;
         float_type scale_;
@@ -7,6 +7,7 @@
 #pragma once
 
 #include "fdeep/layers/layer.hpp"
+#include "fdeep/weight_store.hpp"
 
 #include <string>
 
@@ -37,6 +38,14 @@ namespace internal {
             assertion(gamma.empty() || gamma.size() == moving_mean.size(), "invalid sizes");
         }
 
+        void share_weights(weight_store& store) override
+        {
+            moving_mean_ = store.share(moving_mean_);
+            moving_variance_ = store.share(moving_variance_);
+            beta_ = store.share(beta_);
+            gamma_ = store.share(gamma_);
+        }
+
     protected:
         int axis_;
         shared_float_vec moving_mean_;
@@ -61,6 +70,12 @@ namespace internal {
                 gamma_->empty() ? tensor(input.shape(), 1) : broadcast(tensor(params_shape, gamma_), input.shape()),
                 epsilon_) };
         }
+
+        // Normalizing the channels treats every position separately.
+        bool is_slice_wise_impl() const override
+        {
+            return axis_ == -1;
+        }
     };
 
 }
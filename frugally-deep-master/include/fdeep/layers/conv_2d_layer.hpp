@@ -8,9 +8,11 @@
 
 #include "fdeep/convolution.hpp"
 #include "fdeep/filter.hpp"
+#include "fdeep/kernel_tuning.hpp"
 #include "fdeep/layers/layer.hpp"
 #include "fdeep/shape2.hpp"
 #include "fdeep/tensor_shape.hpp"
+#include "fdeep/weight_store.hpp"
 
 #include <fplus/fplus.hpp>
 
@@ -30,24 +32,100 @@ namespace internal {
             const float_vec& weights, const float_vec& bias)
             : layer(name)
             , filters_(generate_im2col_filter_matrix(
-                  generate_filters(dilation_rate, filter_shape, k, weights, bias, false)))
+                  generate_filters(shape2(1, 1), filter_shape, k, weights, bias, false),
+                  dilation_rate))
             , strides_(strides)
             , padding_(p)
+            , kernel_tuning_()
         {
             assertion(k > 0, "needs at least one filter");
             assertion(filter_shape.volume() > 0, "filter must have volume");
             assertion(strides.area() > 0, "invalid strides");
         }
 
+        // Makes the layer expect x instead of (scale * x + offset),
+        // with scale and offset given per input channel (or once for all).
+        // Returns false (and changes nothing) if this is not possible,
+        // because the padded zeros would have to be transformed too.
+        bool fold_input_affine(const float_vec& scale, const float_vec& offset)
+        {
+            const bool has_offset = fplus::any_by([](float_type o) { return o != 0; }, offset);
+            if ((padding_ != padding::valid && has_offset)
+                || (scale.size() != 1 && scale.size() != filters_.filter_shape_.depth_)) {
+                return false;
+            }
+            // With valid padding every tap reads a transformed input value,
+            // so the offset contributes the same amount to every output pixel
+            // and can live in the biases. A padded zero would contribute nothing
+            // instead of the offset, which is why only the scale can be folded then.
+            filters_ = fold_input_affine_into_filter_matrices(filters_, scale, offset);
+            return true;
+        }
+
+        void set_kernel_tuning(const kernel_tuning_cache_ptr& tuning) override
+        {
+            kernel_tuning_ = tuning;
+        }
+
+        void share_weights(weight_store& store) override
+        {
+            filters_.filter_mats_ = share_tensor_values(store, filters_.filter_mats_);
+        }
+
     protected:
         tensors apply_impl(const tensors& inputs) const override
         {
             const auto& input = single_tensor_from_tensors(inputs);
+            // With strides of 1 several kernels are possible,
+            // and which one is faster depends on the shapes and the CPU.
+            if (kernel_tuning_ && strides_ == shape2(1, 1)) {
+                const auto run = [&](const std::string& kernel) -> tensor {
+                    return convolve(strides_, padding_, filters_, input, create_conv_kernel(kernel));
+                };
+                std::vector<std::string> candidates = { show_conv_kernel(conv_kernel::s1x1), show_conv_kernel(conv_kernel::rows) };
+                if (is_pointwise_convolution(filters_, strides_)) {
+                    candidates.insert(candidates.begin(), show_conv_kernel(conv_kernel::pointwise));
+                }
+                if (!filters_.sparse_filter_mats_.empty()) {
+                    candidates.push_back(show_conv_kernel(conv_kernel::sparse));
+                }
+                return { kernel_tuning_->run_tuned(tuning_key(input.shape()), candidates,
+                    show_conv_kernel(conv_kernel::automatic), run) };
+            }
             return { convolve(strides_, padding_, filters_, input) };
         }
+        fplus::maybe<row_window> get_row_window_impl(std::size_t in_height) const override
+        {
+            const auto filter_size = dilated_filter_size(filters_);
+            const auto rows = preprocess_convolution_rows(filter_size, strides_, padding_, in_height);
+            return row_window({ filter_size.height_, strides_.height_, rows.first, rows.second });
+        }
+        // Uses the kernel tuned for the whole input if there is one yet.
+        tensor apply_to_rows_impl(const tensor& in_rows, std::size_t in_height,
+            std::size_t out_begin, std::size_t out_end) const override
+        {
+            auto kernel = conv_kernel::automatic;
+            if (kernel_tuning_ && strides_ == shape2(1, 1)) {
+                const auto input_shape = tensor_shape(in_height, in_rows.shape().width_, in_rows.shape().depth_);
+                const auto winner = kernel_tuning_->known_winner(tuning_key(input_shape));
+                if (winner.is_just()) {
+                    kernel = create_conv_kernel(winner.unsafe_get_just());
+                }
+            }
+            return convolve_rows(strides_, padding_, filters_, in_rows, in_height, out_begin, out_end, kernel);
+        }
+        std::string tuning_key(const tensor_shape& input_shape) const
+        {
+            const auto& f = filters_.filter_shape_;
+            return "conv_2d " + show_tensor_shape(input_shape)
+                + " filters " + fplus::show(filters_.filter_count_) + "x" + show_tensor_shape(f)
+                + " dilation " + fplus::show(filters_.dilation_rate_.height_) + "x" + fplus::show(filters_.dilation_rate_.width_)
+                + " padding " + fplus::show(static_cast<int>(padding_));
+        }
         convolution_filter_matrices filters_;
         shape2 strides_;
         padding padding_;
+        kernel_tuning_cache_ptr kernel_tuning_;
     };
 
 }
@@ -11,6 +11,7 @@
 #include "fdeep/layers/layer.hpp"
 #include "fdeep/shape2.hpp"
 #include "fdeep/tensor_shape.hpp"
+#include "fdeep/weight_store.hpp"
 
 #include <fplus/fplus.hpp>
 
@@ -30,7 +31,8 @@ namespace internal {
             const float_vec& weights, const float_vec& bias)
             : layer(name)
             , filters_(generate_im2col_filter_matrix(
-                  generate_filters(dilation_rate, filter_shape, k, weights, bias, true)))
+                  generate_filters(shape2(1, 1), filter_shape, k, weights, bias, false),
+                  dilation_rate))
             , dilation_rate_(dilation_rate)
             , strides_(strides)
             , padding_(p)
@@ -40,6 +42,11 @@ namespace internal {
             assertion(strides.area() > 0, "invalid strides");
         }
 
+        void share_weights(weight_store& store) override
+        {
+            filters_.filter_mats_ = share_tensor_values(store, filters_.filter_mats_);
+        }
+
     protected:
         tensors apply_impl(const tensors& inputs) const override
         {
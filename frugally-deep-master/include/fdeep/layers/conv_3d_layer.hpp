@@ -0,0 +1,57 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/convolution3d.hpp"
+#include "fdeep/layers/layer.hpp"
+#include "fdeep/shape3.hpp"
+#include "fdeep/weight_store.hpp"
+
+#include <fplus/fplus.hpp>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace fdeep {
+namespace internal {
+
+    class conv_3d_layer : public layer {
+    public:
+        explicit conv_3d_layer(
+            const std::string& name, const shape3& filter_size,
+            std::size_t k, const shape3& strides, padding p,
+            const shape3& dilation_rate,
+            const float_vec& weights, const float_vec& bias)
+            : layer(name)
+            , filter_mat_(generate_convolution3d_filter_matrix(
+                  filter_size, dilation_rate, k, weights, bias))
+            , strides_(strides)
+            , padding_(p)
+        {
+            assertion(strides.volume() > 0, "invalid strides");
+            assertion(dilation_rate.volume() > 0, "invalid dilation rate");
+        }
+
+        void share_weights(weight_store& store) override
+        {
+            filter_mat_.filter_mat_ = share_tensor_values(store, filter_mat_.filter_mat_);
+        }
+
+    protected:
+        tensors apply_impl(const tensors& inputs) const override
+        {
+            const auto& input = single_tensor_from_tensors(inputs);
+            return { convolve_3d(strides_, padding_, filter_mat_, input) };
+        }
+        convolution3d_filter_matrix filter_mat_;
+        shape3 strides_;
+        padding padding_;
+    };
+
+}
+}
@@ -6,11 +6,13 @@
 
 #pragma once
 
+#include "fdeep/block_sparse.hpp"
 #include "fdeep/layers/layer.hpp"
 #include "fdeep/tensor.hpp"
 
 #include <fplus/fplus.hpp>
 
+#include <algorithm>
 #include <string>
 #include <utility>
 #include <vector>
@@ -21,12 +23,13 @@ namespace internal {
     // Takes a single stack volume (tensor_shape(n)) as input.
     class dense_layer : public layer {
     public:
-        static RowMajorMatrixXf generate_params(std::size_t n_in,
+        // The (n_in + 1) x n_out row-major matrix of the weights, with the biases as the last row.
+        // Kept in a float_vec, so it is allocated like the tensors (see accounting_allocator).
+        static float_vec generate_params(std::size_t n_in,
             const float_vec& weights, const float_vec& bias)
         {
-            assertion(weights.size() % bias.size() == 0, "invalid params");
-            return eigen_row_major_mat_from_values(n_in + 1, bias.size(),
-                fplus::append(weights, bias));
+            assertion(weights.size() == n_in * bias.size(), "invalid params");
+            return fplus::append(weights, bias);
         }
         dense_layer(const std::string& name, std::size_t units,
             const float_vec& weights,
@@ -35,16 +38,55 @@ namespace internal {
             , n_in_(weights.size() / bias.size())
             , n_out_(units)
             , params_(generate_params(n_in_, weights, bias))
+            , sparse_weights_(create_block_sparse_matrix(params_.data(), n_out_, n_in_, n_out_))
+            , flatten_input_(false)
         {
             assertion(bias.size() == units, "invalid bias count");
             assertion(weights.size() % units == 0, "invalid weight count");
         }
 
+        // Lets the layer take over the work of a preceding Flatten layer.
+        void set_flatten_input(bool flatten_input)
+        {
+            flatten_input_ = flatten_input;
+        }
+
+        // The weights of the connections from all inputs to one unit.
+        float_vec unit_weights(std::size_t unit) const
+        {
+            assertion(unit < n_out_, "invalid unit index");
+            float_vec result(n_in_);
+            for (std::size_t i = 0; i < n_in_; ++i) {
+                result[i] = params_[i * n_out_ + unit];
+            }
+            return result;
+        }
+
+        bool flattens_input() const
+        {
+            return flatten_input_;
+        }
+
+        // The class activation map of the unit for a feature map,
+        // whose global average pooling is the input of this layer:
+        // The channels of the feature map weighted with the unit's weights,
+        // with negative values set to zero and scaled to a maximum of 1.
+        tensor class_activation_map(const tensor& feature_map, std::size_t unit) const
+        {
+            assertion(!flatten_input_, name_ + " is not a dense layer on pooled features");
+            const auto cam = weighted_sum_depth(feature_map, unit_weights(unit));
+            const auto cam_max = std::max(static_cast<float_type>(0), cam.get(tensor_max_pos(cam)));
+            return transform_tensor([cam_max](float_type x) -> float_type {
+                return cam_max > 0 ? std::max(static_cast<float_type>(0), x) / cam_max : 0;
+            },
+                cam);
+        }
+
     protected:
         tensors apply_impl(const tensors& inputs) const override
         {
             assertion(inputs.size() == 1, "invalid number of input tensors");
-            auto input = inputs.front();
+            const auto input = flatten_input_ ? flatten_tensor(inputs.front()) : inputs.front();
             // According to the Keras documentation
             // https://keras.io/layers/core/#dense
             // "if the input to the layer has a rank greater than 2,
@@ -64,25 +106,29 @@ namespace internal {
             std::vector<float_type> result_values((input.shape().volume() / depth) * n_out_);
             const size_t n_of_parts = size / depth;
 
-            Eigen::Map<const RowMajorMatrixXf, Eigen::Unaligned> params(
-                params_.data(),
-                static_cast<EigenIndex>(params_.rows() - 1),
-                static_cast<EigenIndex>(params_.cols()));
             Eigen::Map<const RowMajorMatrixXf, Eigen::Unaligned> bias(
-                params_.data() + (params_.rows() - 1) * params_.cols(),
+                params_.data() + n_in_ * n_out_,
                 static_cast<EigenIndex>(1),
-                static_cast<EigenIndex>(params_.cols()));
-
-            for (size_t part_id = 0; part_id < n_of_parts; ++part_id) {
-                Eigen::Map<const RowMajorMatrixXf, Eigen::Unaligned> m(
-                    &(*feature_arr)[part_id * depth],
-                    static_cast<EigenIndex>(1),
-                    static_cast<EigenIndex>(depth));
-                Eigen::Map<RowMajorMatrixXf, Eigen::Unaligned> res_m(
-                    &result_values[part_id * n_out_],
-                    static_cast<EigenIndex>(1),
-                    static_cast<EigenIndex>(n_out_));
-                res_m.noalias() = m * params + bias;
+                static_cast<EigenIndex>(n_out_));
+
+            Eigen::Map<RowMajorMatrixXf, Eigen::Unaligned> res_m(
+                result_values.data(),
+                static_cast<EigenIndex>(n_of_parts),
+                static_cast<EigenIndex>(n_out_));
+            // The sparse weights are used for single feature vectors (e.g., in classifier heads),
+            // but for multiple positions only if they are pruned so much, that it pays off.
+            if (uses_sparse_weights(input.shape().rank())) {
+                res_m.rowwise() = bias.row(0);
+                block_sparse_multiply_add(sparse_weights_.unsafe_get_just(),
+                    feature_arr->data(), depth, n_of_parts, result_values.data(), n_out_);
+            } else {
+                // All positions at once, i.e., one GEMM instead of one GEMV per position,
+                // so the weights are streamed through the cache only once.
+                // With the row-major matrices seen as column-major ones,
+                // this is result^T = weights^T * input^T.
+                gemm_accumulate(n_out_, n_of_parts, n_in_,
+                    params_.data(), n_out_, feature_arr->data(), depth, result_values.data(), n_out_);
+                res_m.rowwise() += bias.row(0);
             }
             return { tensor(tensor_shape_with_changed_rank(
                                 tensor_shape(
@@ -95,9 +141,27 @@ namespace internal {
                 std::move(result_values)) };
         }
 
+        bool uses_sparse_weights(std::size_t input_rank) const
+        {
+            return sparse_weights_.is_just()
+                && (input_rank == 1 || prefer_block_sparse_gemm(sparse_weights_.unsafe_get_just()));
+        }
+
+        // If the sparse weights are used for single feature vectors only,
+        // the rank-1 slices of a rank-2 input would be computed by another kernel
+        // than the whole input, with different rounding.
+        bool is_slice_wise_impl() const override
+        {
+            return !flatten_input_ && uses_sparse_weights(1) == uses_sparse_weights(2);
+        }
+
         std::size_t n_in_;
         std::size_t n_out_;
-        RowMajorMatrixXf params_;
+        float_vec params_;
+        // The transposed weights (without the biases) in blocked-sparse format,
+        // if enough of them are pruned.
+        fplus::maybe<block_sparse_matrix> sparse_weights_;
+        bool flatten_input_;
     };
 
 }
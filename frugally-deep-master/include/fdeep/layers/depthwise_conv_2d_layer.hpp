@@ -11,6 +11,7 @@
 #include "fdeep/layers/layer.hpp"
 #include "fdeep/shape2.hpp"
 #include "fdeep/tensor_shape.hpp"
+#include "fdeep/weight_store.hpp"
 
 #include <fplus/fplus.hpp>
 
@@ -34,8 +35,9 @@ namespace internal {
             const float_vec& bias)
             : layer(name)
             , filters_(generate_im2col_filter_matrix(
-                  generate_filters(dilation_rate, filter_shape,
-                      input_depth, depthwise_weights, bias, false)))
+                  generate_filters(shape2(1, 1), filter_shape,
+                      input_depth, depthwise_weights, bias, false),
+                  dilation_rate))
             , strides_(strides)
             , padding_(p)
         {
@@ -47,6 +49,11 @@ namespace internal {
                 "invalid filter shape");
         }
 
+        void share_weights(weight_store& store) override
+        {
+            filters_.filter_mats_ = share_tensor_values(store, filters_.filter_mats_);
+        }
+
     protected:
         tensors apply_impl(const tensors& inputs) const override
         {
@@ -56,6 +63,17 @@ namespace internal {
                 "Invalid output shape");
             return { result };
         }
+        fplus::maybe<row_window> get_row_window_impl(std::size_t in_height) const override
+        {
+            const auto filter_size = dilated_filter_size(filters_);
+            const auto rows = preprocess_convolution_rows(filter_size, strides_, padding_, in_height);
+            return row_window({ filter_size.height_, strides_.height_, rows.first, rows.second });
+        }
+        tensor apply_to_rows_impl(const tensor& in_rows, std::size_t in_height,
+            std::size_t out_begin, std::size_t out_end) const override
+        {
+            return depthwise_convolve_rows(strides_, padding_, filters_, in_rows, in_height, out_begin, out_end);
+        }
 
         convolution_filter_matrices filters_;
         shape2 strides_;
@@ -26,17 +26,14 @@ namespace internal {
         {
             const auto out_dimensions = keepdims_ ? fplus::append_elem(in.shape().depth_, std::vector<std::size_t>(in.shape().rank() - 1, 1)) : fplus::singleton_seq(in.shape().depth_);
             tensor out(create_tensor_shape_from_dims(out_dimensions), 0);
-            for (std::size_t z = 0; z < in.shape().depth_; ++z) {
-                float_type val = 0;
-                for (std::size_t d4 = 0; d4 < in.shape().size_dim_4_; ++d4) {
-                    for (std::size_t y = 0; y < in.shape().height_; ++y) {
-                        for (std::size_t x = 0; x < in.shape().width_; ++x) {
-                            val += in.get_ignore_rank(tensor_pos(d4, y, x, z));
-                        }
-                    }
-                }
-                out.set_ignore_rank(tensor_pos(z), val / static_cast<float_type>(in.shape().size_dim_4_ * in.shape().height_ * in.shape().width_));
-            }
+            // One pass over the input, reducing all channels at once.
+            const std::size_t depth = in.shape().depth_;
+            const std::size_t pixels = in.shape().size_dim_4_ * in.shape().height_ * in.shape().width_;
+            const Eigen::Map<const ColMajorMatrixXf, Eigen::Unaligned> in_map(
+                in.as_vector()->data(), static_cast<EigenIndex>(depth), static_cast<EigenIndex>(pixels));
+            Eigen::Map<ArrayXf1D, Eigen::Unaligned> out_vec(
+                out.as_vector()->data(), static_cast<EigenIndex>(depth));
+            out_vec = in_map.rowwise().sum().array() / static_cast<float_type>(pixels);
             return out;
         }
         bool keepdims_;
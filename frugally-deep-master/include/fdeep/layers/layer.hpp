@@ -8,13 +8,16 @@
 
 #include "fdeep/common.hpp"
 
+#include "fdeep/cancellation.hpp"
 #include "fdeep/tensor.hpp"
 
 #include "fdeep/node.hpp"
 
+#include <algorithm>
 #include <cstddef>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace fdeep {
@@ -28,6 +31,35 @@ namespace internal {
     typedef std::shared_ptr<activation_layer> activation_layer_ptr;
     tensors apply_activation_layer(const activation_layer_ptr& ptr,
         const tensors& input);
+    bool is_slice_wise_activation_layer(const activation_layer_ptr& ptr);
+
+    class kernel_tuning_cache;
+    typedef std::shared_ptr<kernel_tuning_cache> kernel_tuning_cache_ptr;
+
+    class weight_store;
+
+    // How the output rows of a convolution or pooling layer depend
+    // on its input rows: output row y is computed from the input rows
+    // [y * stride_ - pad_top_, y * stride_ - pad_top_ + size_),
+    // with the rows outside of the input being padding.
+    struct row_window {
+        std::size_t size_;
+        std::size_t stride_;
+        std::size_t pad_top_;
+        std::size_t out_height_;
+    };
+
+    // The input rows [begin, end) needed for the output rows [out_begin, out_end).
+    inline std::pair<std::size_t, std::size_t> row_window_input_rows(
+        const row_window& window, std::size_t in_height,
+        std::size_t out_begin, std::size_t out_end)
+    {
+        const std::size_t begin = out_begin * window.stride_;
+        const std::size_t end = (out_end - 1) * window.stride_ + window.size_;
+        return std::make_pair(
+            begin > window.pad_top_ ? std::min(in_height, begin - window.pad_top_) : 0,
+            end > window.pad_top_ ? std::min(in_height, end - window.pad_top_) : 0);
+    }
 
     class layer {
     public:
@@ -51,8 +83,32 @@ namespace internal {
             nodes_ = layer_nodes;
         }
 
+        bool has_activation() const
+        {
+            return activation_ != nullptr;
+        }
+
+        const activation_layer_ptr& get_activation() const
+        {
+            return activation_;
+        }
+
+        // Layers with more than one implementation override this
+        // to pick the fastest one per configuration using the given cache.
+        virtual void set_kernel_tuning(const kernel_tuning_cache_ptr&)
+        {
+        }
+
+        // Layers with weights override this to replace their buffers
+        // by the ones with the same values from the store.
+        virtual void share_weights(weight_store&)
+        {
+        }
+
         virtual tensors apply(const tensors& input) const final
         {
+            throw_if_cancelled();
+            const memory_accounting_layer_guard accounting(name_);
             const auto result = apply_impl(input);
             if (activation_ == nullptr)
                 return result;
@@ -60,6 +116,56 @@ namespace internal {
                 return apply_activation_layer(activation_, result);
         }
 
+        // Like apply, but leaving out the activation function,
+        // e.g., to get the logits of a layer with softmax activation.
+        tensors apply_without_activation(const tensors& input) const
+        {
+            throw_if_cancelled();
+            const memory_accounting_layer_guard accounting(name_);
+            return apply_impl(input);
+        }
+
+        // The row window for an input of the given height (and rank 3),
+        // if the layer can compute any range of its output rows
+        // from just the input rows this range depends on (see apply_to_rows).
+        fplus::maybe<row_window> get_row_window(std::size_t in_height) const
+        {
+            if (!is_slice_wise_activation_layer(activation_)) {
+                return fplus::nothing<row_window>();
+            }
+            return get_row_window_impl(in_height);
+        }
+
+        // The output rows [out_begin, out_end) for an input of in_height rows,
+        // computed from only the input rows given by row_window_input_rows.
+        tensor apply_to_rows(const tensor& in_rows, std::size_t in_height,
+            std::size_t out_begin, std::size_t out_end) const
+        {
+            throw_if_cancelled();
+            const memory_accounting_layer_guard accounting(name_);
+            const tensors result = { apply_to_rows_impl(in_rows, in_height, out_begin, out_end) };
+            if (activation_ == nullptr)
+                return result.front();
+            else
+                return single_tensor_from_tensors(apply_activation_layer(activation_, result));
+        }
+
+        // True if applying the layer to a whole tensor gives the same result
+        // as applying it to every slice along the outermost axis separately,
+        // e.g., because it only works on the individual depth vectors.
+        // TimeDistributed uses this to process all time steps in one go.
+        bool is_slice_wise() const
+        {
+            return is_slice_wise_impl() && is_slice_wise_activation_layer(activation_);
+        }
+
+        // The index in nodes_ (and in the output cache) of the node
+        // a connection to this layer with the given node index refers to.
+        virtual std::size_t local_node_idx(std::size_t node_idx) const
+        {
+            return node_idx;
+        }
+
         virtual tensor get_output(const layer_ptrs& layers,
             output_dict& output_cache,
             std::size_t node_idx, std::size_t tensor_idx) const
@@ -84,6 +190,19 @@ namespace internal {
 
     protected:
         virtual tensors apply_impl(const tensors& input) const = 0;
+        virtual bool is_slice_wise_impl() const
+        {
+            return false;
+        }
+        virtual fplus::maybe<row_window> get_row_window_impl(std::size_t) const
+        {
+            return fplus::nothing<row_window>();
+        }
+        virtual tensor apply_to_rows_impl(const tensor&, std::size_t, std::size_t, std::size_t) const
+        {
+            raise_error("layer " + name_ + " can not be applied to rows separately");
+            return tensor(tensor_shape(static_cast<std::size_t>(0)), 0);
+        }
         activation_layer_ptr activation_;
     };
 
@@ -7,6 +7,7 @@
 #pragma once
 
 #include "fdeep/layers/layer.hpp"
+#include "fdeep/weight_store.hpp"
 
 #include <string>
 
@@ -28,6 +29,12 @@ namespace internal {
         {
         }
 
+        void share_weights(weight_store& store) override
+        {
+            beta_ = store.share(beta_);
+            gamma_ = store.share(gamma_);
+        }
+
     protected:
         std::vector<int> axes_;
         shared_float_vec beta_;
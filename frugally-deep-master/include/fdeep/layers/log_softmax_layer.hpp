@@ -30,6 +30,11 @@ namespace internal {
             },
                 softmax(in_vol));
         }
+        // softmax only handles tensors up to rank 3.
+        bool is_slice_wise_impl() const override
+        {
+            return false;
+        }
     };
 
 }
@@ -14,27 +14,52 @@
 namespace fdeep {
 namespace internal {
 
-    inline void inner_max_pool(const tensor& in, tensor& out,
-        std::size_t pool_size_d4, std::size_t pool_height, std::size_t pool_width,
-        std::size_t strides_d4, std::size_t strides_y, std::size_t strides_x,
-        std::size_t d4, std::size_t y, std::size_t x, std::size_t z,
-        int pad_front_int, int pad_top_int, int pad_left_int)
+    // Unrolled version for the common 2x2 and 3x3 windows.
+    template <std::size_t PoolHeight, std::size_t PoolWidth>
+    void max_pool_fixed_window(const float_type* window_ptr, float_type* out_ptr,
+        std::size_t row_stride, std::size_t depth)
     {
-        const float_type invalid = std::numeric_limits<float_type>::lowest();
-        float_type val = std::numeric_limits<float_type>::lowest();
-        for (std::size_t d4f = 0; d4f < pool_size_d4; ++d4f) {
-            int in_get_d4 = static_cast<int>(strides_d4 * d4 + d4f) - pad_front_int;
-            for (std::size_t yf = 0; yf < pool_height; ++yf) {
-                int in_get_y = static_cast<int>(strides_y * y + yf) - pad_top_int;
-                for (std::size_t xf = 0; xf < pool_width; ++xf) {
-                    int in_get_x = static_cast<int>(strides_x * x + xf) - pad_left_int;
-                    const auto current = in.get_padded(invalid,
-                        0, in_get_d4, in_get_y, in_get_x, static_cast<int>(z));
-                    val = std::max(val, current);
+        Eigen::Map<ArrayXf1D, Eigen::Unaligned> out_vec(out_ptr, static_cast<EigenIndex>(depth));
+        out_vec = Eigen::Map<const ArrayXf1D, Eigen::Unaligned>(window_ptr, static_cast<EigenIndex>(depth));
+        for (std::size_t yf = 0; yf < PoolHeight; ++yf) {
+            for (std::size_t xf = 0; xf < PoolWidth; ++xf) {
+                if (yf != 0 || xf != 0) {
+                    out_vec = out_vec.max(Eigen::Map<const ArrayXf1D, Eigen::Unaligned>(
+                        window_ptr + yf * row_stride + xf * depth, static_cast<EigenIndex>(depth)));
+                }
+            }
+        }
+    }
+
+    inline void inner_max_pool(const float_type* in_ptr, float_type* out_ptr,
+        std::size_t in_height, std::size_t in_width, std::size_t depth,
+        std::size_t d4_begin, std::size_t d4_end,
+        std::size_t y_begin, std::size_t y_end,
+        std::size_t x_begin, std::size_t x_end)
+    {
+        const std::size_t row_stride = in_width * depth;
+        const float_type* window_ptr = in_ptr + ((d4_begin * in_height + y_begin) * in_width + x_begin) * depth;
+        if (d4_end - d4_begin == 1) {
+            if (y_end - y_begin == 2 && x_end - x_begin == 2) {
+                max_pool_fixed_window<2, 2>(window_ptr, out_ptr, row_stride, depth);
+                return;
+            }
+            if (y_end - y_begin == 3 && x_end - x_begin == 3) {
+                max_pool_fixed_window<3, 3>(window_ptr, out_ptr, row_stride, depth);
+                return;
+            }
+        }
+        Eigen::Map<ArrayXf1D, Eigen::Unaligned> out_vec(out_ptr, static_cast<EigenIndex>(depth));
+        out_vec.setConstant(std::numeric_limits<float_type>::lowest());
+        for (std::size_t d4 = d4_begin; d4 < d4_end; ++d4) {
+            for (std::size_t y = y_begin; y < y_end; ++y) {
+                const float_type* row_ptr = in_ptr + ((d4 * in_height + y) * in_width + x_begin) * depth;
+                for (std::size_t x = x_begin; x < x_end; ++x, row_ptr += depth) {
+                    out_vec = out_vec.max(Eigen::Map<const ArrayXf1D, Eigen::Unaligned>(
+                        row_ptr, static_cast<EigenIndex>(depth)));
                 }
             }
         }
-        out.set_ignore_rank(tensor_pos(d4, y, x, z), val);
     }
 
     class max_pooling_3d_layer : public pooling_3d_layer {
@@ -8,14 +8,24 @@
 
 #include "fdeep/common.hpp"
 
+#include "fdeep/pipeline.hpp"
 #include "fdeep/tensor.hpp"
 
 #include "fdeep/layers/layer.hpp"
+#include "fdeep/layers/softmax_layer.hpp"
 
 #include <algorithm>
+#include <chrono>
 #include <cstddef>
+#include <functional>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace fdeep {
 namespace internal {
@@ -25,30 +35,371 @@ namespace internal {
         explicit model_layer(const std::string& name,
             const layer_ptrs& layers,
             const node_connections& input_connections,
-            const node_connections& output_connections)
+            const node_connections& output_connections,
+            const std::vector<std::string>& graph_rewrites = {})
             : layer(name)
             , layers_(layers)
             , input_connections_(input_connections)
             , output_connections_(output_connections)
+            , graph_rewrites_(graph_rewrites)
+            , execution_plan_once_()
+            , execution_plan_()
+            , logits_plan_once_()
+            , logits_plan_()
         {
             assertion(fplus::all_unique(
                           fplus::transform(fplus_get_ptr_mem(name_), layers)),
                 "layer names must be unique");
         }
 
+        // What the graph optimizer changed when loading the model.
+        const std::vector<std::string>& graph_rewrites() const
+        {
+            return graph_rewrites_;
+        }
+
+        void set_kernel_tuning(const kernel_tuning_cache_ptr& tuning) override
+        {
+            for (const auto& l : layers_) {
+                l->set_kernel_tuning(tuning);
+            }
+        }
+
+        void share_weights(weight_store& store) override
+        {
+            for (const auto& l : layers_) {
+                l->share_weights(store);
+            }
+        }
+
+        std::size_t local_node_idx(std::size_t node_idx) const override
+        {
+            // https://stackoverflow.com/questions/46011749/understanding-keras-model-architecture-node-index-of-nested-model
+            return node_idx >= 1 ? node_idx - 1 : node_idx;
+        }
+
         tensor get_output(const layer_ptrs& layers, output_dict& output_cache,
             std::size_t node_idx, std::size_t tensor_idx) const override
         {
-            // https://stackoverflow.com/questions/46011749/understanding-keras-model-architecture-node-index-of-nested-model
-            if (node_idx >= 1) {
-                node_idx = node_idx - 1;
-            }
+            node_idx = local_node_idx(node_idx);
             assertion(node_idx < nodes_.size(), "invalid node index: " + std::to_string(node_idx) + " of " + std::to_string(nodes_.size()));
             return layer::get_output(layers, output_cache, node_idx, tensor_idx);
         }
 
+        // Like apply, but also returns the outputs of the named layers
+        // (of their first node), computed in the same pass.
+        // Only these are kept until the end, all other intermediate results
+        // are freed after their last use, as in apply.
+        std::pair<tensors, tensors> apply_with_layer_outputs(const tensors& inputs,
+            const std::vector<std::string>& layer_names) const
+        {
+            assertion(inputs.size() == input_connections_.size(),
+                "invalid number of input tensors for this model: " + fplus::show(input_connections_.size()) + " required but " + fplus::show(inputs.size()) + " provided");
+            const memory_accounting_layer_guard accounting(name_);
+            const auto layer_connections = fplus::transform([this](const std::string& layer_name) -> node_connection {
+                return node_connection(find_layer(layer_name)->name_, 0, 0);
+            },
+                layer_names);
+            const auto outputs = run_execution_plan(
+                create_execution_plan(fplus::append(output_connections_, layer_connections)), inputs);
+            return std::make_pair(fplus::take(output_connections_.size(), outputs),
+                fplus::drop(output_connections_.size(), outputs));
+        }
+
+        // For a model with a single output computed by a softmax
+        // (a Softmax layer or the activation of the last layer),
+        // the input of this softmax, i.e., the logits.
+        // Nothing for other models.
+        fplus::maybe<tensor> apply_until_softmax(const tensors& inputs) const
+        {
+            if (output_connections_.size() != 1 || output_connections_.front().tensor_idx_ != 0) {
+                return fplus::nothing<tensor>();
+            }
+            const auto& conn = output_connections_.front();
+            const auto l = get_layer(layers_, conn.layer_id_);
+            const bool is_softmax_layer = std::dynamic_pointer_cast<softmax_layer>(l) != nullptr && !l->has_activation();
+            const bool has_softmax_activation = std::dynamic_pointer_cast<softmax_layer>(l->get_activation()) != nullptr;
+            const auto node_idx = l->local_node_idx(conn.node_idx_);
+            if ((!is_softmax_layer && !has_softmax_activation) || node_idx >= l->nodes_.size()) {
+                return fplus::nothing<tensor>();
+            }
+
+            assertion(inputs.size() == input_connections_.size(),
+                "invalid number of input tensors for this model: " + fplus::show(input_connections_.size()) + " required but " + fplus::show(inputs.size()) + " provided");
+            const memory_accounting_layer_guard accounting(name_);
+            // The plan stops at the inputs of the softmax layer.
+            std::call_once(logits_plan_once_, [&]() {
+                logits_plan_ = create_execution_plan(l->nodes_[node_idx].inbound_connections());
+            });
+            const auto layer_inputs = run_execution_plan(logits_plan_, inputs);
+            const auto logits = is_softmax_layer ? layer_inputs : l->apply_without_activation(layer_inputs);
+            assertion(logits.size() == 1, "invalid number of tensors before softmax");
+            return logits.front();
+        }
+
+        // The layer with the given name.
+        // Layers inside nested models are not searched, because their names
+        // are only unique within the nested model.
+        layer_ptr find_layer(const std::string& layer_name) const
+        {
+            const auto is_named = [&layer_name](const layer_ptr& l) -> bool {
+                return l->name_ == layer_name;
+            };
+            const auto found = fplus::find_first_by(is_named, layers_);
+            assertion(found.is_just(), "no layer named " + layer_name + " in model " + name_ + " (it might have been removed when optimizing the graph)");
+            return found.unsafe_get_just();
+        }
+
+        // Like apply, but runs the chain of convolution, pooling and slice-wise
+        // layers (at most max_layers of them) following the single input
+        // on horizontal bands, computing band_rows output rows of the chain at a time.
+        // So the activations inside the chain never exist for the whole input at once.
+        // The results equal the ones of apply up to float rounding.
+        tensors apply_tiled(const tensors& inputs,
+            std::size_t band_rows, std::size_t max_layers) const
+        {
+            assertion(band_rows > 0, "number of rows per band must be positive");
+            const memory_accounting_layer_guard accounting(name_);
+            output_dict output_cache = create_output_cache(inputs);
+            if (inputs.size() == 1 && inputs.front().shape().rank() == 3) {
+                const auto chain = find_row_chain(inputs.front().shape().height_, max_layers);
+                if (!chain.empty()) {
+                    output_cache[std::make_pair(chain.back().layer_->name_, std::size_t(0))] = { apply_chain_in_bands(chain, inputs.front(), band_rows) };
+                }
+            }
+            return get_outputs(output_cache);
+        }
+
+        // Outputs of the model for all windows of the image with the model's input shape,
+        // which are stride cells of the feature map of the chain of convolution,
+        // pooling and slice-wise layers following the input apart (in both directions).
+        // The chain runs only once on the whole image, and the rest of the model
+        // once per window, on the part of the feature map belonging to it.
+        std::vector<std::vector<tensors>> apply_sliding_window(const tensor& image,
+            const tensor_shape& window_shape, std::size_t stride) const
+        {
+            assertion(stride > 0, "sliding window stride must be positive");
+            assertion(input_connections_.size() == 1 && image.shape().rank() == 3 && window_shape.rank() == 3,
+                "sliding windows need a model with a single input of rank 3");
+            assertion(image.shape().height_ >= window_shape.height_ && image.shape().width_ >= window_shape.width_
+                    && image.shape().depth_ == window_shape.depth_,
+                "image " + show_tensor_shape(image.shape()) + " does not contain windows of shape " + show_tensor_shape(window_shape));
+            const memory_accounting_layer_guard accounting(name_);
+
+            const std::size_t band_rows = 16;
+            const auto max_layers = std::numeric_limits<std::size_t>::max();
+            const auto chain = find_row_chain(image.shape().height_, max_layers);
+            const auto features = chain.empty() ? image : apply_chain_in_bands(chain, image, band_rows);
+            // The size of the feature map of a single window is simply measured.
+            const auto window_chain = find_row_chain(window_shape.height_, max_layers);
+            assertion(window_chain.size() == chain.size(), "invalid layer chain for the windows");
+            const auto window_features_shape = chain.empty()
+                ? window_shape
+                : apply_chain_in_bands(window_chain, tensor(window_shape, 0), band_rows).shape();
+            const auto features_key = chain.empty()
+                ? input_connections_.front().without_tensor_idx()
+                : std::make_pair(chain.back().layer_->name_, std::size_t(0));
+
+            const auto& fs = features.shape();
+            const auto& ws = window_features_shape;
+            assertion(fs.height_ >= ws.height_ && fs.width_ >= ws.width_ && fs.depth_ == ws.depth_,
+                "invalid feature map shape for sliding windows");
+            std::vector<std::vector<tensors>> result;
+            for (std::size_t y = 0; y + ws.height_ <= fs.height_; y += stride) {
+                std::vector<tensors> row;
+                for (std::size_t x = 0; x + ws.width_ <= fs.width_; x += stride) {
+                    output_dict output_cache;
+                    output_cache[features_key] = { crop_tensor(0, 0,
+                        y, fs.height_ - y - ws.height_, x, fs.width_ - x - ws.width_, features) };
+                    row.push_back(get_outputs(output_cache));
+                }
+                result.push_back(row);
+            }
+            return result;
+        }
+
+        typedef std::pair<std::string, std::size_t> output_key;
+
+        // Consecutive parts of the nodes of the model, in execution order.
+        struct pipeline_plan {
+            std::vector<node_connections> stages_;
+            // Per stage, the cached outputs not needed after it anymore.
+            std::vector<std::vector<output_key>> dead_after_stage_;
+        };
+
+        // Splits the nodes into at most stage_count stages of about the same
+        // run time, measured by applying the model to inputs.
+        // The outputs of this run are returned too.
+        std::pair<pipeline_plan, tensors> plan_pipeline(const tensors& inputs,
+            std::size_t stage_count) const
+        {
+            assertion(stage_count > 0, "number of pipeline stages must be positive");
+            const auto order = execution_order(output_connections_);
+            output_dict output_cache = create_output_cache(inputs);
+            std::vector<double> times;
+            for (const auto& conn : order) {
+                const auto start = std::chrono::steady_clock::now();
+                get_layer(layers_, conn.layer_id_)->get_output(layers_, output_cache, conn.node_idx_, 0);
+                const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                times.push_back(elapsed.count());
+            }
+            const double total = fplus::sum(times);
+
+            // Every node goes to the stage its midpoint in time falls into.
+            std::vector<node_connections> stages(stage_count);
+            double done = 0;
+            for (std::size_t i = 0; i < order.size(); ++i) {
+                const double position = total > 0
+                    ? (done + times[i] / 2) / total
+                    : static_cast<double>(i) / static_cast<double>(order.size());
+                const auto stage = std::min(stage_count - 1,
+                    static_cast<std::size_t>(position * static_cast<double>(stage_count)));
+                stages[stage].push_back(order[i]);
+                done += times[i];
+            }
+            stages.erase(std::remove_if(stages.begin(), stages.end(),
+                             [](const node_connections& stage) { return stage.empty(); }),
+                stages.end());
+
+            // Outputs can be dropped after the last stage using them.
+            std::map<output_key, std::size_t> last_use;
+            for (std::size_t s = 0; s < stages.size(); ++s) {
+                for (const auto& conn : stages[s]) {
+                    const auto& l = get_layer(layers_, conn.layer_id_);
+                    for (const auto& input : l->nodes_[l->local_node_idx(conn.node_idx_)].inbound_connections()) {
+                        last_use[cache_key(input)] = s;
+                    }
+                }
+            }
+            std::set<output_key> model_outputs;
+            for (const auto& conn : output_connections_) {
+                model_outputs.insert(cache_key(conn));
+            }
+            std::vector<std::vector<output_key>> dead_after_stage(stages.size());
+            for (const auto& entry : last_use) {
+                if (model_outputs.count(entry.first) == 0) {
+                    dead_after_stage[entry.second].push_back(entry.first);
+                }
+            }
+            return std::make_pair(pipeline_plan({ stages, dead_after_stage }), get_outputs(output_cache));
+        }
+
+        // Applies the model to all inputs, every stage of the plan running
+        // in its own thread, so the stages work on consecutive inputs at the same time.
+        std::vector<tensors> apply_pipelined(const pipeline_plan& plan,
+            const std::vector<tensors>& inputs_vec, bool pin_threads) const
+        {
+            std::vector<std::function<void(output_dict&)>> stages;
+            for (std::size_t s = 0; s < plan.stages_.size(); ++s) {
+                stages.push_back([this, &plan, s](output_dict& output_cache) {
+                    for (const auto& conn : plan.stages_[s]) {
+                        get_layer(layers_, conn.layer_id_)->get_output(layers_, output_cache, conn.node_idx_, 0);
+                    }
+                    for (const auto& key : plan.dead_after_stage_[s]) {
+                        output_cache.erase(key);
+                    }
+                });
+            }
+            const std::size_t queue_capacity = 2;
+            auto output_caches = run_pipeline(stages,
+                fplus::transform([this](const tensors& inputs) { return create_output_cache(inputs); }, inputs_vec),
+                queue_capacity, pin_threads);
+            std::vector<tensors> result;
+            for (auto& output_cache : output_caches) {
+                result.push_back(get_outputs(output_cache));
+            }
+            return result;
+        }
+
     protected:
+        // Every output of a step (and every model input) is stored in a slot,
+        // which is freed after the last step using it.
+        typedef std::pair<std::size_t, std::size_t> slot_and_tensor_idx;
+        struct execution_step {
+            layer_ptr layer_;
+            std::vector<slot_and_tensor_idx> inputs_;
+            std::vector<std::size_t> freed_slots_;
+        };
+
+        // The nodes needed for the outputs in execution order,
+        // with the layers and inputs already looked up.
+        struct execution_plan {
+            std::vector<execution_step> steps_;
+            std::vector<slot_and_tensor_idx> outputs_;
+        };
+
         tensors apply_impl(const tensors& inputs) const override
+        {
+            assertion(inputs.size() == input_connections_.size(),
+                "invalid number of input tensors for this model: " + fplus::show(input_connections_.size()) + " required but " + fplus::show(inputs.size()) + " provided");
+            std::call_once(execution_plan_once_, [this]() {
+                execution_plan_ = create_execution_plan(output_connections_);
+            });
+            return run_execution_plan(execution_plan_, inputs);
+        }
+
+        tensors run_execution_plan(const execution_plan& plan, const tensors& inputs) const
+        {
+            std::vector<tensors> slots(inputs.size() + plan.steps_.size());
+            for (std::size_t i = 0; i < inputs.size(); ++i) {
+                slots[i] = { inputs[i] };
+            }
+            const auto get_tensor = [&slots](const slot_and_tensor_idx& input) -> tensor {
+                assertion(input.second < slots[input.first].size(), "invalid tensor index");
+                return slots[input.first][input.second];
+            };
+            for (std::size_t s = 0; s < plan.steps_.size(); ++s) {
+                const auto& step = plan.steps_[s];
+                slots[inputs.size() + s] = step.layer_->apply(fplus::transform(get_tensor, step.inputs_));
+                for (const auto slot : step.freed_slots_) {
+                    slots[slot].clear();
+                }
+            }
+            return fplus::transform(get_tensor, plan.outputs_);
+        }
+
+        // The plan computing the given outputs (of the layers of the model),
+        // which are kept until the end.
+        execution_plan create_execution_plan(const node_connections& outputs) const
+        {
+            std::map<output_key, std::size_t> slots;
+            for (std::size_t i = 0; i < input_connections_.size(); ++i) {
+                slots[cache_key(input_connections_[i])] = i;
+            }
+            const auto get_slot = [this, &slots](const node_connection& conn) -> slot_and_tensor_idx {
+                const auto it = slots.find(cache_key(conn));
+                assertion(it != slots.end(), "missing input of layer " + conn.layer_id_);
+                return std::make_pair(it->second, conn.tensor_idx_);
+            };
+
+            execution_plan plan;
+            for (const auto& conn : execution_order(outputs)) {
+                const auto l = get_layer(layers_, conn.layer_id_);
+                const auto& layer_node = l->nodes_[l->local_node_idx(conn.node_idx_)];
+                plan.steps_.push_back({ l, fplus::transform(get_slot, layer_node.inbound_connections()), {} });
+                slots[cache_key(conn)] = input_connections_.size() + plan.steps_.size() - 1;
+            }
+            plan.outputs_ = fplus::transform(get_slot, outputs);
+
+            const std::size_t no_step = std::numeric_limits<std::size_t>::max();
+            std::vector<std::size_t> last_use(input_connections_.size() + plan.steps_.size(), no_step);
+            for (std::size_t s = 0; s < plan.steps_.size(); ++s) {
+                for (const auto& input : plan.steps_[s].inputs_) {
+                    last_use[input.first] = s;
+                }
+            }
+            for (const auto& output : plan.outputs_) {
+                last_use[output.first] = no_step;
+            }
+            for (std::size_t slot = 0; slot < last_use.size(); ++slot) {
+                if (last_use[slot] != no_step) {
+                    plan.steps_[last_use[slot]].freed_slots_.push_back(slot);
+                }
+            }
+            return plan;
+        }
+
+        output_dict create_output_cache(const tensors& inputs) const
         {
             output_dict output_cache;
 
@@ -58,15 +409,157 @@ namespace internal {
             for (std::size_t i = 0; i < inputs.size(); ++i) {
                 output_cache[input_connections_[i].without_tensor_idx()] = { inputs[i] };
             }
+            return output_cache;
+        }
 
+        tensors get_outputs(output_dict& output_cache) const
+        {
             const auto get_output = [this, &output_cache](const node_connection& conn) -> tensor {
                 return get_layer(layers_, conn.layer_id_)->get_output(layers_, output_cache, conn.node_idx_, conn.tensor_idx_);
             };
             return fplus::transform(get_output, output_connections_);
         }
+
+        // The key of the outputs of a connection in the output cache.
+        output_key cache_key(const node_connection& conn) const
+        {
+            return std::make_pair(conn.layer_id_, get_layer(layers_, conn.layer_id_)->local_node_idx(conn.node_idx_));
+        }
+
+        // The nodes needed for the outputs (apart from the inputs),
+        // every one after the nodes it depends on.
+        node_connections execution_order(const node_connections& outputs) const
+        {
+            node_connections result;
+            std::set<output_key> visited;
+            for (const auto& conn : input_connections_) {
+                visited.insert(cache_key(conn));
+            }
+            std::function<void(const node_connection&)> visit = [&](const node_connection& conn) {
+                const auto key = cache_key(conn);
+                if (!visited.insert(key).second) {
+                    return;
+                }
+                const auto& l = get_layer(layers_, conn.layer_id_);
+                assertion(key.second < l->nodes_.size(), "invalid node index");
+                for (const auto& input : l->nodes_[key.second].inbound_connections()) {
+                    visit(input);
+                }
+                result.push_back(node_connection(conn.layer_id_, conn.node_idx_, 0));
+            };
+            for (const auto& conn : outputs) {
+                visit(conn);
+            }
+            return result;
+        }
+
+        struct row_chain_step {
+            layer_ptr layer_;
+            std::size_t in_height_;
+            // Nothing for slice-wise layers, which map every row to itself.
+            fplus::maybe<row_window> window_;
+        };
+
+        // The layers that can be run on bands of rows, starting after the input
+        // as long as every output is only used by the next layer.
+        std::vector<row_chain_step> find_row_chain(std::size_t in_height, std::size_t max_layers) const
+        {
+            const auto same_connection = [](const node_connection& a, const node_connection& b) {
+                return a.layer_id_ == b.layer_id_ && a.node_idx_ == b.node_idx_ && a.tensor_idx_ == b.tensor_idx_;
+            };
+            std::vector<row_chain_step> result;
+            node_connection current = input_connections_.front();
+            while (result.size() < max_layers) {
+                const bool is_model_output = fplus::any_by([&](const node_connection& conn) {
+                    return same_connection(conn, current);
+                },
+                    output_connections_);
+                if (is_model_output) {
+                    break;
+                }
+                layer_ptr consumer;
+                std::size_t consumer_count = 0;
+                for (const auto& l : layers_) {
+                    for (const auto& n : l->nodes_) {
+                        for (const auto& conn : n.inbound_connections()) {
+                            if (same_connection(conn, current)) {
+                                consumer = l;
+                                ++consumer_count;
+                            }
+                        }
+                    }
+                }
+                if (consumer_count != 1 || consumer->nodes_.size() != 1
+                    || consumer->nodes_.front().inbound_connections().size() != 1) {
+                    break;
+                }
+                const auto window = consumer->get_row_window(in_height);
+                if (window.is_nothing() && !consumer->is_slice_wise()) {
+                    break;
+                }
+                result.push_back({ consumer, in_height, window });
+                if (window.is_just()) {
+                    in_height = window.unsafe_get_just().out_height_;
+                }
+                current = node_connection(consumer->name_, 0, 0);
+            }
+            return result;
+        }
+
+        static tensor apply_chain_in_bands(const std::vector<row_chain_step>& chain,
+            const tensor& input, std::size_t band_rows)
+        {
+            typedef std::pair<std::size_t, std::size_t> row_range;
+            const auto& last = chain.back();
+            const std::size_t out_height = last.window_.is_just() ? last.window_.unsafe_get_just().out_height_ : last.in_height_;
+            const std::size_t in_row_size = input.shape().width_ * input.shape().depth_;
+
+            float_vec result_values;
+            std::size_t out_width = 0;
+            std::size_t out_depth = 0;
+            for (std::size_t out_begin = 0; out_begin < out_height; out_begin += band_rows) {
+                // The rows every layer has to compute for this band, from the last layer back.
+                std::vector<row_range> out_rows(chain.size());
+                row_range rows(out_begin, std::min(out_height, out_begin + band_rows));
+                for (std::size_t i = chain.size(); i-- > 0;) {
+                    out_rows[i] = rows;
+                    if (chain[i].window_.is_just()) {
+                        rows = row_window_input_rows(chain[i].window_.unsafe_get_just(),
+                            chain[i].in_height_, rows.first, rows.second);
+                    }
+                }
+
+                const float_type* input_ptr = input.as_vector()->data();
+                tensor band(tensor_shape(rows.second - rows.first, input.shape().width_, input.shape().depth_),
+                    float_vec(input_ptr + rows.first * in_row_size, input_ptr + rows.second * in_row_size));
+                for (std::size_t i = 0; i < chain.size(); ++i) {
+                    if (chain[i].window_.is_just()) {
+                        band = chain[i].layer_->apply_to_rows(band, chain[i].in_height_, out_rows[i].first, out_rows[i].second);
+                    } else {
+                        band = single_tensor_from_tensors(chain[i].layer_->apply({ band }));
+                    }
+                }
+
+                if (result_values.empty()) {
+                    out_width = band.shape().width_;
+                    out_depth = band.shape().depth_;
+                    result_values.resize(out_height * out_width * out_depth);
+                }
+                assertion(band.shape() == tensor_shape(out_rows.back().second - out_begin, out_width, out_depth),
+                    "invalid band shape");
+                std::copy(band.as_vector()->begin(), band.as_vector()->end(),
+                    result_values.data() + out_begin * out_width * out_depth);
+            }
+            return tensor(tensor_shape(out_height, out_width, out_depth), std::move(result_values));
+        }
         layer_ptrs layers_;
         node_connections input_connections_;
         node_connections output_connections_;
+        std::vector<std::string> graph_rewrites_;
+        mutable std::once_flag execution_plan_once_;
+        mutable execution_plan execution_plan_;
+        mutable std::once_flag logits_plan_once_;
+        mutable execution_plan logits_plan_;
     };
 
 }
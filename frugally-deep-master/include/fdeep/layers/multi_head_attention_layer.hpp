@@ -8,8 +8,9 @@
 
 #include "fdeep/layers/dense_layer.hpp"
 #include "fdeep/layers/layer.hpp"
-#include "fdeep/layers/softmax_layer.hpp"
+#include "fdeep/matmul.hpp"
 
+#include <cmath>
 #include <string>
 
 namespace fdeep {
@@ -24,39 +25,62 @@ namespace internal {
             , num_heads_(num_heads)
             , key_dim_(key_dim)
             , value_dim_(value_dim)
-            , query_dense_(create_dense_layers(weights_and_biases, use_bias, num_heads, 0, key_dim, name + "_query_dense"))
-            , value_dense_(create_dense_layers(weights_and_biases, use_bias, num_heads, 2, value_dim, name + "_value_dense"))
-            , key_dense_(create_dense_layers(weights_and_biases, use_bias, num_heads, 1, key_dim, name + "_key_dense"))
+            , projection_weights_(create_projection_weights(weights_and_biases, use_bias))
+            , projection_bias_(create_projection_bias(weights_and_biases, use_bias))
             , output_dense_(create_output_dense_layer(weights_and_biases, use_bias, name + "_output_dense"))
         {
         }
 
     private:
-        std::vector<dense_layer> create_dense_layers(
-            const tensors& weights_and_biases, bool use_bias, const std::size_t num_heads,
-            const std::size_t index, const std::size_t units, const std::string& name)
+        // The query, key and value kernels (dim, num_heads, units)
+        // already are (dim x (num_heads * units)) row-major matrices.
+        // They are stored side by side, so that the projections
+        // of all heads can be done with a single GEMM.
+        void check_projection_params(const tensors& weights_and_biases, bool use_bias,
+            std::size_t index, std::size_t units) const
         {
             assertion(index <= 2, "Invalid dense layer index.");
             const std::size_t index_factor = use_bias ? 2 : 1;
-            const tensor weights = weights_and_biases[index_factor * index];
-            const tensor biases = use_bias ? weights_and_biases[index_factor * index + 1] : tensor(tensor_shape(num_heads, units), 0);
-
+            const tensor& weights = weights_and_biases[index_factor * index];
             assertion(weights.shape().depth_ == units, "Invalid weights shape for attention head dimension.");
-            assertion(biases.shape().depth_ == units, "Invalid biases shape for attention head dimension.");
-
-            const auto weights_per_head = tensor_to_tensors_width_slices(weights);
-            const auto biases_per_head = tensor_to_tensors_width_slices(biases);
-            assertion(weights_per_head.size() == num_heads, "Invalid weights for number of heads.");
-            assertion(biases_per_head.size() == num_heads, "Invalid biases for number of heads.");
-            return fplus::transform(
-                [&](const std::pair<std::size_t, std::pair<tensor, tensor>>& n_and_w_with_b) {
-                    return dense_layer(
-                        name + "_" + std::to_string(n_and_w_with_b.first),
-                        units,
-                        *n_and_w_with_b.second.first.as_vector(),
-                        *n_and_w_with_b.second.second.as_vector());
-                },
-                fplus::enumerate(fplus::zip(weights_per_head, biases_per_head)));
+            assertion(weights.shape().width_ == num_heads_, "Invalid weights for number of heads.");
+            if (use_bias) {
+                const tensor& biases = weights_and_biases[index_factor * index + 1];
+                assertion(biases.shape().depth_ == units, "Invalid biases shape for attention head dimension.");
+                assertion(biases.shape().width_ == num_heads_, "Invalid biases for number of heads.");
+            }
+        }
+        RowMajorMatrixXf create_projection_weights(
+            const tensors& weights_and_biases, bool use_bias) const
+        {
+            check_projection_params(weights_and_biases, use_bias, 0, key_dim_);
+            check_projection_params(weights_and_biases, use_bias, 1, key_dim_);
+            check_projection_params(weights_and_biases, use_bias, 2, value_dim_);
+            const std::size_t index_factor = use_bias ? 2 : 1;
+            const tensor& query_weights = weights_and_biases[0];
+            const tensor& key_weights = weights_and_biases[index_factor];
+            const tensor& value_weights = weights_and_biases[index_factor * 2];
+            const std::size_t dim = query_weights.shape().height_;
+            assertion(key_weights.shape().height_ == dim && value_weights.shape().height_ == dim,
+                "Invalid input dimension of attention projections.");
+            RowMajorMatrixXf result(static_cast<EigenIndex>(dim),
+                static_cast<EigenIndex>(num_heads_ * (2 * key_dim_ + value_dim_)));
+            result << eigen_row_major_mat_from_values(dim, num_heads_ * key_dim_, *query_weights.as_vector()),
+                eigen_row_major_mat_from_values(dim, num_heads_ * key_dim_, *key_weights.as_vector()),
+                eigen_row_major_mat_from_values(dim, num_heads_ * value_dim_, *value_weights.as_vector());
+            return result;
+        }
+        RowMajorMatrixXf create_projection_bias(
+            const tensors& weights_and_biases, bool use_bias) const
+        {
+            RowMajorMatrixXf result = RowMajorMatrixXf::Zero(1,
+                static_cast<EigenIndex>(num_heads_ * (2 * key_dim_ + value_dim_)));
+            if (use_bias) {
+                result << eigen_row_major_mat_from_values(1, num_heads_ * key_dim_, *weights_and_biases[1].as_vector()),
+                    eigen_row_major_mat_from_values(1, num_heads_ * key_dim_, *weights_and_biases[3].as_vector()),
+                    eigen_row_major_mat_from_values(1, num_heads_ * value_dim_, *weights_and_biases[5].as_vector());
+            }
+            return result;
         }
         dense_layer create_output_dense_layer(
             const tensors& weights_and_biases, bool use_bias, const std::string& name)
@@ -67,53 +91,95 @@ namespace internal {
             const tensor biases = use_bias ? weights_and_biases[index_factor * 3 + 1] : tensor(tensor_shape(units), 0);
             return dense_layer(name + "_output", units, *weights.as_vector(), *biases.as_vector());
         }
-        tensors extract_biases(const tensors& saved_weights, bool use_bias)
+        // Projects the input with the projection columns [col_begin, col_begin + col_count).
+        RowMajorMatrixXf project(const tensor& input,
+            std::size_t col_begin, std::size_t col_count) const
         {
-            return use_bias ? fplus::unweave(saved_weights).second : tensors();
+            const Eigen::Map<const RowMajorMatrixXf, Eigen::Unaligned> input_map(
+                input.as_vector()->data(),
+                static_cast<EigenIndex>(input.shape().width_),
+                static_cast<EigenIndex>(input.shape().depth_));
+            RowMajorMatrixXf result = input_map * projection_weights_.middleCols(static_cast<EigenIndex>(col_begin), static_cast<EigenIndex>(col_count));
+            result.rowwise() += projection_bias_.row(0).segment(static_cast<EigenIndex>(col_begin), static_cast<EigenIndex>(col_count));
+            return result;
         }
-        tensor apply_head(
-            const tensor& query_raw,
-            const tensor& value_raw,
-            const tensor& key_raw,
-            std::size_t head_index) const
+        static strided_matrix head_view(RowMajorMatrixXf& projected,
+            std::size_t col_begin, std::size_t head_size, std::size_t head_index)
         {
+            return { projected.data() + col_begin + head_index * head_size,
+                static_cast<std::size_t>(projected.rows()), head_size,
+                static_cast<std::size_t>(projected.cols()), 1 };
+        }
+
+    protected:
+        tensors apply_impl(const tensors& input) const override
+        {
+            assertion(input.size() == 2 || input.size() == 3, "Invalid number of inputs for MultiHeadAttention layer.");
+            const tensor& query_raw = input[0];
+            const tensor& value_raw = input[1];
+            const tensor& key_raw = input.size() > 2 ? input[2] : value_raw;
             assertion(
                 query_raw.shape().rank() == 2 && value_raw.shape().rank() == 2 && key_raw.shape().rank() == 2 && query_raw.shape().depth_ == value_raw.shape().depth_ && query_raw.shape().depth_ == key_raw.shape().depth_ && value_raw.shape().width_ == key_raw.shape().width_,
                 "Invalid shapes; need a query tensor of shape (B, T, dim) and a value/key tensor of shape (B, S, dim).");
-            const tensor query = query_dense_[head_index].apply({ query_raw }).front();
-            const tensor value = value_dense_[head_index].apply({ value_raw }).front();
-            const tensor key = key_dense_[head_index].apply({ key_raw }).front();
 
             // https://towardsdatascience.com/transformers-explained-visually-part-3-multi-head-attention-deep-dive-1c1ff1024853
             // https://dmol.pub/dl/attention.html#multi-head-attention-block
             // https://github.com/keras-team/keras/blob/v2.14.0/keras/layers/attention/multi_head_attention.py
             // https://gist.github.com/sevagh/b71d253a347a9b59c026580625452fc5
-            const tensor scores = dot_product_tensors(query, transpose(key), std::vector<int>({ 2, 1 }), false);
-            const std::size_t query_size = query.shape().depth_;
-            const tensor distribution = softmax(transform_tensor(fplus::multiply_with(1 / std::sqrt(query_size)), scores));
-            return dot_product_tensors(distribution, value, std::vector<int>({ 2, 1 }), false);
-        }
+            const std::size_t q_cols = num_heads_ * key_dim_;
+            const std::size_t k_cols = num_heads_ * key_dim_;
+            const std::size_t v_cols = num_heads_ * value_dim_;
+            const auto same_values = [](const tensor& a, const tensor& b) {
+                return a.as_vector()->data() == b.as_vector()->data();
+            };
 
-    protected:
-        tensors apply_impl(const tensors& input) const override
-        {
-            assertion(input.size() == 2 || input.size() == 3, "Invalid number of inputs for MultiHeadAttention layer.");
-            const tensor query_raw = input[0];
-            const tensor value_raw = input[1];
-            const tensor key_raw = input.size() > 2 ? input[2] : value_raw;
-            const auto outputs = fplus::transform([&](const std::size_t head_idx) {
-                return apply_head(query_raw, value_raw, key_raw, head_idx);
-            },
-                fplus::numbers<std::size_t>(0, num_heads_));
-            const tensor merged = concatenate_tensors_depth(outputs);
+            // Inputs that are the same tensor (e.g., self-attention)
+            // share one projection GEMM.
+            RowMajorMatrixXf projected_q;
+            RowMajorMatrixXf projected_kv;
+            strided_matrix q_view, k_view, v_view;
+            if (same_values(query_raw, key_raw) && same_values(query_raw, value_raw)) {
+                projected_q = project(query_raw, 0, q_cols + k_cols + v_cols);
+                q_view = head_view(projected_q, 0, key_dim_, 0);
+                k_view = head_view(projected_q, q_cols, key_dim_, 0);
+                v_view = head_view(projected_q, q_cols + k_cols, value_dim_, 0);
+            } else {
+                projected_q = project(query_raw, 0, q_cols);
+                q_view = head_view(projected_q, 0, key_dim_, 0);
+                if (same_values(key_raw, value_raw)) {
+                    projected_kv = project(key_raw, q_cols, k_cols + v_cols);
+                    k_view = head_view(projected_kv, 0, key_dim_, 0);
+                    v_view = head_view(projected_kv, k_cols, value_dim_, 0);
+                } else {
+                    projected_kv.resize(static_cast<EigenIndex>(key_raw.shape().width_),
+                        static_cast<EigenIndex>(k_cols + v_cols));
+                    projected_kv << project(key_raw, q_cols, k_cols), project(value_raw, q_cols + k_cols, v_cols);
+                    k_view = head_view(projected_kv, 0, key_dim_, 0);
+                    v_view = head_view(projected_kv, k_cols, value_dim_, 0);
+                }
+            }
+
+            // The heads write their results directly into
+            // the slices of the concatenated tensor.
+            const std::size_t query_count = query_raw.shape().width_;
+            tensor merged(tensor_shape(query_count, v_cols), static_cast<float_type>(0));
+            const float_type scale = static_cast<float_type>(1 / std::sqrt(key_dim_));
+            for (std::size_t head_idx = 0; head_idx < num_heads_; ++head_idx) {
+                scaled_dot_product_attention(
+                    strided_matrix_offset(q_view, head_idx * key_dim_),
+                    strided_matrix_offset(k_view, head_idx * key_dim_),
+                    strided_matrix_offset(v_view, head_idx * value_dim_),
+                    scale,
+                    { merged.as_vector()->data() + head_idx * value_dim_,
+                        query_count, value_dim_, v_cols, 1 });
+            }
             return output_dense_.apply({ merged });
         }
         std::size_t num_heads_;
         std::size_t key_dim_;
         std::size_t value_dim_;
-        std::vector<dense_layer> query_dense_;
-        std::vector<dense_layer> value_dense_;
-        std::vector<dense_layer> key_dense_;
+        RowMajorMatrixXf projection_weights_;
+        RowMajorMatrixXf projection_bias_;
         dense_layer output_dense_;
     };
 
@@ -31,6 +31,29 @@ namespace internal {
             assertion(axes.size() <= 1, "Unsupported number of axes for Normalization layer");
         }
 
+        const std::vector<int>& axes() const
+        {
+            return axes_;
+        }
+
+        // The normalization as x -> scale * x + offset,
+        // with one scale and offset per entry of the normalized axis.
+        float_vec affine_scales() const
+        {
+            return fplus::transform_convert<float_vec>([](float_type v) -> float_type {
+                return static_cast<float_type>(1 / std::fmax(std::sqrt(v), 1e-7));
+            },
+                variance_);
+        }
+        float_vec affine_offsets() const
+        {
+            float_vec offsets = affine_scales();
+            for (std::size_t i = 0; i < offsets.size(); ++i) {
+                offsets[i] *= -mean_[i];
+            }
+            return offsets;
+        }
+
     protected:
         tensors apply_impl(const tensors& inputs) const override final
         {
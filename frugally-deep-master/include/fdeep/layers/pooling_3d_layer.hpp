@@ -11,6 +11,7 @@
 
 #include <fplus/fplus.hpp>
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <string>
@@ -19,12 +20,28 @@
 namespace fdeep {
 namespace internal {
 
+    // Pools all channels of one output position at once.
+    // The window bounds are already clipped to the valid (unpadded) input region,
+    // so the inner functions do not need to check every single access.
     typedef void (*inner_pooling_func)(
-        const tensor&, tensor& out,
-        std::size_t, std::size_t, std::size_t,
-        std::size_t, std::size_t, std::size_t,
-        std::size_t, std::size_t, std::size_t, std::size_t,
-        int, int, int);
+        const float_type* in_ptr, float_type* out_ptr,
+        std::size_t in_height, std::size_t in_width, std::size_t depth,
+        std::size_t d4_begin, std::size_t d4_end,
+        std::size_t y_begin, std::size_t y_end,
+        std::size_t x_begin, std::size_t x_end);
+
+    inline std::size_t pooling_window_begin(std::size_t out_idx, std::size_t stride, int pad)
+    {
+        return static_cast<std::size_t>(std::max(0, static_cast<int>(out_idx * stride) - pad));
+    }
+
+    inline std::size_t pooling_window_end(std::size_t out_idx, std::size_t stride, int pad,
+        std::size_t pool_size, std::size_t in_size)
+    {
+        // Never ends before it begins, so empty windows stay empty.
+        return std::max(pooling_window_begin(out_idx, stride, pad),
+            static_cast<std::size_t>(std::max(0, std::min(static_cast<int>(in_size), static_cast<int>(out_idx * stride + pool_size) - pad))));
+    }
 
     // Abstract base class for pooling layers
     class pooling_3d_layer : public layer {
@@ -42,39 +59,65 @@ namespace internal {
 
     protected:
         tensor pool(const tensor& in) const
+        {
+            const auto out_height = preprocess_convolution_3d(
+                pool_size_, strides_, padding_, in.shape().size_dim_4_, in.shape().height_, in.shape().width_)
+                                        .out_height_;
+            return pool_rows(in, in.shape().height_, 0, out_height);
+        }
+
+        // Output rows [out_begin, out_end) for an input with in_height rows,
+        // of which only the rows from the first one the output rows depend on are given.
+        tensor pool_rows(const tensor& in, std::size_t in_height,
+            std::size_t out_begin, std::size_t out_end) const
         {
             const auto conv_cfg = preprocess_convolution_3d(
                 shape3(pool_size_.size_dim_4_, pool_size_.height_, pool_size_.width_),
                 shape3(strides_.size_dim_4_, strides_.height_, strides_.width_),
-                padding_, in.shape().size_dim_4_, in.shape().height_, in.shape().width_);
+                padding_, in.shape().size_dim_4_, in_height, in.shape().width_);
 
             int pad_front_int = static_cast<int>(conv_cfg.pad_front_);
             int pad_top_int = static_cast<int>(conv_cfg.pad_top_);
             int pad_left_int = static_cast<int>(conv_cfg.pad_left_);
 
             const std::size_t out_size_d4 = conv_cfg.out_size_d4_;
-            const std::size_t out_height = conv_cfg.out_height_;
             const std::size_t out_width = conv_cfg.out_width_;
 
+            const std::size_t in_first_row = pooling_window_begin(out_begin, strides_.height_, pad_top_int);
+            const std::size_t in_rows = in.shape().height_;
+            const std::size_t in_width = in.shape().width_;
+            const std::size_t depth = in.shape().depth_;
+
             tensor out(
                 tensor_shape_with_changed_rank(
-                    tensor_shape(out_size_d4, out_height, out_width, in.shape().depth_),
+                    tensor_shape(out_size_d4, out_end - out_begin, out_width, depth),
                     in.shape().rank()),
                 0);
 
-            for (std::size_t d4 = 0; d4 < out_size_d4; ++d4) {
-                for (std::size_t y = 0; y < out_height; ++y) {
+            const float_type* in_ptr = in.as_vector()->data();
+            float_type* const out_data = out.as_vector()->data();
+            const std::size_t slice_size = (out_end - out_begin) * out_width * depth;
+
+            // The output depth slices of volumes are distributed among the threads of the worker pool.
+            const std::size_t parts = slice_thread_count(out_size_d4, slice_size * pool_size_.volume());
+            for_slices_parallelly(out_size_d4, parts, [&](std::size_t d4, std::size_t) {
+                float_type* out_ptr = out_data + d4 * slice_size;
+                const std::size_t d4_begin = pooling_window_begin(d4, strides_.size_dim_4_, pad_front_int);
+                const std::size_t d4_end = pooling_window_end(d4, strides_.size_dim_4_, pad_front_int, pool_size_.size_dim_4_, in.shape().size_dim_4_);
+                for (std::size_t y = out_begin; y < out_end; ++y) {
+                    const std::size_t y_begin = pooling_window_begin(y, strides_.height_, pad_top_int) - in_first_row;
+                    const std::size_t y_end = pooling_window_end(y, strides_.height_, pad_top_int, pool_size_.height_, in_height) - in_first_row;
+                    assertion(y_end <= in_rows, "invalid number of input rows");
                     for (std::size_t x = 0; x < out_width; ++x) {
-                        for (std::size_t z = 0; z < in.shape().depth_; ++z) {
-                            inner_f_(in, out,
-                                pool_size_.size_dim_4_, pool_size_.height_, pool_size_.width_,
-                                strides_.size_dim_4_, strides_.height_, strides_.width_,
-                                d4, y, x, z,
-                                pad_front_int, pad_top_int, pad_left_int);
-                        }
+                        const std::size_t x_begin = pooling_window_begin(x, strides_.width_, pad_left_int);
+                        const std::size_t x_end = pooling_window_end(x, strides_.width_, pad_left_int, pool_size_.width_, in_width);
+                        inner_f_(in_ptr, out_ptr,
+                            in_rows, in_width, depth,
+                            d4_begin, d4_end, y_begin, y_end, x_begin, x_end);
+                        out_ptr += depth;
                     }
                 }
-            }
+            });
             return out;
         }
 
@@ -84,6 +127,22 @@ namespace internal {
             return { pool(input) };
         }
 
+        // Only 2D pooling (no pooling along dimension 4) can work on rows.
+        fplus::maybe<row_window> get_row_window_impl(std::size_t in_height) const override
+        {
+            if (pool_size_.size_dim_4_ != 1 || strides_.size_dim_4_ != 1) {
+                return fplus::nothing<row_window>();
+            }
+            const auto conv_cfg = preprocess_convolution_3d(
+                pool_size_, strides_, padding_, 1, in_height, pool_size_.width_);
+            return row_window({ pool_size_.height_, strides_.height_, conv_cfg.pad_top_, conv_cfg.out_height_ });
+        }
+        tensor apply_to_rows_impl(const tensor& in_rows, std::size_t in_height,
+            std::size_t out_begin, std::size_t out_end) const override
+        {
+            return pool_rows(in_rows, in_height, out_begin, out_end);
+        }
+
         shape3 pool_size_;
         shape3 strides_;
         padding padding_;
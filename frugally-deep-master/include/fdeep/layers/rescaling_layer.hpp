@@ -24,6 +24,22 @@ namespace internal {
         {
         }
 
+        float_type scale() const
+        {
+            return scale_;
+        }
+        float_type offset() const
+        {
+            return offset_;
+        }
+
+        // Merges a preceding x -> scale * x + offset into this layer.
+        void prepend_affine(float_type scale, float_type offset)
+        {
+            offset_ = scale_ * offset + offset_;
+            scale_ = scale_ * scale;
+        }
+
     protected:
         float_type scale_;
         float_type offset_;
@@ -11,6 +11,7 @@
 #include "fdeep/layers/layer.hpp"
 #include "fdeep/shape2.hpp"
 #include "fdeep/tensor_shape.hpp"
+#include "fdeep/weight_store.hpp"
 
 #include <fplus/fplus.hpp>
 
@@ -43,6 +44,12 @@ namespace internal {
         {
         }
 
+        void share_weights(weight_store& store) override
+        {
+            depthwise_layer_.share_weights(store);
+            filters_pointwise_.filter_mats_ = share_tensor_values(store, filters_pointwise_.filter_mats_);
+        }
+
     protected:
         tensors apply_impl(const tensors& inputs) const override
         {
@@ -50,6 +57,16 @@ namespace internal {
             const auto temp_single = single_tensor_from_tensors(temp);
             return { convolve(shape2(1, 1), padding::valid, filters_pointwise_, temp_single) };
         }
+        fplus::maybe<row_window> get_row_window_impl(std::size_t in_height) const override
+        {
+            return depthwise_layer_.get_row_window(in_height);
+        }
+        tensor apply_to_rows_impl(const tensor& in_rows, std::size_t in_height,
+            std::size_t out_begin, std::size_t out_end) const override
+        {
+            const auto temp = depthwise_layer_.apply_to_rows(in_rows, in_height, out_begin, out_end);
+            return convolve(shape2(1, 1), padding::valid, filters_pointwise_, temp);
+        }
 
         depthwise_conv_2d_layer depthwise_layer_;
         convolution_filter_matrices filters_pointwise_;
@@ -25,6 +25,11 @@ namespace internal {
         {
             return softmax(input);
         }
+        // softmax only handles tensors up to rank 3.
+        bool is_slice_wise_impl() const override
+        {
+            return false;
+        }
     };
 
 }
@@ -30,10 +30,27 @@ namespace internal {
             assertion(td_output_len_ > 1, "Wrong input dimension");
         }
 
+        void set_kernel_tuning(const kernel_tuning_cache_ptr& tuning) override
+        {
+            inner_layer_->set_kernel_tuning(tuning);
+        }
+
+        void share_weights(weight_store& store) override
+        {
+            inner_layer_->share_weights(store);
+        }
+
     protected:
         tensors apply_impl(const tensors& inputs) const override final
         {
             const auto& input = single_tensor_from_tensors(inputs);
+
+            // The time axis is the outermost one,
+            // so it can be folded into the inner layer's input directly.
+            if (inner_layer_->is_slice_wise() && td_input_len_ == td_output_len_ && input.shape().rank() == td_input_len_) {
+                return inner_layer_->apply({ input });
+            }
+
             tensors result_time_step = {};
             std::size_t len_series = 0;
             tensors slices = {};
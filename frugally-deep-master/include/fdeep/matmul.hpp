@@ -0,0 +1,321 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include "fdeep/cpu_features.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+namespace fdeep {
+namespace internal {
+
+#if FDEEP_MULTIVERSIONING_ENABLED
+    typedef float_type float_simd_256 __attribute__((vector_size(32)));
+    typedef float_type float_simd_512 __attribute__((vector_size(64)));
+
+    // c += a * b for a block of (VR vectors x NR) values of c, kept in registers,
+    // with the columns of a loaded as vectors and the values of b broadcast.
+    template <typename V, std::size_t VR, std::size_t NR>
+    FDEEP_FORCE_INLINE void gemm_register_block(std::size_t k,
+        const float_type* a, std::size_t lda, const float_type* b, std::size_t ldb,
+        float_type* c, std::size_t ldc)
+    {
+        const std::size_t lanes = sizeof(V) / sizeof(float_type);
+        V acc[NR][VR];
+        for (std::size_t j = 0; j < NR; ++j) {
+            for (std::size_t v = 0; v < VR; ++v) {
+                acc[j][v] = V {};
+            }
+        }
+        for (std::size_t p = 0; p < k; ++p) {
+            V a_col[VR];
+            for (std::size_t v = 0; v < VR; ++v) {
+                std::memcpy(&a_col[v], a + p * lda + v * lanes, sizeof(V));
+            }
+            for (std::size_t j = 0; j < NR; ++j) {
+                const V b_val = V {} + b[j * ldb + p];
+                for (std::size_t v = 0; v < VR; ++v) {
+                    acc[j][v] += a_col[v] * b_val;
+                }
+            }
+        }
+        for (std::size_t j = 0; j < NR; ++j) {
+            for (std::size_t v = 0; v < VR; ++v) {
+                V c_col;
+                std::memcpy(&c_col, c + j * ldc + v * lanes, sizeof(V));
+                c_col += acc[j][v];
+                std::memcpy(c + j * ldc + v * lanes, &c_col, sizeof(V));
+            }
+        }
+    }
+
+    // All columns of a horizontal band of c, VR vectors high.
+    template <typename V, std::size_t VR, std::size_t NR>
+    FDEEP_FORCE_INLINE void gemm_row_band(std::size_t n, std::size_t k,
+        const float_type* a, std::size_t lda, const float_type* b, std::size_t ldb,
+        float_type* c, std::size_t ldc)
+    {
+        std::size_t j = 0;
+        for (; j + NR <= n; j += NR) {
+            gemm_register_block<V, VR, NR>(k, a, lda, b + j * ldb, ldb, c + j * ldc, ldc);
+        }
+        for (; j < n; ++j) {
+            gemm_register_block<V, VR, 1>(k, a, lda, b + j * ldb, ldb, c + j * ldc, ldc);
+        }
+    }
+
+    // c += a * b for column-major matrices, see gemm_accumulate.
+    // The depth is split into parts, so the used part of a stays in the cache.
+    template <typename V>
+    FDEEP_FORCE_INLINE void gemm_accumulate_kernel(std::size_t m, std::size_t n, std::size_t k,
+        const float_type* a, std::size_t lda, const float_type* b, std::size_t ldb,
+        float_type* c, std::size_t ldc)
+    {
+        const std::size_t lanes = sizeof(V) / sizeof(float_type);
+        const std::size_t depth_part = 256;
+        for (std::size_t p = 0; p < k; p += depth_part) {
+            const std::size_t kp = std::min(depth_part, k - p);
+            std::size_t i = 0;
+            for (; i + 2 * lanes <= m; i += 2 * lanes) {
+                gemm_row_band<V, 2, 4>(n, kp, a + p * lda + i, lda, b + p, ldb, c + i, ldc);
+            }
+            for (; i + lanes <= m; i += lanes) {
+                gemm_row_band<V, 1, 4>(n, kp, a + p * lda + i, lda, b + p, ldb, c + i, ldc);
+            }
+            for (std::size_t j = 0; j < n; ++j) {
+                for (std::size_t q = p; q < p + kp; ++q) {
+                    const float_type b_val = b[j * ldb + q];
+                    for (std::size_t r = i; r < m; ++r) {
+                        c[j * ldc + r] += a[q * lda + r] * b_val;
+                    }
+                }
+            }
+        }
+    }
+
+    FDEEP_TARGET_AVX2 inline void gemm_accumulate_avx2(std::size_t m, std::size_t n, std::size_t k,
+        const float_type* a, std::size_t lda, const float_type* b, std::size_t ldb,
+        float_type* c, std::size_t ldc)
+    {
+        gemm_accumulate_kernel<float_simd_256>(m, n, k, a, lda, b, ldb, c, ldc);
+    }
+
+    FDEEP_TARGET_AVX512F inline void gemm_accumulate_avx512f(std::size_t m, std::size_t n, std::size_t k,
+        const float_type* a, std::size_t lda, const float_type* b, std::size_t ldb,
+        float_type* c, std::size_t ldc)
+    {
+        gemm_accumulate_kernel<float_simd_512>(m, n, k, a, lda, b, ldb, c, ldc);
+    }
+#endif
+
+    // c += a * b with column-major matrices a (m x k), b (k x n) and c (m x n),
+    // given by their first values and the distances between their columns.
+    // Runs the GEMM kernel for the instruction set of the CPU
+    // if it is wider than the one of Eigen (see dispatched_gemm_instruction_set).
+    // Matrices too small to fill its registers are left to Eigen.
+    inline void gemm_accumulate(std::size_t m, std::size_t n, std::size_t k,
+        const float_type* a, std::size_t lda, const float_type* b, std::size_t ldb,
+        float_type* c, std::size_t ldc)
+    {
+#if FDEEP_MULTIVERSIONING_ENABLED
+        typedef void (*gemm_kernel)(std::size_t, std::size_t, std::size_t,
+            const float_type*, std::size_t, const float_type*, std::size_t, float_type*, std::size_t);
+        static const std::pair<gemm_kernel, std::size_t> kernel_and_lanes = []() {
+            const auto isa = dispatched_gemm_instruction_set();
+            if (isa == instruction_set::avx512f) {
+                return std::make_pair(&gemm_accumulate_avx512f, sizeof(float_simd_512) / sizeof(float_type));
+            }
+            if (isa == instruction_set::avx2) {
+                return std::make_pair(&gemm_accumulate_avx2, sizeof(float_simd_256) / sizeof(float_type));
+            }
+            return std::make_pair(static_cast<gemm_kernel>(nullptr), std::size_t(0));
+        }();
+        if (kernel_and_lanes.first && m >= kernel_and_lanes.second && n >= 4) {
+            kernel_and_lanes.first(m, n, k, a, lda, b, ldb, c, ldc);
+            return;
+        }
+#endif
+        const Eigen::Map<const ColMajorMatrixXf, Eigen::Unaligned, Eigen::OuterStride<>>
+            a_map(a, static_cast<EigenIndex>(m), static_cast<EigenIndex>(k), Eigen::OuterStride<>(static_cast<EigenIndex>(lda)));
+        const Eigen::Map<const ColMajorMatrixXf, Eigen::Unaligned, Eigen::OuterStride<>>
+            b_map(b, static_cast<EigenIndex>(k), static_cast<EigenIndex>(n), Eigen::OuterStride<>(static_cast<EigenIndex>(ldb)));
+        Eigen::Map<ColMajorMatrixXf, Eigen::Unaligned, Eigen::OuterStride<>>
+            c_map(c, static_cast<EigenIndex>(m), static_cast<EigenIndex>(n), Eigen::OuterStride<>(static_cast<EigenIndex>(ldc)));
+        c_map.noalias() += a_map * b_map;
+    }
+
+    // View of a matrix inside a flat buffer with arbitrary element strides.
+    // Element (r, c) is located at data_[r * row_stride_ + c * col_stride_].
+    // Transposing only swaps the dimensions and strides, no values are moved.
+    struct strided_matrix {
+        float_type* data_;
+        std::size_t rows_;
+        std::size_t cols_;
+        std::size_t row_stride_;
+        std::size_t col_stride_;
+    };
+
+    inline strided_matrix strided_matrix_transposed(const strided_matrix& m)
+    {
+        return { m.data_, m.cols_, m.rows_, m.col_stride_, m.row_stride_ };
+    }
+
+    inline strided_matrix strided_matrix_offset(const strided_matrix& m, std::size_t offset)
+    {
+        return { m.data_ + offset, m.rows_, m.cols_, m.row_stride_, m.col_stride_ };
+    }
+
+    // Calls f with an Eigen map of the matrix.
+    // Eigen's GEMM can only work in place on operands with a unit inner stride,
+    // so if neither stride is 1, the values are gathered into a temporary first.
+    template <typename F>
+    void with_eigen_matrix_map(const strided_matrix& m, F f)
+    {
+        const auto rows = static_cast<EigenIndex>(m.rows_);
+        const auto cols = static_cast<EigenIndex>(m.cols_);
+        if (m.row_stride_ == 1) {
+            Eigen::Map<ColMajorMatrixXf, Eigen::Unaligned, Eigen::OuterStride<>>
+                mapped(m.data_, rows, cols, Eigen::OuterStride<>(static_cast<EigenIndex>(m.col_stride_)));
+            f(mapped);
+        } else if (m.col_stride_ == 1) {
+            Eigen::Map<RowMajorMatrixXf, Eigen::Unaligned, Eigen::OuterStride<>>
+                mapped(m.data_, rows, cols, Eigen::OuterStride<>(static_cast<EigenIndex>(m.row_stride_)));
+            f(mapped);
+        } else {
+            ColMajorMatrixXf gathered = Eigen::Map<ColMajorMatrixXf, Eigen::Unaligned, Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>>(
+                m.data_, rows, cols,
+                Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>(
+                    static_cast<EigenIndex>(m.col_stride_), static_cast<EigenIndex>(m.row_stride_)));
+            Eigen::Map<ColMajorMatrixXf, Eigen::Unaligned, Eigen::OuterStride<>>
+                mapped(gathered.data(), rows, cols, Eigen::OuterStride<>(rows));
+            f(mapped);
+        }
+    }
+
+    // out = a * b, or out += a * b if accumulate is set.
+    inline void matmul_strided(
+        const strided_matrix& a, const strided_matrix& b,
+        const strided_matrix& out, bool accumulate = false)
+    {
+        assertion(a.cols_ == b.rows_, "inner dimensions of matrix product do not match");
+        assertion(out.rows_ == a.rows_ && out.cols_ == b.cols_, "invalid output dimensions for matrix product");
+        assertion(out.row_stride_ == 1 || out.col_stride_ == 1, "output of matrix product needs a unit stride");
+        if (a.row_stride_ == 1 && b.row_stride_ == 1 && out.row_stride_ == 1) {
+            if (!accumulate) {
+                for (std::size_t c = 0; c < out.cols_; ++c) {
+                    std::fill_n(out.data_ + c * out.col_stride_, out.rows_, static_cast<float_type>(0));
+                }
+            }
+            gemm_accumulate(a.rows_, b.cols_, a.cols_, a.data_, a.col_stride_, b.data_, b.col_stride_, out.data_, out.col_stride_);
+            return;
+        }
+        if (a.col_stride_ == 1 && b.col_stride_ == 1 && out.col_stride_ == 1) {
+            // out^T = b^T * a^T, all column-major.
+            matmul_strided(strided_matrix_transposed(b), strided_matrix_transposed(a),
+                strided_matrix_transposed(out), accumulate);
+            return;
+        }
+        with_eigen_matrix_map(a, [&](const auto& a_map) {
+            with_eigen_matrix_map(b, [&](const auto& b_map) {
+                with_eigen_matrix_map(out, [&](auto& out_map) {
+                    if (accumulate) {
+                        out_map.noalias() += a_map * b_map;
+                    } else {
+                        out_map.noalias() = a_map * b_map;
+                    }
+                });
+            });
+        });
+    }
+
+    // out[i] = a[i] * b[i] for i in [0, batch_count).
+    // The i-th matrix of an operand starts at (i * batch_stride) from its data_.
+    // A batch stride of 0 uses the same matrix for all products.
+    inline void batched_matmul(std::size_t batch_count,
+        const strided_matrix& a, std::size_t a_batch_stride,
+        const strided_matrix& b, std::size_t b_batch_stride,
+        const strided_matrix& out, std::size_t out_batch_stride)
+    {
+        for (std::size_t i = 0; i < batch_count; ++i) {
+            matmul_strided(
+                strided_matrix_offset(a, i * a_batch_stride),
+                strided_matrix_offset(b, i * b_batch_stride),
+                strided_matrix_offset(out, i * out_batch_stride));
+        }
+    }
+
+    // out = softmax(scale * q * k^T) * v, with the softmax applied per row.
+    // The keys/values are consumed in tiles using an online softmax
+    // (running maximum and running sum per query row),
+    // so the full (queries x keys) score matrix is never materialized
+    // and the memory needed is linear in the sequence lengths.
+    inline void scaled_dot_product_attention(
+        const strided_matrix& q, const strided_matrix& k, const strided_matrix& v,
+        float_type scale, const strided_matrix& out)
+    {
+        assertion(q.cols_ == k.cols_, "query and key dimensions do not match");
+        assertion(k.rows_ == v.rows_, "key and value counts do not match");
+        assertion(out.rows_ == q.rows_ && out.cols_ == v.cols_, "invalid attention output dimensions");
+
+        const std::size_t tile_size = 64;
+        const std::size_t v_dim = v.cols_;
+
+        RowMajorMatrixXf scores;
+        RowMajorMatrixXf acc;
+        ArrayXf1D running_max;
+        ArrayXf1D running_sum;
+        ArrayXf1D correction;
+
+        for (std::size_t q_begin = 0; q_begin < q.rows_; q_begin += tile_size) {
+            const std::size_t q_count = std::min(tile_size, q.rows_ - q_begin);
+            strided_matrix q_tile = strided_matrix_offset(q, q_begin * q.row_stride_);
+            q_tile.rows_ = q_count;
+
+            acc.setZero(static_cast<EigenIndex>(q_count), static_cast<EigenIndex>(v_dim));
+            running_max.setConstant(static_cast<EigenIndex>(q_count), std::numeric_limits<float_type>::lowest());
+            running_sum.setZero(static_cast<EigenIndex>(q_count));
+
+            for (std::size_t kv_begin = 0; kv_begin < k.rows_; kv_begin += tile_size) {
+                const std::size_t kv_count = std::min(tile_size, k.rows_ - kv_begin);
+                strided_matrix k_tile = strided_matrix_offset(k, kv_begin * k.row_stride_);
+                k_tile.rows_ = kv_count;
+                strided_matrix v_tile = strided_matrix_offset(v, kv_begin * v.row_stride_);
+                v_tile.rows_ = kv_count;
+
+                scores.resize(static_cast<EigenIndex>(q_count), static_cast<EigenIndex>(kv_count));
+                matmul_strided(q_tile, strided_matrix_transposed(k_tile),
+                    { scores.data(), q_count, kv_count, kv_count, 1 });
+                scores *= scale;
+
+                const ArrayXf1D new_max = running_max.max(scores.rowwise().maxCoeff().array());
+                correction = (running_max - new_max).exp();
+                scores.array() = (scores.array().colwise() - new_max).exp();
+                running_sum = running_sum * correction + scores.rowwise().sum().array();
+                running_max = new_max;
+
+                acc.array().colwise() *= correction;
+                matmul_strided({ scores.data(), q_count, kv_count, kv_count, 1 }, v_tile,
+                    { acc.data(), q_count, v_dim, v_dim, 1 }, true);
+            }
+
+            acc.array().colwise() /= running_sum;
+            strided_matrix out_tile = strided_matrix_offset(out, q_begin * out.row_stride_);
+            out_tile.rows_ = q_count;
+            with_eigen_matrix_map(out_tile, [&](auto& out_map) {
+                out_map = acc;
+            });
+        }
+    }
+
+}
+}
@@ -0,0 +1,248 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+// Included by common.hpp (after Eigen), so it must not include other fdeep headers,
+// except for ones following the same rule.
+
+#include "fdeep/huge_pages.hpp"
+
+#include <Eigen/Core>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace fdeep {
+namespace internal {
+
+    struct layer_memory_stats {
+        std::string layer_name_;
+        // The names of the enclosing layers and of the layer itself, joined by '/',
+        // e.g., "model/inner_model/dense". Layers of the same name in different
+        // nested models (or wrappers like TimeDistributed) thus are kept apart.
+        std::string layer_path_;
+        // Number and total size of the allocations done while the layer was running,
+        // including the ones of the layers nested in it.
+        std::size_t allocations_;
+        std::size_t allocated_bytes_;
+        // Maximum of the bytes in use (allocated during the measurement and
+        // not freed yet) observed while the layer was running.
+        // This is the live total of the whole forward pass at that time,
+        // so it includes, e.g., the inputs of the layer and the outputs
+        // of earlier layers that are still needed.
+        std::size_t peak_live_bytes_;
+    };
+
+    struct memory_stats {
+        std::size_t allocations_;
+        std::size_t allocated_bytes_;
+        std::size_t peak_live_bytes_;
+        // In the order the layers were executed first.
+        std::vector<layer_memory_stats> layers_;
+    };
+
+    // Collects the allocations of tensor values done by one thread.
+    class memory_accounting_session {
+    public:
+        memory_accounting_session()
+            : live_bytes_(0)
+            , current_layer_(-1)
+            , stats_({ 0, 0, 0, {} })
+            , layer_indices_()
+            , layer_parents_()
+        {
+        }
+
+        void record_allocation(std::size_t bytes)
+        {
+            live_bytes_ += static_cast<std::int64_t>(bytes);
+            stats_.allocations_ += 1;
+            stats_.allocated_bytes_ += bytes;
+            update_peaks();
+            for (auto idx = current_layer_; idx >= 0; idx = layer_parents_[static_cast<std::size_t>(idx)]) {
+                auto& layer = stats_.layers_[static_cast<std::size_t>(idx)];
+                layer.allocations_ += 1;
+                layer.allocated_bytes_ += bytes;
+            }
+        }
+
+        // Memory allocated before the measurement started
+        // can be freed during it, so live bytes are clamped at zero.
+        void record_deallocation(std::size_t bytes)
+        {
+            live_bytes_ = std::max<std::int64_t>(0, live_bytes_ - static_cast<std::int64_t>(bytes));
+        }
+
+        // Makes the named layer (nested in the current one, if any)
+        // the one allocations are attributed to,
+        // and returns the index of the previous one.
+        std::int64_t enter_layer(const std::string& layer_name)
+        {
+            const auto previous = current_layer_;
+            const std::string layer_path = previous >= 0
+                ? stats_.layers_[static_cast<std::size_t>(previous)].layer_path_ + "/" + layer_name
+                : layer_name;
+            const auto it = layer_indices_.find(layer_path);
+            if (it == layer_indices_.end()) {
+                current_layer_ = static_cast<std::int64_t>(stats_.layers_.size());
+                layer_indices_[layer_path] = current_layer_;
+                stats_.layers_.push_back({ layer_name, layer_path, 0, 0, 0 });
+                layer_parents_.push_back(previous);
+            } else {
+                current_layer_ = it->second;
+            }
+            update_peaks();
+            return previous;
+        }
+
+        void leave_layer(std::int64_t previous)
+        {
+            current_layer_ = previous;
+        }
+
+        const memory_stats& stats() const
+        {
+            return stats_;
+        }
+
+    private:
+        void update_peaks()
+        {
+            const auto live = static_cast<std::size_t>(live_bytes_);
+            stats_.peak_live_bytes_ = std::max(stats_.peak_live_bytes_, live);
+            for (auto idx = current_layer_; idx >= 0; idx = layer_parents_[static_cast<std::size_t>(idx)]) {
+                auto& layer = stats_.layers_[static_cast<std::size_t>(idx)];
+                layer.peak_live_bytes_ = std::max(layer.peak_live_bytes_, live);
+            }
+        }
+
+        std::int64_t live_bytes_;
+        std::int64_t current_layer_;
+        memory_stats stats_;
+        std::map<std::string, std::int64_t> layer_indices_;
+        // Index of the enclosing layer of each layer, -1 for none.
+        std::vector<std::int64_t> layer_parents_;
+    };
+
+    // The session of the current thread, nullptr if memory is not being measured.
+    inline memory_accounting_session*& current_memory_accounting_session()
+    {
+        static thread_local memory_accounting_session* session = nullptr;
+        return session;
+    }
+
+    // Measures the allocations of the current thread during its lifetime.
+    class memory_accounting_scope {
+    public:
+        memory_accounting_scope()
+            : session_()
+            , previous_(current_memory_accounting_session())
+        {
+            current_memory_accounting_session() = &session_;
+        }
+        ~memory_accounting_scope()
+        {
+            current_memory_accounting_session() = previous_;
+        }
+        memory_accounting_scope(const memory_accounting_scope&) = delete;
+        memory_accounting_scope& operator=(const memory_accounting_scope&) = delete;
+
+        const memory_stats& stats() const
+        {
+            return session_.stats();
+        }
+
+    private:
+        memory_accounting_session session_;
+        memory_accounting_session* previous_;
+    };
+
+    // Attributes the allocations during its lifetime to a layer,
+    // if memory is being measured.
+    class memory_accounting_layer_guard {
+    public:
+        explicit memory_accounting_layer_guard(const std::string& layer_name)
+            : session_(current_memory_accounting_session())
+            , previous_(session_ ? session_->enter_layer(layer_name) : -1)
+        {
+        }
+        ~memory_accounting_layer_guard()
+        {
+            if (session_) {
+                session_->leave_layer(previous_);
+            }
+        }
+        memory_accounting_layer_guard(const memory_accounting_layer_guard&) = delete;
+        memory_accounting_layer_guard& operator=(const memory_accounting_layer_guard&) = delete;
+
+    private:
+        memory_accounting_session* session_;
+        std::int64_t previous_;
+    };
+
+    // Eigen's aligned allocator, which also reports to the session
+    // of the current thread (if any).
+    // Large buffers can be backed by huge pages (see huge_page_mode).
+    template <typename T>
+    class accounting_allocator : public Eigen::aligned_allocator<T> {
+    public:
+        typedef T value_type;
+        typedef std::size_t size_type;
+
+        template <typename U>
+        struct rebind {
+            typedef accounting_allocator<U> other;
+        };
+
+        accounting_allocator() = default;
+        template <typename U>
+        accounting_allocator(const accounting_allocator<U>&)
+        {
+        }
+
+        T* allocate(size_type num, const void* hint = 0)
+        {
+            T* result = num * sizeof(T) >= huge_page_min_bytes
+                ? static_cast<T*>(allocate_large_buffer(num * sizeof(T)))
+                : Eigen::aligned_allocator<T>::allocate(num, hint);
+            if (current_memory_accounting_session()) {
+                current_memory_accounting_session()->record_allocation(num * sizeof(T));
+            }
+            return result;
+        }
+
+        void deallocate(T* p, size_type num)
+        {
+            if (current_memory_accounting_session()) {
+                current_memory_accounting_session()->record_deallocation(num * sizeof(T));
+            }
+            if (num * sizeof(T) >= huge_page_min_bytes) {
+                deallocate_large_buffer(p);
+            } else {
+                Eigen::aligned_allocator<T>::deallocate(p, num);
+            }
+        }
+    };
+
+    template <typename T, typename U>
+    bool operator==(const accounting_allocator<T>&, const accounting_allocator<U>&)
+    {
+        return true;
+    }
+
+    template <typename T, typename U>
+    bool operator!=(const accounting_allocator<T>&, const accounting_allocator<U>&)
+    {
+        return false;
+    }
+
+}
+}
@@ -0,0 +1,121 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fdeep {
+namespace internal {
+
+    // Parses a Linux CPU list like "0-3,8,10-11".
+    inline std::vector<std::size_t> parse_cpu_list(const std::string& str)
+    {
+        std::vector<std::size_t> cpus;
+        std::istringstream stream(str);
+        std::string range;
+        while (std::getline(stream, range, ',')) {
+            if (range.find_first_of("0123456789") == std::string::npos) {
+                continue;
+            }
+            const auto dash = range.find('-');
+            const std::size_t first = std::stoul(range.substr(0, dash));
+            const std::size_t last = dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+            for (std::size_t cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    // The CPUs of every NUMA node having some.
+    // One node with all CPUs if the topology is not known (e.g., not on Linux).
+    inline std::vector<std::vector<std::size_t>> numa_node_cpus()
+    {
+        const std::size_t max_nodes = 64;
+        std::vector<std::vector<std::size_t>> nodes;
+        for (std::size_t node = 0; node < max_nodes; ++node) {
+            std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string line;
+            if (std::getline(cpulist, line)) {
+                auto cpus = parse_cpu_list(line);
+                if (!cpus.empty()) {
+                    nodes.push_back(cpus);
+                }
+            }
+        }
+        if (nodes.empty()) {
+            std::vector<std::size_t> cpus(std::max<std::size_t>(1, std::thread::hardware_concurrency()));
+            for (std::size_t i = 0; i < cpus.size(); ++i) {
+                cpus[i] = i;
+            }
+            nodes.push_back(cpus);
+        }
+        return nodes;
+    }
+
+    struct huge_page_usage {
+        huge_page_mode mode_;
+        // Bytes of the mappings made for large buffers.
+        std::size_t mapped_bytes_;
+        // Bytes of the process backed by transparent huge pages.
+        std::size_t anon_huge_page_bytes_;
+        // Bytes of the process backed by reserved huge pages.
+        std::size_t hugetlb_bytes_;
+    };
+
+    inline std::string show_huge_page_mode(huge_page_mode mode)
+    {
+        if (mode == huge_page_mode::transparent) {
+            return "transparent";
+        }
+        if (mode == huge_page_mode::hugetlb) {
+            return "hugetlb";
+        }
+        return "none";
+    }
+
+    inline huge_page_mode create_huge_page_mode(const std::string& name)
+    {
+        return fplus::throw_on_nothing(error("unknown huge page mode: " + name),
+            fplus::choose<std::string, huge_page_mode>({
+                                                           { std::string("none"), huge_page_mode::none },
+                                                           { std::string("transparent"), huge_page_mode::transparent },
+                                                           { std::string("hugetlb"), huge_page_mode::hugetlb },
+                                                       },
+                name));
+    }
+
+}
+
+using huge_page_mode = internal::huge_page_mode;
+using huge_page_usage = internal::huge_page_usage;
+
+// How tensor buffers of at least 1 MiB allocated from now on are backed.
+// Buffers allocated before keep their pages.
+// So set this before loading the models whose weights should use huge pages.
+inline void set_huge_page_mode(huge_page_mode mode)
+{
+    internal::global_huge_page_mode() = mode;
+}
+
+inline huge_page_usage get_huge_page_usage()
+{
+    return { internal::global_huge_page_mode().load(),
+        internal::huge_page_mapped_bytes().load(),
+        internal::read_smaps_rollup_kb("AnonHugePages") * 1024,
+        internal::read_smaps_rollup_kb("Private_Hugetlb") * 1024 };
+}
+
+}
@@ -6,23 +6,146 @@
 
 #pragma once
 
+#include "fdeep/cancellation.hpp"
 #include "fdeep/common.hpp"
+#include "fdeep/cpu_features.hpp"
 #include "fdeep/import_model.hpp"
+#include "fdeep/kernel_tuning.hpp"
+#include "fdeep/layers/dense_layer.hpp"
 #include "fdeep/layers/layer.hpp"
+#include "fdeep/layers/model_layer.hpp"
+#include "fdeep/pipeline.hpp"
 #include "fdeep/tensor.hpp"
+#include "fdeep/weight_store.hpp"
+#include "fdeep/worker_pool.hpp"
 
 #include <algorithm>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace fdeep {
 
+using memory_stats = internal::memory_stats;
+using layer_memory_stats = internal::layer_memory_stats;
+using pipeline_throughput = internal::pipeline_throughput;
+using cancellation_token = internal::cancellation_token;
+using prediction_cancelled = internal::prediction_cancelled;
+
 class model {
 public:
     // A single forward pass (no batches).
     tensors predict(const tensors& inputs) const
     {
-        return predict_impl(inputs);
+        return predict_impl(inputs, [&]() {
+            return model_layer_->apply(inputs);
+        });
+    }
+
+    // Like predict, but also measures the memory allocated for tensor values
+    // during the forward pass, in total and per layer
+    // (identified by its path in the nested models, see layer_memory_stats).
+    // Only allocations done by the calling thread are counted.
+    std::pair<tensors, memory_stats> predict_with_memory_stats(const tensors& inputs) const
+    {
+        const internal::memory_accounting_scope accounting;
+        auto outputs = predict(inputs);
+        return std::make_pair(std::move(outputs), accounting.stats());
+    }
+
+    // Like predict, but for models with a single (height, width, channels) input,
+    // the convolution and pooling layers directly following the input
+    // (up to max_tiled_layers of them) are run on horizontal bands,
+    // band_rows output rows of the last one at a time.
+    // This keeps their activations, which are largest for high-resolution
+    // inputs, small enough for the CPU caches.
+    // The results equal the ones of predict up to float rounding,
+    // because the GEMMs of a band can be evaluated differently by Eigen.
+    tensors predict_tiled(const tensors& inputs, std::size_t band_rows = 16,
+        std::size_t max_tiled_layers = std::numeric_limits<std::size_t>::max()) const
+    {
+        return predict_impl(inputs, [&]() {
+            return get_model_layer().apply_tiled(inputs, band_rows, max_tiled_layers);
+        });
+    }
+
+    // For models with a single input of fixed (height, width, channels) shape
+    // and a single output: Returns the outputs of the model for all windows
+    // of the input shape in the (larger) image, as a tensor of shape
+    // (window rows, window columns, output values).
+    // The convolution and pooling layers directly following the input
+    // run only once for the whole image, and the rest of the model
+    // (e.g., the classification head) runs per window on the part of their
+    // feature map belonging to it. So the windows are stride cells of this
+    // feature map apart, i.e., stride times the combined strides of these layers
+    // in pixels. Near the window borders the results can differ from predict
+    // on the single windows, if these layers use same padding,
+    // because they see the surrounding image instead of zeros.
+    tensor predict_sliding_window(const tensor& image, std::size_t stride = 1) const
+    {
+        internal::assertion(get_input_shapes().size() == 1 && get_output_shapes().size() == 1,
+            "sliding windows need a model with a single input and a single output");
+        const auto& input_shape = get_input_shapes().front();
+        internal::assertion(input_shape.rank() == 3 && input_shape.height_.is_just()
+                && input_shape.width_.is_just() && input_shape.depth_.is_just(),
+            "sliding windows need a fixed input shape of (height, width, channels)");
+        const auto window_shape = tensor_shape(input_shape.height_.unsafe_get_just(),
+            input_shape.width_.unsafe_get_just(), input_shape.depth_.unsafe_get_just());
+
+        const auto outputs = get_model_layer().apply_sliding_window(image, window_shape, stride);
+
+        const std::size_t rows = outputs.size();
+        const std::size_t cols = rows == 0 ? 0 : outputs.front().size();
+        const std::size_t output_size = rows == 0 || cols == 0 ? 0 : outputs.front().front().front().shape().volume();
+        float_vec values;
+        values.reserve(rows * cols * output_size);
+        for (const auto& row : outputs) {
+            for (const auto& window_outputs : row) {
+                internal::assertion(window_outputs.size() == 1 && window_outputs.front().shape() == get_output_shapes().front(),
+                    "invalid output shape for sliding window");
+                values.insert(values.end(), window_outputs.front().as_vector()->begin(), window_outputs.front().as_vector()->end());
+            }
+        }
+        return tensor(tensor_shape(rows, cols, output_size), std::move(values));
+    }
+
+    // Like predict, but also returns the outputs of the named layers
+    // from the same forward pass, e.g., the last convolutional feature map
+    // for class_activation_map.
+    // Only layers of the model itself can be requested, not ones inside
+    // nested models, and neither ones that were removed or merged into others
+    // when loading the model (see graph_rewrites).
+    std::pair<tensors, tensors> predict_with_layer_outputs(const tensors& inputs,
+        const std::vector<std::string>& layer_names) const
+    {
+        tensors layer_outputs;
+        auto outputs = predict_impl(inputs, [&]() {
+            auto results = get_model_layer().apply_with_layer_outputs(inputs, layer_names);
+            layer_outputs = std::move(results.second);
+            return results.first;
+        });
+        return std::make_pair(std::move(outputs), std::move(layer_outputs));
+    }
+
+    // Class activation map (CAM) for models that classify using global average
+    // pooling of a feature map followed by a dense layer (with the given name,
+    // which, as in predict_with_layer_outputs, must not be inside a nested model):
+    // The channels of the feature map (from predict_with_layer_outputs)
+    // weighted with the dense layer's weights for the class,
+    // with negative values set to zero and scaled to a maximum of 1.
+    // For such models this is the same heatmap Grad-CAM gives,
+    // without needing gradients. Returns a tensor of shape (height, width, 1).
+    tensor class_activation_map(const tensor& feature_map,
+        const std::string& dense_layer_name, std::size_t class_idx) const
+    {
+        const auto dense = std::dynamic_pointer_cast<internal::dense_layer>(
+            get_model_layer().find_layer(dense_layer_name));
+        internal::assertion(dense != nullptr, dense_layer_name + " is not a dense layer");
+        return dense->class_activation_map(feature_map, class_idx);
     }
 
     // Forward pass multiple data.
@@ -41,6 +164,73 @@ public:
         }
     }
 
+    // Runs predict on a thread of fdeep's worker pool (one thread per CPU core).
+    // Once the token is cancelled, the prediction does not start any further layer,
+    // and the future throws prediction_cancelled.
+    // The model can be destroyed before the prediction is done.
+    std::future<tensors> predict_async(const tensors& inputs,
+        const cancellation_token& token = cancellation_token()) const
+    {
+        const model self = *this;
+        return internal::global_worker_pool().submit([self, inputs, token]() -> tensors {
+            const internal::cancellation_scope cancellation(token);
+            return self.predict(inputs);
+        });
+    }
+
+    // Forward pass multiple data in a pipeline of up to `stages` threads,
+    // each pinned to its own one of the CPUs the process may run on (on Linux).
+    // The layers are split into consecutive parts of about the same run time
+    // (measured on the first input), and every thread runs one part
+    // on one input after the other, handing the results on to the next thread.
+    // So every core only needs the weights of its own layers in its caches.
+    // The results are the same as the ones of predict.
+    std::vector<tensors> predict_pipelined(const std::vector<tensors>& inputs_vec,
+        std::size_t stages) const
+    {
+        if (inputs_vec.empty()) {
+            return {};
+        }
+        for (const auto& inputs : inputs_vec) {
+            check_input_shapes(inputs);
+        }
+        const auto plan = get_model_layer().plan_pipeline(inputs_vec.front(), stages);
+        auto results = get_model_layer().apply_pipelined(plan.first, fplus::drop(1, inputs_vec), true);
+        results.insert(results.begin(), plan.second);
+        for (const auto& outputs : results) {
+            check_output_shapes(outputs);
+        }
+        return results;
+    }
+
+    // Measures the steady-state throughput on dummy inputs
+    // of predict_pipelined with the given number of stages, and of
+    // data-parallel prediction (every thread running the whole model
+    // on its share of the inputs) with as many threads as stages were used.
+    pipeline_throughput test_pipeline_throughput(std::size_t stages,
+        std::size_t input_count = 64) const
+    {
+        const auto inputs = generate_dummy_inputs();
+        const auto plan = get_model_layer().plan_pipeline(inputs, stages).first;
+        const std::size_t threads = plan.stages_.size();
+        const auto run_pipelined = [&](std::size_t count) {
+            get_model_layer().apply_pipelined(plan, std::vector<tensors>(count, inputs), true);
+        };
+        const auto run_data_parallel = [&](std::size_t count) {
+            fplus::transform_parallelly_n_threads(threads, [this](const tensors& x) -> tensors {
+                return predict(x);
+            },
+                std::vector<tensors>(count, inputs));
+        };
+        const auto throughput = [input_count](const std::function<void(std::size_t)>& run) -> double {
+            run(std::max<std::size_t>(1, input_count / 4)); // warm-up
+            fplus::stopwatch stopwatch;
+            run(input_count);
+            return static_cast<double>(input_count) / stopwatch.elapsed();
+        };
+        return { threads, throughput(run_pipelined), throughput(run_data_parallel) };
+    }
+
     // Convenience wrapper around predict for models with
     // single tensor outputs of shape (1, 1, z).
     // Suitable for classification models with more than one output neuron.
@@ -58,6 +248,29 @@ public:
         return predict_class_with_confidence_impl(inputs);
     }
 
+    // Like predict_class_with_confidence, but for the k most likely classes,
+    // most likely first.
+    // If the output is computed by a softmax, the classes are selected
+    // on its input (the logits), and of the softmax only the normalization
+    // and the probabilities of the selected classes are computed.
+    std::vector<std::pair<std::size_t, float_type>>
+    predict_topk(const tensors& inputs, std::size_t k) const
+    {
+        check_input_shapes(inputs);
+        const auto logits = get_model_layer().apply_until_softmax(inputs);
+        if (logits.is_just()) {
+            // The softmax does not change the shape.
+            check_output_shapes({ logits.unsafe_get_just() });
+            check_class_output_shape(logits.unsafe_get_just().shape(), "predict_topk");
+            return internal::softmax_top_k(logits.unsafe_get_just(), k);
+        }
+        const tensors outputs = predict(inputs);
+        internal::assertion(outputs.size() == 1,
+            std::string("invalid number of outputs.\n") + "Use model::predict instead of model::predict_topk.");
+        check_class_output_shape(outputs.front().shape(), "predict_topk");
+        return internal::top_k_values(outputs.front().as_vector()->data(), outputs.front().shape().depth_, k);
+    }
+
     // Convenience wrapper around predict for models with
     // single tensor outputs of shape (1, 1, 1),
     // typically used for regression or binary classification.
@@ -94,6 +307,24 @@ public:
             get_dummy_input_shapes());
     }
 
+    // Measures which kernels are fastest for the shapes of these inputs
+    // (and of the intermediate tensors they lead to),
+    // and stores the results in the kernel tuning cache given when loading.
+    // Predictions never measure kernels themselves,
+    // so call this once with representative inputs, e.g., right after loading.
+    // Does nothing if the model was loaded without a kernel tuning cache.
+    void tune_kernels(const tensors& inputs) const
+    {
+        if (!kernel_tuning_) {
+            return;
+        }
+        {
+            const internal::kernel_tuning_scope tuning;
+            predict(inputs);
+        }
+        kernel_tuning_->flush();
+    }
+
     // Measure time of one single forward pass using dummy input data.
     double test_speed() const
     {
@@ -113,23 +344,50 @@ public:
         return hash_;
     }
 
+    // Changes made to the layer graph while loading,
+    // e.g., removed Dropout layers or Rescaling folded into a convolution.
+    const std::vector<std::string>& graph_rewrites() const
+    {
+        return graph_rewrites_;
+    }
+
 private:
     model(const internal::layer_ptr& model_layer,
         const std::vector<tensor_shape_variable>& input_shapes,
         const std::vector<tensor_shape_variable>& output_shapes,
-        const std::string& hash)
+        const std::string& hash,
+        const std::vector<std::string>& graph_rewrites)
         : input_shapes_(input_shapes)
         , output_shapes_(output_shapes)
         , model_layer_(model_layer)
         , hash_(hash)
+        , graph_rewrites_(graph_rewrites)
+        , kernel_tuning_()
     {
     }
 
     friend model read_model(std::istream&, bool,
         const std::function<void(std::string)>&, float_type,
-        const internal::layer_creators&);
+        const internal::layer_creators&, const std::string&, bool);
 
-    tensors predict_impl(const tensors& inputs) const
+    const internal::model_layer& get_model_layer() const
+    {
+        const auto result = std::dynamic_pointer_cast<internal::model_layer>(model_layer_);
+        internal::assertion(result != nullptr, "invalid model layer");
+        return *result;
+    }
+
+    // Checks the shapes of the inputs and of the outputs apply_model returns.
+    tensors predict_impl(const tensors& inputs,
+        const std::function<tensors()>& apply_model) const
+    {
+        check_input_shapes(inputs);
+        const auto outputs = apply_model();
+        check_output_shapes(outputs);
+        return outputs;
+    }
+
+    void check_input_shapes(const tensors& inputs) const
     {
         const auto input_shapes = fplus::transform(
             fplus_c_mem_fn_t(tensor, shape, tensor_shape),
@@ -137,17 +395,23 @@ private:
         internal::assertion(input_shapes
                 == get_input_shapes(),
             std::string("Invalid inputs shape.\n") + "The model takes " + show_tensor_shapes_variable(get_input_shapes()) + " but provided was: " + show_tensor_shapes(input_shapes));
+    }
 
-        const auto outputs = model_layer_->apply(inputs);
-
+    void check_output_shapes(const tensors& outputs) const
+    {
         const auto output_shapes = fplus::transform(
             fplus_c_mem_fn_t(tensor, shape, tensor_shape),
             outputs);
         internal::assertion(output_shapes
                 == get_output_shapes(),
             std::string("Invalid outputs shape.\n") + "The model should return " + show_tensor_shapes_variable(get_output_shapes()) + " but actually returned: " + show_tensor_shapes(output_shapes));
+    }
 
-        return outputs;
+    static void check_class_output_shape(const tensor_shape& output_shape,
+        const std::string& function_name)
+    {
+        internal::assertion(output_shape.without_depth().area() == 1,
+            std::string("invalid output shape.\n") + "Use model::predict instead of model::" + function_name + ".");
     }
 
     std::pair<std::size_t, float_type>
@@ -156,9 +420,7 @@ private:
         const tensors outputs = predict(inputs);
         internal::assertion(outputs.size() == 1,
             std::string("invalid number of outputs.\n") + "Use model::predict instead of model::predict_class.");
-        const auto output_shape = outputs.front().shape();
-        internal::assertion(output_shape.without_depth().area() == 1,
-            std::string("invalid output shape.\n") + "Use model::predict instead of model::predict_class.");
+        check_class_output_shape(outputs.front().shape(), "predict_class");
         const auto pos = internal::tensor_max_pos(outputs.front());
         return std::make_pair(pos.z_, outputs.front().get(pos));
     }
@@ -178,6 +440,8 @@ private:
     std::vector<tensor_shape_variable> output_shapes_;
     internal::layer_ptr model_layer_;
     std::string hash_;
+    std::vector<std::string> graph_rewrites_;
+    internal::kernel_tuning_cache_ptr kernel_tuning_;
 };
 
 // Write an std::string to std::cout.
@@ -194,12 +458,20 @@ inline void dev_null_logger(const std::string&)
 
 // Load and construct an fdeep::model from an istream
 // providing the exported json content.
+// If a kernel tuning cache path is given, layers with more than one
+// implementation use the one found fastest for each input shape
+// by model::tune_kernels, and the results are stored in (and reused from) that file.
+// With share_weights, convolution filters and normalization parameters
+// identical to ones of other models loaded this way (e.g., fine-tuned
+// variants of the same backbone) use the same memory.
 // Throws an exception if a problem occurs.
 inline model read_model(std::istream& model_file_stream,
     bool verify = true,
     const std::function<void(std::string)>& logger = cout_logger,
     float_type verify_epsilon = static_cast<float_type>(0.0001),
-    const internal::layer_creators& custom_layer_creators = internal::layer_creators())
+    const internal::layer_creators& custom_layer_creators = internal::layer_creators(),
+    const std::string& kernel_tuning_cache_path = "",
+    bool share_weights = false)
 {
     const auto log = [&logger](const std::string& msg) {
         if (logger) {
@@ -240,17 +512,39 @@ inline model read_model(std::istream& model_file_stream,
     };
 
     log_sol("Building model");
-    model full_model(internal::create_model_layer(
-                         get_param, json_data["architecture"],
-                         json_data["architecture"]["config"]["name"],
-                         custom_layer_creators,
-                         ""),
+    const auto model_layer = internal::create_model_layer(
+        get_param, json_data["architecture"],
+        json_data["architecture"]["config"]["name"],
+        custom_layer_creators,
+        "");
+    model full_model(model_layer,
         internal::create_tensor_shapes_variable(json_data["input_shapes"]),
         internal::create_tensor_shapes_variable(json_data["output_shapes"]),
         internal::json_object_get<std::string, std::string>(
-            json_data, "hash", ""));
+            json_data, "hash", ""),
+        std::dynamic_pointer_cast<internal::model_layer>(model_layer)->graph_rewrites());
     log_duration();
 
+    for (const auto& rewrite : full_model.graph_rewrites()) {
+        log("Graph optimization: " + rewrite);
+    }
+
+    log("Instruction sets: " + show_simd_info(get_simd_info()));
+
+    if (!kernel_tuning_cache_path.empty()) {
+        const auto tuning = std::make_shared<internal::kernel_tuning_cache>(
+            kernel_tuning_cache_path, full_model.hash());
+        log("Kernel tuning cache " + kernel_tuning_cache_path + " has " + fplus::show(tuning->size()) + " entries for this model and CPU");
+        model_layer->set_kernel_tuning(tuning);
+        full_model.kernel_tuning_ = tuning;
+    }
+
+    if (share_weights) {
+        auto store = internal::global_weight_store().for_owner(model_layer);
+        model_layer->share_weights(store);
+        log("Shared weights of all loaded models: " + fplus::show_float(0, 1, static_cast<double>(shared_weights_bytes()) / (1024 * 1024)) + " MiB");
+    }
+
     if (verify) {
         if (!json_data["tests"].is_array()) {
             log("No test cases available");
@@ -259,7 +553,7 @@ inline model read_model(std::istream& model_file_stream,
             json_data = {}; // free RAM
             for (std::size_t i = 0; i < tests.size(); ++i) {
                 log_sol("Running test " + fplus::show(i + 1) + " of " + fplus::show(tests.size()));
-                const auto output = full_model.predict_impl(tests[i].input_);
+                const auto output = full_model.predict(tests[i].input_);
                 log_duration();
                 check_test_outputs(verify_epsilon, output, tests[i].output_);
             }
@@ -273,11 +567,13 @@ inline model read_model_from_string(const std::string& content,
     bool verify = true,
     const std::function<void(std::string)>& logger = cout_logger,
     float_type verify_epsilon = static_cast<float_type>(0.0001),
-    const internal::layer_creators& custom_layer_creators = internal::layer_creators())
+    const internal::layer_creators& custom_layer_creators = internal::layer_creators(),
+    const std::string& kernel_tuning_cache_path = "",
+    bool share_weights = false)
 {
     std::istringstream content_stream(content);
     return read_model(content_stream, verify, logger, verify_epsilon,
-        custom_layer_creators);
+        custom_layer_creators, kernel_tuning_cache_path, share_weights);
 }
 
 // Load and construct an fdeep::model from file.
@@ -286,13 +582,15 @@ inline model load_model(const std::string& file_path,
     bool verify = true,
     const std::function<void(std::string)>& logger = cout_logger,
     float_type verify_epsilon = static_cast<float_type>(0.0001),
-    const internal::layer_creators& custom_layer_creators = internal::layer_creators())
+    const internal::layer_creators& custom_layer_creators = internal::layer_creators(),
+    const std::string& kernel_tuning_cache_path = "",
+    bool share_weights = false)
 {
     fplus::stopwatch stopwatch;
     std::ifstream in_stream(file_path);
     internal::assertion(in_stream.good(), "Can not open " + file_path);
     const auto model = read_model(in_stream, verify, logger, verify_epsilon,
-        custom_layer_creators);
+        custom_layer_creators, kernel_tuning_cache_path, share_weights);
     if (logger) {
         const std::string additional_action = verify ? ", testing" : "";
         logger("Loading, constructing" + additional_action + " of " + file_path + " took " + fplus::show_float(0, 6, stopwatch.elapsed()) + " s overall.\n");
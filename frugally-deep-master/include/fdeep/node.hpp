@@ -63,6 +63,10 @@ namespace internal {
             return apply_layer(layer,
                 fplus::transform(get_input, inbound_connections_));
         }
+        const node_connections& inbound_connections() const
+        {
+            return inbound_connections_;
+        }
 
     private:
         node_connections inbound_connections_;
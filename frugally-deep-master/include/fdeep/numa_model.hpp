@@ -0,0 +1,77 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include "fdeep/cancellation.hpp"
+#include "fdeep/memory_placement.hpp"
+#include "fdeep/model.hpp"
+#include "fdeep/pipeline.hpp"
+#include "fdeep/worker_pool.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+namespace fdeep {
+
+// One replica of a model per NUMA node, each only used by workers
+// pinned to the CPUs of its node.
+// Every replica is loaded by one of these workers, so (with the kernel's
+// first-touch policy) its weights and buffers end up in the memory of that node,
+// and no prediction has to read weights from another node.
+// load must create a model with weights of its own,
+// i.e., not one loaded with share_weights = true.
+class numa_replicated_model {
+public:
+    explicit numa_replicated_model(const std::function<model()>& load)
+        : pools_()
+        , replicas_()
+        , next_(0)
+    {
+        for (const auto& cpus : internal::numa_node_cpus()) {
+            pools_.push_back(std::make_unique<internal::worker_pool>(cpus.size(),
+                [cpus](std::size_t) { internal::pin_current_thread_to_cpus(cpus); }));
+            replicas_.push_back(std::make_shared<model>(pools_.back()->submit(load).get()));
+        }
+    }
+
+    std::size_t node_count() const
+    {
+        return replicas_.size();
+    }
+
+    const model& replica(std::size_t node) const
+    {
+        return *replicas_[node];
+    }
+
+    // Runs the prediction on the workers of the next node (round robin)
+    // with the replica of that node.
+    std::future<tensors> predict_async(const tensors& inputs,
+        const cancellation_token& token = cancellation_token())
+    {
+        const std::size_t node = next_++ % replicas_.size();
+        const auto replica = replicas_[node];
+        return pools_[node]->submit([replica, inputs, token]() -> tensors {
+            const internal::cancellation_scope cancellation(token);
+            return replica->predict(inputs);
+        });
+    }
+
+private:
+    // Declared first, so the workers are stopped after the replicas are released.
+    std::vector<std::unique_ptr<internal::worker_pool>> pools_;
+    std::vector<std::shared_ptr<const model>> replicas_;
+    std::atomic<std::size_t> next_;
+};
+
+}
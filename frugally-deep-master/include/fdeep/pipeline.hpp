@@ -0,0 +1,211 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include <fplus/fplus.hpp>
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace fdeep {
+namespace internal {
+
+    struct pipeline_throughput {
+        // Number of stages (and threads) actually used.
+        std::size_t stages_;
+        // Forward passes per second.
+        double pipelined_;
+        double data_parallel_;
+    };
+
+    // A thread-safe FIFO queue holding at most capacity elements,
+    // to hand work from one pipeline stage to the next.
+    template <typename T>
+    class bounded_queue {
+    public:
+        explicit bounded_queue(std::size_t capacity)
+            : capacity_(capacity)
+            , closed_(false)
+            , values_()
+            , mutex_()
+            , not_full_()
+            , not_empty_()
+        {
+            assertion(capacity > 0, "queue capacity must be positive");
+        }
+
+        // Waits while the queue is full.
+        // Returns false (and drops the value) if the queue has been closed.
+        bool push(T&& value)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            not_full_.wait(lock, [this]() { return closed_ || values_.size() < capacity_; });
+            if (closed_) {
+                return false;
+            }
+            values_.push_back(std::move(value));
+            not_empty_.notify_one();
+            return true;
+        }
+
+        // Waits while the queue is empty.
+        // Returns nothing once it has been closed and all values are taken.
+        fplus::maybe<T> pop()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            not_empty_.wait(lock, [this]() { return closed_ || !values_.empty(); });
+            if (values_.empty()) {
+                return fplus::nothing<T>();
+            }
+            T result = std::move(values_.front());
+            values_.pop_front();
+            not_full_.notify_one();
+            return result;
+        }
+
+        void close()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+            not_full_.notify_all();
+            not_empty_.notify_all();
+        }
+
+    private:
+        std::size_t capacity_;
+        bool closed_;
+        std::deque<T> values_;
+        std::mutex mutex_;
+        std::condition_variable not_full_;
+        std::condition_variable not_empty_;
+    };
+
+    // Lets the calling thread only run on the given CPUs.
+    // Only supported on Linux, does nothing on other systems.
+    inline void pin_current_thread_to_cpus(const std::vector<std::size_t>& cpus)
+    {
+#if defined(__linux__)
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        for (const auto cpu : cpus) {
+            if (cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &cpu_set);
+            }
+        }
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_set);
+#else
+        (void)cpus;
+#endif
+    }
+
+    // The CPUs the calling thread may run on, i.e., its affinity mask,
+    // which it inherits from the process (e.g., restricted by taskset or a container).
+    // Only supported on Linux, empty on other systems.
+    inline std::vector<std::size_t> allowed_cpus()
+    {
+        std::vector<std::size_t> result;
+#if defined(__linux__)
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        if (sched_getaffinity(0, sizeof(cpu_set_t), &cpu_set) == 0) {
+            for (std::size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &cpu_set)) {
+                    result.push_back(cpu);
+                }
+            }
+        }
+#endif
+        return result;
+    }
+
+    // Passes every item through all stages (in this order),
+    // with every stage running in its own thread,
+    // so different stages work on different items at the same time.
+    // At most queue_capacity items wait between two stages.
+    // Exceptions thrown by a stage are rethrown after all threads have stopped.
+    template <typename T>
+    std::vector<T> run_pipeline(const std::vector<std::function<void(T&)>>& stages,
+        std::vector<T> items, std::size_t queue_capacity, bool pin_threads)
+    {
+        assertion(!stages.empty(), "a pipeline needs at least one stage");
+        std::vector<std::unique_ptr<bounded_queue<T>>> queues;
+        for (std::size_t i = 0; i <= stages.size(); ++i) {
+            queues.push_back(std::make_unique<bounded_queue<T>>(
+                i == stages.size() ? std::max<std::size_t>(1, items.size()) : queue_capacity));
+        }
+
+        std::mutex error_mutex;
+        std::exception_ptr error;
+        const auto close_all = [&queues]() {
+            for (const auto& queue : queues) {
+                queue->close();
+            }
+        };
+
+        // Stage i runs on the i-th of the CPUs allowed for the calling thread.
+        const auto cpus = pin_threads ? allowed_cpus() : std::vector<std::size_t>();
+        std::vector<std::thread> threads;
+        for (std::size_t i = 0; i < stages.size(); ++i) {
+            threads.emplace_back([&, i]() {
+                if (!cpus.empty()) {
+                    pin_current_thread_to_cpus({ cpus[i % cpus.size()] });
+                }
+                try {
+                    for (auto item = queues[i]->pop(); item.is_just(); item = queues[i]->pop()) {
+                        T value = item.unsafe_get_just();
+                        stages[i](value);
+                        if (!queues[i + 1]->push(std::move(value))) {
+                            break;
+                        }
+                    }
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    close_all();
+                    return;
+                }
+                queues[i + 1]->close();
+            });
+        }
+
+        for (auto& item : items) {
+            if (!queues.front()->push(std::move(item))) {
+                break;
+            }
+        }
+        queues.front()->close();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+
+        std::vector<T> results;
+        for (auto item = queues.back()->pop(); item.is_just(); item = queues.back()->pop()) {
+            results.push_back(item.unsafe_get_just());
+        }
+        return results;
+    }
+
+}
+}
@@ -8,6 +8,7 @@
 
 #include "fdeep/common.hpp"
 
+#include "fdeep/matmul.hpp"
 #include "fdeep/tensor_pos.hpp"
 #include "fdeep/tensor_shape.hpp"
 
@@ -18,6 +19,7 @@
 #include <cstddef>
 #include <functional>
 #include <limits>
+#include <numeric>
 #include <string>
 #include <utility>
 #include <vector>
@@ -187,10 +189,31 @@ namespace internal {
         return t.get(tensor_pos(static_cast<std::size_t>(0)));
     }
 
+    template <typename F>
+    FDEEP_FORCE_INLINE void transform_values_kernel(F f, const float_type* in, float_type* out, std::size_t count)
+    {
+        for (std::size_t i = 0; i < count; ++i) {
+            out[i] = static_cast<float_type>(f(in[i]));
+        }
+    }
+
+    FDEEP_KERNEL_VARIANTS(template <typename F>, void, transform_values,
+        (F f, const float_type* in, float_type* out, std::size_t count), (f, in, out, count))
+
+    template <typename F>
+    void transform_values(F f, const float_type* in, float_type* out, std::size_t count)
+    {
+        typedef void (*kernel)(F, const float_type*, float_type*, std::size_t);
+        static const kernel selected = FDEEP_SELECT_KERNEL(kernel, transform_values);
+        selected(f, in, out, count);
+    }
+
     template <typename F>
     tensor transform_tensor(F f, const tensor& m)
     {
-        return tensor(m.shape(), fplus::transform_convert<float_vec>(f, *m.as_vector()));
+        float_vec values(m.as_vector()->size());
+        transform_values(f, m.as_vector()->data(), values.data(), values.size());
+        return tensor(m.shape(), std::move(values));
     }
 
     inline std::vector<tensor> tensor_to_depth_slices(const tensor& m)
@@ -682,6 +705,24 @@ namespace internal {
         return sum_tensors(tensor_to_depth_slices(t));
     }
 
+    // Sum of the depth slices, each one multiplied by its weight.
+    inline tensor weighted_sum_depth(const tensor& t, const float_vec& weights)
+    {
+        const auto depth = t.shape().depth_;
+        assertion(weights.size() == depth, "invalid number of weights");
+        float_vec result_values(t.shape().volume() / depth);
+        const Eigen::Map<const RowMajorMatrixXf, Eigen::Unaligned> values(
+            t.as_vector()->data(),
+            static_cast<EigenIndex>(result_values.size()),
+            static_cast<EigenIndex>(depth));
+        const Eigen::Map<const Eigen::Matrix<float_type, Eigen::Dynamic, 1>, Eigen::Unaligned> weights_vec(
+            weights.data(), static_cast<EigenIndex>(depth));
+        Eigen::Map<Eigen::Matrix<float_type, Eigen::Dynamic, 1>, Eigen::Unaligned> result_vec(
+            result_values.data(), static_cast<EigenIndex>(result_values.size()));
+        result_vec.noalias() = values * weights_vec;
+        return tensor(change_tensor_shape_dimension_by_index(t.shape(), 4, 1), std::move(result_values));
+    }
+
     inline tensor multiply_tensors(const tensors& ts_orig)
     {
         return fplus::fold_left_1(mult_tensors, ts_orig);
@@ -815,12 +856,10 @@ namespace internal {
         bool normalize)
     {
         /*
-    Move axes[0] to start of a.
-    Move axes[1] to end of b.
-    Reshape a into (axes[0], remaining_axes).
-    Reshape b into (remaining_axes, axes[1]).
-    Matrix-multiply b with a.
-    Reshape result into: non-contracted axes of a + non-contracted axes of b.
+    View a as (outer_a, axes[0], inner_a).
+    View b as (outer_b, axes[1], inner_b).
+    Matrix-multiply the blocks (without moving any values).
+    Result has shape: non-contracted axes of a + non-contracted axes of b.
     See:
     - https://github.com/keras-team/keras/blob/v2.11.0/keras/layers/merging/dot.py#L29-L206
     - https://github.com/numpy/numpy/blob/9896b46b36c4875badc15787c403840d997cf45a/numpy/core/numeric.py#L938
@@ -836,48 +875,89 @@ namespace internal {
         const auto axis_a = axes[0];
         const auto axis_b = axes[1];
 
-        const auto permute_target_a_suffix = fplus::keep_if(
-            fplus::is_not_equal_to(axis_a), fplus::numbers(std::size_t(1), a.rank() + 1));
-        const auto permute_target_b_prefix = fplus::keep_if(
-            fplus::is_not_equal_to(axis_b), fplus::numbers(std::size_t(1), b.rank() + 1));
+        assertion(axis_a >= 1 && static_cast<std::size_t>(axis_a) <= a.rank(), "invalid axis for first tensor");
+        assertion(axis_b >= 1 && static_cast<std::size_t>(axis_b) <= b.rank(), "invalid axis for second tensor");
 
-        const auto permute_target_a = fplus::prepend_elem(axis_a, permute_target_a_suffix);
-        const auto permute_target_b = fplus::append_elem(axis_b, permute_target_b_prefix);
+        const tensor a_normalized = normalize ? l2_normalize(a, { axis_a }) : a;
+        const tensor b_normalized = normalize ? l2_normalize(b, { axis_b }) : b;
 
-        const auto a_permuted = permute_tensor(normalize ? l2_normalize(a, { axis_a }) : a, permute_target_a);
-        const auto b_permuted = permute_tensor(normalize ? l2_normalize(b, { axis_b }) : b, permute_target_b);
+        // Instead of permuting the contracted axes into place,
+        // both tensors are viewed as (outer, contracted, inner) blocks
+        // and multiplied with strided matrix products.
+        const auto a_dims = a.shape().dimensions();
+        const auto b_dims = b.shape().dimensions();
+        const auto a_axis_idx = static_cast<std::size_t>(axis_a - 1);
+        const auto b_axis_idx = static_cast<std::size_t>(axis_b - 1);
 
-        const auto a_axis_dim_size = a.shape().dimensions()[static_cast<std::size_t>(axis_a - 1)];
-        const auto b_axis_dim_size = b.shape().dimensions()[static_cast<std::size_t>(axis_b - 1)];
+        const auto dims_product = [](const std::vector<std::size_t>& dims, std::size_t begin, std::size_t end) {
+            std::size_t result = 1;
+            for (std::size_t i = begin; i < end; ++i) {
+                result *= dims[i];
+            }
+            return result;
+        };
 
-        const auto a_remaining_dim_sizes = fplus::elems_at_idxs(
-            fplus::numbers(std::size_t(1), a.rank()), a_permuted.shape().dimensions());
-        const auto b_remaining_dim_sizes = fplus::elems_at_idxs(
-            fplus::numbers(std::size_t(0), b.rank() - 1), b_permuted.shape().dimensions());
+        const std::size_t contracted_size = a_dims[a_axis_idx];
+        assertion(contracted_size == b_dims[b_axis_idx], "contracted dimensions must have the same size");
 
-        const auto a_remaining_dim_sizes_prod = a.rank() == 1 ? 1 : fplus::product(a_remaining_dim_sizes);
-        const auto b_remaining_dim_sizes_prod = b.rank() == 1 ? 1 : fplus::product(b_remaining_dim_sizes);
+        const std::size_t a_outer = dims_product(a_dims, 0, a_axis_idx);
+        const std::size_t a_inner = dims_product(a_dims, a_axis_idx + 1, a_dims.size());
+        const std::size_t b_outer = dims_product(b_dims, 0, b_axis_idx);
+        const std::size_t b_inner = dims_product(b_dims, b_axis_idx + 1, b_dims.size());
 
-        const auto out_dims = permute_target_a_suffix.size() + permute_target_b_prefix.size() == 0 ? std::vector<std::size_t> { 1 } : fplus::concat(std::vector<std::vector<std::size_t>> { a_remaining_dim_sizes, b_remaining_dim_sizes });
-        tensor output = tensor(create_tensor_shape_from_dims(out_dims), static_cast<float_type>(0));
+        const auto a_remaining_dim_sizes = fplus::append(
+            std::vector<std::size_t>(a_dims.begin(), a_dims.begin() + static_cast<std::ptrdiff_t>(a_axis_idx)),
+            std::vector<std::size_t>(a_dims.begin() + static_cast<std::ptrdiff_t>(a_axis_idx) + 1, a_dims.end()));
+        const auto b_remaining_dim_sizes = fplus::append(
+            std::vector<std::size_t>(b_dims.begin(), b_dims.begin() + static_cast<std::ptrdiff_t>(b_axis_idx)),
+            std::vector<std::size_t>(b_dims.begin() + static_cast<std::ptrdiff_t>(b_axis_idx) + 1, b_dims.end()));
 
-        const Eigen::Map<RowMajorMatrixXf, Eigen::Unaligned>
-            a_mat(const_cast<float_type*>(a_permuted.as_vector()->data()),
-                static_cast<EigenIndex>(a_axis_dim_size),
-                static_cast<EigenIndex>(a_remaining_dim_sizes_prod));
+        const auto out_dims = a_remaining_dim_sizes.size() + b_remaining_dim_sizes.size() == 0 ? std::vector<std::size_t> { 1 } : fplus::append(a_remaining_dim_sizes, b_remaining_dim_sizes);
+        tensor output = tensor(create_tensor_shape_from_dims(out_dims), static_cast<float_type>(0));
 
-        const Eigen::Map<RowMajorMatrixXf, Eigen::Unaligned>
-            b_mat(const_cast<float_type*>(b_permuted.as_vector()->data()),
-                static_cast<EigenIndex>(b_remaining_dim_sizes_prod),
-                static_cast<EigenIndex>(b_axis_dim_size));
+        // The output is a row-major (a_outer * a_inner) x (b_outer * b_inner) matrix.
+        const std::size_t out_row_stride = b_outer * b_inner;
+        float_type* const a_ptr = const_cast<float_type*>(a_normalized.as_vector()->data());
+        float_type* const b_ptr = const_cast<float_type*>(b_normalized.as_vector()->data());
+
+        // If there is no inner block, all outer indices form the rows of one matrix.
+        // Otherwise there is one (inner x contracted) matrix per outer index.
+        const bool a_batched = a_inner != 1;
+        const strided_matrix a_mat = a_batched
+            ? strided_matrix { a_ptr, a_inner, contracted_size, 1, a_inner }
+            : strided_matrix { a_ptr, a_outer, contracted_size, contracted_size, 1 };
+        const bool b_batched = b_inner != 1;
+        const strided_matrix b_mat = b_batched
+            ? strided_matrix { b_ptr, contracted_size, b_inner, b_inner, 1 }
+            : strided_matrix { b_ptr, contracted_size, b_outer, 1, contracted_size };
+
+        const strided_matrix out_mat { output.as_vector()->data(), a_mat.rows_, b_mat.cols_, out_row_stride, 1 };
+
+        const std::size_t a_batch_count = a_batched ? a_outer : 1;
+        for (std::size_t i = 0; i < a_batch_count; ++i) {
+            batched_matmul(b_batched ? b_outer : 1,
+                strided_matrix_offset(a_mat, i * contracted_size * a_inner), 0,
+                b_mat, contracted_size * b_inner,
+                strided_matrix_offset(out_mat, i * a_inner * out_row_stride), b_inner);
+        }
 
-        Eigen::Map<ColMajorMatrixXf, Eigen::Unaligned>
-            output_map(output.as_vector()->data(),
-                static_cast<EigenIndex>(b_remaining_dim_sizes_prod),
-                static_cast<EigenIndex>(a_remaining_dim_sizes_prod));
+        return output;
+    }
 
-        output_map.noalias() = b_mat * a_mat;
+    // Row-major (width x depth) matrix view of a tensor with rank 2.
+    inline strided_matrix rank_2_matrix_view(const tensor& t)
+    {
+        assertion(t.shape().rank() == 2, "matrix view needs a tensor of rank 2");
+        return { const_cast<float_type*>(t.as_vector()->data()),
+            t.shape().width_, t.shape().depth_, t.shape().depth_, 1 };
+    }
 
+    // Multiplies two (possibly transposed) matrix views into a tensor of rank 2.
+    inline tensor matmul_tensors(const strided_matrix& a, const strided_matrix& b)
+    {
+        tensor output(tensor_shape(a.rows_, b.cols_), static_cast<float_type>(0));
+        matmul_strided(a, b,
+            { output.as_vector()->data(), a.rows_, b.cols_, b.cols_, 1 });
         return output;
     }
 
@@ -954,135 +1034,138 @@ namespace internal {
         return out_vol;
     }
 
-    inline float_type interpolate_2d_value_bilinearly(const tensor& t, float_type y, float_type x, std::size_t z)
-    {
-        y = fplus::max(0, y);
-        x = fplus::max(0, x);
-        y = fplus::min(y, t.height());
-        x = fplus::min(x, t.width());
-        std::size_t y_top = static_cast<std::size_t>(fplus::max(0, fplus::floor(y)));
-        std::size_t y_bottom = static_cast<std::size_t>(fplus::min(t.height() - 1, y_top + 1));
-        std::size_t x_left = static_cast<std::size_t>(fplus::max(0, fplus::floor(x)));
-        std::size_t x_right = static_cast<std::size_t>(fplus::min(t.width() - 1, x_left + 1));
-        const auto val_top_left = t.get_ignore_rank(tensor_pos(y_top, x_left, z));
-        const auto val_top_right = t.get_ignore_rank(tensor_pos(y_top, x_right, z));
-        const auto val_bottom_left = t.get_ignore_rank(tensor_pos(y_bottom, x_left, z));
-        const auto val_bottom_right = t.get_ignore_rank(tensor_pos(y_bottom, x_right, z));
-        const auto y_factor_top = static_cast<float_type>(y_bottom) - y;
-        const auto y_factor_bottom = 1.0 - y_factor_top;
-        const auto x_factor_left = static_cast<float_type>(x_right) - x;
-        const auto x_factor_right = 1.0 - x_factor_left;
-        return static_cast<float_type>(
-            y_factor_top * x_factor_left * val_top_left + y_factor_top * x_factor_right * val_top_right + y_factor_bottom * x_factor_left * val_bottom_left + y_factor_bottom * x_factor_right * val_bottom_right);
-    }
+    // Precomputed interpolation weights along one axis of a separable resize.
+    // Output coordinate i is the weighted sum of the input coordinates
+    // indices_[j] with weights_[j] for j in [offsets_[i], offsets_[i + 1]).
+    struct resize_axis_weights {
+        std::vector<std::size_t> offsets_;
+        std::vector<std::size_t> indices_;
+        std::vector<float_type> weights_;
+    };
 
-    inline tensor resize2d_bilinear(const tensor& in_vol, const shape2& target_size)
+    inline resize_axis_weights bilinear_resize_axis_weights(std::size_t in_size, std::size_t out_size)
     {
-        tensor out_vol(tensor_shape(target_size.height_, target_size.width_, in_vol.shape().depth_), 0);
-        const float_type scale_y = static_cast<float_type>(target_size.height_) / static_cast<float_type>(in_vol.shape().height_);
-        const float_type scale_x = static_cast<float_type>(target_size.width_) / static_cast<float_type>(in_vol.shape().width_);
-        for (std::size_t y = 0; y < out_vol.shape().height_; ++y) {
-            const auto y_in = (static_cast<float_type>(y) + 0.5f) / scale_y - 0.5f;
-            for (std::size_t x = 0; x < out_vol.shape().width_; ++x) {
-                const auto x_in = (static_cast<float_type>(x) + 0.5f) / scale_x - 0.5f;
-                for (std::size_t z = 0; z < in_vol.shape().depth_; ++z) {
-                    out_vol.set_ignore_rank(tensor_pos(y, x, z),
-                        interpolate_2d_value_bilinearly(in_vol, y_in, x_in, z));
-                }
-            }
+        resize_axis_weights result;
+        result.offsets_.reserve(out_size + 1);
+        result.offsets_.push_back(0);
+        const float_type scale = static_cast<float_type>(out_size) / static_cast<float_type>(in_size);
+        for (std::size_t i = 0; i < out_size; ++i) {
+            auto pos = (static_cast<float_type>(i) + 0.5f) / scale - 0.5f;
+            pos = fplus::max(0, pos);
+            pos = fplus::min(pos, in_size);
+            const std::size_t low = static_cast<std::size_t>(fplus::max(0, fplus::floor(pos)));
+            const std::size_t high = static_cast<std::size_t>(fplus::min(in_size - 1, low + 1));
+            const auto factor_low = static_cast<float_type>(high) - pos;
+            result.indices_.push_back(low);
+            result.weights_.push_back(factor_low);
+            result.indices_.push_back(high);
+            result.weights_.push_back(static_cast<float_type>(1) - factor_low);
+            result.offsets_.push_back(result.indices_.size());
         }
-        return out_vol;
+        return result;
     }
 
-    inline float_type interpolate_2d_value_area(const tensor& t,
-        float_type top, float_type bottom, float_type left, float_type right,
-        std::size_t z)
+    inline resize_axis_weights area_resize_axis_weights(std::size_t in_size, std::size_t out_size)
     {
-        const std::size_t top_int_outer = fplus::floor<float_type, std::size_t>(top);
-        const std::size_t left_int_outer = fplus::floor<float_type, std::size_t>(left);
-
-        const std::size_t top_int_inner = fplus::ceil<float_type, std::size_t>(top);
-        const std::size_t bottom_int_inner = fplus::floor<float_type, std::size_t>(bottom);
-        const std::size_t left_int_inner = fplus::ceil<float_type, std::size_t>(left);
-        const std::size_t right_int_inner = fplus::floor<float_type, std::size_t>(right);
-
-        const float_type top_weight = static_cast<float_type>(top_int_inner) - top;
-        const float_type left_weight = static_cast<float_type>(left_int_inner) - left;
-        const float_type bottom_weight = bottom - static_cast<float_type>(bottom_int_inner);
-        const float_type right_weight = right - static_cast<float_type>(right_int_inner);
-
-        const float_type top_left_weight = top_weight * left_weight;
-        const float_type top_right_weight = top_weight * right_weight;
-        const float_type bottom_left_weight = bottom_weight * left_weight;
-        const float_type bottom_right_weight = bottom_weight * right_weight;
-
-        float_type inner_sum = static_cast<float_type>(0);
-        std::size_t inner_pixels = 0;
-        for (std::size_t y = top_int_inner; y < bottom_int_inner; ++y) {
-            for (std::size_t x = left_int_inner; x < right_int_inner; ++x) {
-                inner_sum += t.get_ignore_rank(tensor_pos(y, x, z));
-                inner_pixels += 1;
+        // The box [begin, end) of each output coordinate covers
+        // the inner input cells fully and the two border cells partially.
+        // Since the 2D weights are the products of the 1D weights,
+        // normalizing each axis separately gives the same averages.
+        resize_axis_weights result;
+        result.offsets_.reserve(out_size + 1);
+        result.offsets_.push_back(0);
+        const float_type scale = static_cast<float_type>(out_size) / static_cast<float_type>(in_size);
+        const auto add = [&](std::size_t idx, float_type weight) {
+            if (weight != 0) {
+                result.indices_.push_back(std::min(idx, in_size - 1));
+                result.weights_.push_back(weight);
             }
+        };
+        for (std::size_t i = 0; i < out_size; ++i) {
+            const auto begin = static_cast<float_type>(i) / scale;
+            const auto end = static_cast<float_type>(i + 1) / scale;
+            const std::size_t begin_outer = fplus::floor<float_type, std::size_t>(begin);
+            const std::size_t begin_inner = fplus::ceil<float_type, std::size_t>(begin);
+            const std::size_t end_inner = fplus::floor<float_type, std::size_t>(end);
+            const std::size_t first = result.indices_.size();
+            add(begin_outer, static_cast<float_type>(begin_inner) - begin);
+            for (std::size_t j = begin_inner; j < end_inner; ++j) {
+                add(j, 1);
+            }
+            add(end_inner, end - static_cast<float_type>(end_inner));
+            float_type weight_sum = 0;
+            for (std::size_t j = first; j < result.weights_.size(); ++j) {
+                weight_sum += result.weights_[j];
+            }
+            for (std::size_t j = first; j < result.weights_.size(); ++j) {
+                result.weights_[j] /= weight_sum;
+            }
+            result.offsets_.push_back(result.indices_.size());
         }
+        return result;
+    }
 
-        float_type top_sum = static_cast<float_type>(0);
-        std::size_t top_pixels = 0;
-        for (std::size_t x = left_int_inner; x < right_int_inner; ++x) {
-            top_sum += t.get_ignore_rank(tensor_pos(top_int_outer, x, z));
-            top_pixels += 1;
-        }
-
-        float_type bottom_sum = static_cast<float_type>(0);
-        std::size_t bottom_pixels = 0;
-        for (std::size_t x = left_int_inner; x < right_int_inner; ++x) {
-            bottom_sum += t.get_ignore_rank(tensor_pos(bottom_int_inner, x, z));
-            bottom_pixels += 1;
-        }
-
-        float_type left_sum = static_cast<float_type>(0);
-        std::size_t left_pixels = 0;
-        for (std::size_t y = top_int_inner; y < bottom_int_inner; ++y) {
-            left_sum += t.get_ignore_rank(tensor_pos(y, left_int_outer, z));
-            left_pixels += 1;
-        }
-
-        float_type right_sum = static_cast<float_type>(0);
-        std::size_t right_pixels = 0;
-        for (std::size_t y = top_int_inner; y < bottom_int_inner; ++y) {
-            right_sum += t.get_ignore_rank(tensor_pos(y, right_int_inner, z));
-            right_pixels += 1;
+    // Resizes in two passes, first vertically, then horizontally.
+    // The vertical pass combines complete (contiguous) input rows,
+    // the horizontal pass combines all channels of a pixel at once.
+    FDEEP_FORCE_INLINE tensor resize2d_separable_kernel(const tensor& in_vol,
+        const resize_axis_weights& y_weights, const resize_axis_weights& x_weights)
+    {
+        const std::size_t in_width = in_vol.shape().width_;
+        const std::size_t depth = in_vol.shape().depth_;
+        const std::size_t out_height = y_weights.offsets_.size() - 1;
+        const std::size_t out_width = x_weights.offsets_.size() - 1;
+
+        const float_type* in_ptr = in_vol.as_vector()->data();
+        const std::size_t in_row_size = in_width * depth;
+        const auto in_row_size_idx = static_cast<EigenIndex>(in_row_size);
+        ArrayXf1D row(in_row_size_idx);
+
+        tensor out_vol(tensor_shape(out_height, out_width, depth), 0);
+        float_type* out_ptr = out_vol.as_vector()->data();
+        for (std::size_t y = 0; y < out_height; ++y) {
+            row.setZero();
+            for (std::size_t j = y_weights.offsets_[y]; j < y_weights.offsets_[y + 1]; ++j) {
+                row += y_weights.weights_[j] * Eigen::Map<const ArrayXf1D, Eigen::Unaligned>(in_ptr + y_weights.indices_[j] * in_row_size, in_row_size_idx);
+            }
+            const float_type* row_ptr = row.data();
+            for (std::size_t x = 0; x < out_width; ++x, out_ptr += depth) {
+                for (std::size_t j = x_weights.offsets_[x]; j < x_weights.offsets_[x + 1]; ++j) {
+                    const float_type weight = x_weights.weights_[j];
+                    const float_type* px_ptr = row_ptr + x_weights.indices_[j] * depth;
+                    for (std::size_t z = 0; z < depth; ++z) {
+                        out_ptr[z] += weight * px_ptr[z];
+                    }
+                }
+            }
         }
+        return out_vol;
+    }
 
-        const float_type top_left_val = t.get_ignore_rank(tensor_pos(top_int_outer, left_int_outer, z));
-        const float_type top_right_val = t.get_ignore_rank(tensor_pos(top_int_outer, right_int_inner, z));
-        const float_type bottom_left_val = t.get_ignore_rank(tensor_pos(bottom_int_inner, left_int_outer, z));
-        const float_type bottom_right_val = t.get_ignore_rank(tensor_pos(bottom_int_inner, right_int_inner, z));
-
-        const float_type weighted_sum = inner_sum + top_weight * top_sum + bottom_weight * bottom_sum + left_weight * left_sum + right_weight * right_sum + top_left_weight * top_left_val + top_right_weight * top_right_val + bottom_left_weight * bottom_left_val + bottom_right_weight * bottom_right_val;
+    FDEEP_KERNEL_VARIANTS(, tensor, resize2d_separable,
+        (const tensor& in_vol, const resize_axis_weights& y_weights, const resize_axis_weights& x_weights),
+        (in_vol, y_weights, x_weights))
 
-        const float_type num_pixels = static_cast<float_type>(inner_pixels) + top_weight * static_cast<float_type>(top_pixels) + bottom_weight * static_cast<float_type>(bottom_pixels) + left_weight * static_cast<float_type>(left_pixels) + right_weight * static_cast<float_type>(right_pixels) + top_left_weight + top_right_weight + bottom_left_weight + bottom_right_weight;
+    inline tensor resize2d_separable(const tensor& in_vol,
+        const resize_axis_weights& y_weights, const resize_axis_weights& x_weights)
+    {
+        typedef tensor (*kernel)(const tensor&, const resize_axis_weights&, const resize_axis_weights&);
+        static const kernel selected = FDEEP_SELECT_KERNEL(kernel, resize2d_separable);
+        return selected(in_vol, y_weights, x_weights);
+    }
 
-        return weighted_sum / num_pixels;
+    inline tensor resize2d_bilinear(const tensor& in_vol, const shape2& target_size)
+    {
+        return resize2d_separable(in_vol,
+            bilinear_resize_axis_weights(in_vol.shape().height_, target_size.height_),
+            bilinear_resize_axis_weights(in_vol.shape().width_, target_size.width_));
     }
 
     inline tensor resize2d_area(const tensor& in_vol, const shape2& target_size)
     {
-        tensor out_vol(tensor_shape(target_size.height_, target_size.width_, in_vol.shape().depth_), 0);
-        const float_type scale_y = static_cast<float_type>(target_size.height_) / static_cast<float_type>(in_vol.shape().height_);
-        const float_type scale_x = static_cast<float_type>(target_size.width_) / static_cast<float_type>(in_vol.shape().width_);
-        for (std::size_t y = 0; y < out_vol.shape().height_; ++y) {
-            const auto y_in_top = (static_cast<float_type>(y)) / scale_y;
-            const auto y_in_bottom = (static_cast<float_type>(y + 1)) / scale_y;
-            for (std::size_t x = 0; x < out_vol.shape().width_; ++x) {
-                const auto x_in_left = (static_cast<float_type>(x)) / scale_x;
-                const auto x_in_right = (static_cast<float_type>(x + 1)) / scale_x;
-                for (std::size_t z = 0; z < in_vol.shape().depth_; ++z) {
-                    out_vol.set_ignore_rank(tensor_pos(y, x, z),
-                        interpolate_2d_value_area(in_vol, y_in_top, y_in_bottom, x_in_left, x_in_right, z));
-                }
-            }
-        }
-        return out_vol;
+        return resize2d_separable(in_vol,
+            area_resize_axis_weights(in_vol.shape().height_, target_size.height_),
+            area_resize_axis_weights(in_vol.shape().width_, target_size.width_));
     }
 
     inline tensor resize_tensor_2d(const tensor& in_vol, const shape2& target_size, const std::string& interpolation)
@@ -1122,35 +1205,94 @@ namespace internal {
         return resize_tensor_2d(cropped, target_size, interpolation);
     }
 
-    inline tensor softmax(const tensor& input)
+    // Softmax function is applied along channel dimension.
+    FDEEP_FORCE_INLINE tensor softmax_kernel(const tensor& input)
     {
         tensor output = tensor(input.shape(), static_cast<float_type>(0));
 
-        // Softmax function is applied along channel dimension.
-        for (size_t y = 0; y < input.shape().height_; ++y) {
-            for (size_t x = 0; x < input.shape().width_; ++x) {
-                float_type m = std::numeric_limits<float_type>::lowest();
-                for (size_t z_class = 0; z_class < input.shape().depth_; ++z_class) {
-                    m = std::max(m, input.get_ignore_rank(tensor_pos(y, x, z_class)));
-                }
+        const std::size_t depth = input.shape().depth_;
+        const std::size_t pixels = input.shape().height_ * input.shape().width_;
+        for (std::size_t p = 0; p < pixels; ++p) {
+            const float_type* in_ptr = input.as_vector()->data() + p * depth;
+            float_type* out_ptr = output.as_vector()->data() + p * depth;
 
-                // We are not using Kahan summation, since the number
-                // of object classes is usually quite small.
-                float_type sum_shifted = 0.0f;
-                for (size_t z_class = 0; z_class < input.shape().depth_; ++z_class) {
-                    sum_shifted += std::exp(input.get_ignore_rank(tensor_pos(y, x, z_class)) - m);
-                }
+            float_type m = std::numeric_limits<float_type>::lowest();
+            for (std::size_t z_class = 0; z_class < depth; ++z_class) {
+                m = std::max(m, in_ptr[z_class]);
+            }
 
-                const auto log_sum_shifted = std::log(sum_shifted);
-                for (size_t z_class = 0; z_class < input.shape().depth_; ++z_class) {
-                    const auto result = std::exp(input.get_ignore_rank(tensor_pos(y, x, z_class)) - m - log_sum_shifted);
-                    output.set_ignore_rank(tensor_pos(y, x, z_class), std::isinf(result) ? static_cast<float_type>(0) : result);
-                }
+            // We are not using Kahan summation, since the number
+            // of object classes is usually quite small.
+            float_type sum_shifted = 0.0f;
+            for (std::size_t z_class = 0; z_class < depth; ++z_class) {
+                sum_shifted += std::exp(in_ptr[z_class] - m);
+            }
+
+            const auto log_sum_shifted = std::log(sum_shifted);
+            for (std::size_t z_class = 0; z_class < depth; ++z_class) {
+                const auto result = std::exp(in_ptr[z_class] - m - log_sum_shifted);
+                out_ptr[z_class] = std::isinf(result) ? static_cast<float_type>(0) : result;
             }
         }
         return output;
     }
 
+    FDEEP_KERNEL_VARIANTS(, tensor, softmax, (const tensor& input), (input))
+
+    inline tensor softmax(const tensor& input)
+    {
+        typedef tensor (*kernel)(const tensor&);
+        static const kernel selected = FDEEP_SELECT_KERNEL(kernel, softmax);
+        return selected(input);
+    }
+
+    // Indices and values of the k largest of the given values,
+    // largest first (and for equal values, the lower index first).
+    inline std::vector<std::pair<std::size_t, float_type>> top_k_values(
+        const float_type* values, std::size_t size, std::size_t k)
+    {
+        std::vector<std::size_t> indices(size);
+        std::iota(indices.begin(), indices.end(), 0);
+        const auto middle = indices.begin() + static_cast<std::ptrdiff_t>(std::min(k, size));
+        std::partial_sort(indices.begin(), middle, indices.end(),
+            [values](std::size_t a, std::size_t b) {
+                return values[a] > values[b] || (values[a] == values[b] && a < b);
+            });
+        std::vector<std::pair<std::size_t, float_type>> result;
+        for (auto it = indices.begin(); it != middle; ++it) {
+            result.push_back(std::make_pair(*it, values[*it]));
+        }
+        return result;
+    }
+
+    // The same as top_k_values of softmax(logits) for logits of shape (1, 1, z),
+    // but the classes are selected on the logits, and only the normalization
+    // needs the exponential function of all of them.
+    inline std::vector<std::pair<std::size_t, float_type>> softmax_top_k(
+        const tensor& logits, std::size_t k)
+    {
+        assertion(logits.shape().without_depth().area() == 1, "invalid shape for softmax_top_k");
+        const float_type* in_ptr = logits.as_vector()->data();
+        const std::size_t depth = logits.shape().depth_;
+        auto result = top_k_values(in_ptr, depth, k);
+        if (result.empty()) {
+            return result;
+        }
+
+        // Computed in the same way as in softmax, so the results are identical.
+        const float_type m = result.front().second;
+        float_type sum_shifted = 0.0f;
+        for (std::size_t z_class = 0; z_class < depth; ++z_class) {
+            sum_shifted += std::exp(in_ptr[z_class] - m);
+        }
+        const auto log_sum_shifted = std::log(sum_shifted);
+        for (auto& entry : result) {
+            const auto probability = std::exp(entry.second - m - log_sum_shifted);
+            entry.second = std::isinf(probability) ? static_cast<float_type>(0) : probability;
+        }
+        return result;
+    }
+
 }
 
 using float_type = internal::float_type;
@@ -0,0 +1,178 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include "fdeep/tensor.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace fdeep {
+namespace internal {
+
+    // Process-wide store of weight buffers, found by their content,
+    // so models with identical weights (e.g., fine-tuned variants of the same
+    // backbone) can share one copy of them instead of holding their own.
+    // The buffers must not be changed after they have been shared.
+    // Copies of a store are handles to the same buffers.
+    class weight_store {
+    public:
+        weight_store()
+            : state_(std::make_shared<state>())
+            , owner_()
+        {
+        }
+
+        // The same store, sharing buffers for the given owner (e.g., a model).
+        weight_store for_owner(const std::shared_ptr<const void>& owner) const
+        {
+            weight_store result = *this;
+            result.owner_ = owner;
+            return result;
+        }
+
+        // The stored buffer with the same values as the given one.
+        // If there is none yet, the given one is stored and returned.
+        // A buffer stays in the store only as long as one of the owners
+        // sharing it is alive. (Only weak references to the owners are kept,
+        // because fplus::shared_ref, holding the buffers, has no weak counterpart.)
+        shared_float_vec share(const shared_float_vec& values)
+        {
+            assertion(!owner_.expired(), "weights can only be shared for an owner that is alive");
+            const auto hash = hash_values(*values);
+            std::lock_guard<std::mutex> lock(state_->mutex_);
+            auto& candidates = state_->buffers_[hash];
+            remove_expired(candidates);
+            for (auto& candidate : candidates) {
+                if (candidate.values_->size() == values->size()
+                    && std::memcmp(candidate.values_->data(), values->data(), values->size() * sizeof(float_type)) == 0) {
+                    candidate.owners_.push_back(owner_);
+                    return candidate.values_;
+                }
+            }
+            candidates.push_back({ values, { owner_ } });
+            return values;
+        }
+
+        // Number and total size of the different buffers of owners alive.
+        std::size_t buffer_count() const
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex_);
+            remove_all_expired();
+            std::size_t result = 0;
+            for (const auto& entry : state_->buffers_) {
+                result += entry.second.size();
+            }
+            return result;
+        }
+        std::size_t bytes() const
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex_);
+            remove_all_expired();
+            std::size_t result = 0;
+            for (const auto& entry : state_->buffers_) {
+                for (const auto& buffer : entry.second) {
+                    result += buffer.values_->size() * sizeof(float_type);
+                }
+            }
+            return result;
+        }
+
+        // Forgets all buffers. Models keep the ones they use,
+        // but models loaded later will not share them anymore.
+        void clear()
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex_);
+            state_->buffers_.clear();
+        }
+
+    private:
+        struct stored_buffer {
+            shared_float_vec values_;
+            std::vector<std::weak_ptr<const void>> owners_;
+        };
+
+        struct state {
+            std::unordered_map<std::uint64_t, std::vector<stored_buffer>> buffers_;
+            std::mutex mutex_;
+        };
+
+        // Drops the owners not alive anymore, and the buffers without owners.
+        static void remove_expired(std::vector<stored_buffer>& buffers)
+        {
+            for (auto& b : buffers) {
+                b.owners_.erase(std::remove_if(b.owners_.begin(), b.owners_.end(),
+                                    [](const std::weak_ptr<const void>& owner) { return owner.expired(); }),
+                    b.owners_.end());
+            }
+            buffers.erase(std::remove_if(buffers.begin(), buffers.end(),
+                              [](const stored_buffer& b) { return b.owners_.empty(); }),
+                buffers.end());
+        }
+
+        void remove_all_expired() const
+        {
+            for (auto it = state_->buffers_.begin(); it != state_->buffers_.end();) {
+                remove_expired(it->second);
+                it = it->second.empty() ? state_->buffers_.erase(it) : std::next(it);
+            }
+        }
+
+        // FNV-1a, taking the bit pattern of one value instead of one byte per step.
+        static std::uint64_t hash_values(const float_vec& values)
+        {
+            std::uint64_t result = 14695981039346656037ull;
+            for (const float_type x : values) {
+                std::uint64_t bits = 0;
+                std::memcpy(&bits, &x, sizeof(float_type));
+                result = (result ^ bits) * 1099511628211ull;
+            }
+            return result ^ values.size();
+        }
+
+        std::shared_ptr<state> state_;
+        std::weak_ptr<const void> owner_;
+    };
+
+    inline weight_store& global_weight_store()
+    {
+        static weight_store store;
+        return store;
+    }
+
+    // A tensor with the same values, using the stored buffer for them.
+    inline tensor share_tensor_values(weight_store& store, const tensor& t)
+    {
+        return tensor(t.shape(), store.share(t.as_vector()));
+    }
+
+}
+
+// Size of the weights shared by the models loaded with share_weights = true
+// that are still alive. The weights of destroyed models are dropped from the store.
+inline std::size_t shared_weights_bytes()
+{
+    return internal::global_weight_store().bytes();
+}
+
+// Stops sharing the weights of the loaded models with models loaded later,
+// which get their own copies. The loaded models keep sharing them among each other.
+inline void release_shared_weights()
+{
+    internal::global_weight_store().clear();
+}
+
+}
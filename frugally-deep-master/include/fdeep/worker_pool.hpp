@@ -0,0 +1,107 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+#include "fdeep/pipeline.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace fdeep {
+namespace internal {
+
+    class worker_pool;
+
+    // The pool the current thread belongs to, nullptr for other threads.
+    inline worker_pool*& current_worker_pool()
+    {
+        static thread_local worker_pool* pool = nullptr;
+        return pool;
+    }
+
+    // A fixed number of threads running the submitted tasks
+    // in the order they were submitted.
+    // Every thread first calls init_thread (if given) with its index,
+    // e.g., to pin itself to certain CPUs.
+    class worker_pool {
+    public:
+        explicit worker_pool(std::size_t thread_count,
+            const std::function<void(std::size_t)>& init_thread = nullptr)
+            : tasks_(std::numeric_limits<std::size_t>::max())
+            , threads_()
+        {
+            assertion(thread_count > 0, "a worker pool needs at least one thread");
+            for (std::size_t i = 0; i < thread_count; ++i) {
+                threads_.emplace_back([this, init_thread, i]() {
+                    current_worker_pool() = this;
+                    if (init_thread) {
+                        init_thread(i);
+                    }
+                    for (auto task = tasks_.pop(); task.is_just(); task = tasks_.pop()) {
+                        task.unsafe_get_just()();
+                    }
+                });
+            }
+        }
+
+        // Waits for the tasks already submitted.
+        ~worker_pool()
+        {
+            tasks_.close();
+            for (auto& thread : threads_) {
+                thread.join();
+            }
+        }
+
+        worker_pool(const worker_pool&) = delete;
+        worker_pool& operator=(const worker_pool&) = delete;
+
+        std::size_t thread_count() const
+        {
+            return threads_.size();
+        }
+
+        // The future holds the result of f, or the exception it threw.
+        template <typename F>
+        auto submit(F f) -> std::future<decltype(f())>
+        {
+            typedef decltype(f()) result_type;
+            const auto task = std::make_shared<std::packaged_task<result_type()>>(std::move(f));
+            auto result = task->get_future();
+            assertion(tasks_.push([task]() { (*task)(); }), "worker pool has been shut down");
+            return result;
+        }
+
+    private:
+        bounded_queue<std::function<void()>> tasks_;
+        std::vector<std::thread> threads_;
+    };
+
+    // The pool running the asynchronous predictions,
+    // with one thread per CPU core.
+    inline worker_pool& global_worker_pool()
+    {
+        static worker_pool pool(std::max<std::size_t>(1, std::thread::hardware_concurrency()));
+        return pool;
+    }
+
+    // The pool the current thread belongs to (e.g., the one of a NUMA node),
+    // otherwise the global one.
+    inline worker_pool& current_or_global_worker_pool()
+    {
+        return current_worker_pool() != nullptr ? *current_worker_pool() : global_worker_pool();
+    }
+
+}
+}
@@ -0,0 +1,329 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+// Times individual layer kernels on synthetic weights,
+// so performance changes can be measured without downloading models.
+//
+// Usage: kernel_benchmarks [--output results.json] [--baseline baseline.json]
+//                          [--threshold 0.15] [--filter name_part]
+//                          [--huge-pages none|transparent|hugetlb]
+//
+// With a baseline, every kernel that got slower by more than the threshold
+// (relative to the baseline's median) is reported,
+// and the program exits with a non-zero code.
+// The same happens for kernels the baseline has no entry for,
+// so new benchmarks have to be added to the baseline too.
+// The huge page mode applies to the weights and activations of all kernels,
+// so runs with different modes show the effect of the TLB misses saved.
+
+#include "fdeep/fdeep.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+using namespace fdeep::internal;
+
+struct benchmark {
+    std::string name_;
+    std::function<void()> run_;
+};
+
+float_vec random_values(std::size_t count, std::mt19937& rng)
+{
+    std::uniform_real_distribution<float_type> dist(-1, 1);
+    float_vec result(count);
+    for (auto& x : result) {
+        x = dist(rng);
+    }
+    return result;
+}
+
+// Random weights in which the given fraction of the blocks of sparse_block_height
+// consecutive values (i.e., of outputs with the same input) is zero.
+float_vec pruned_values(std::size_t count, double zero_block_fraction, std::mt19937& rng)
+{
+    std::uniform_real_distribution<double> dist(0, 1);
+    float_vec result = random_values(count, rng);
+    for (std::size_t block = 0; block < count; block += sparse_block_height) {
+        if (dist(rng) < zero_block_fraction) {
+            std::fill_n(result.begin() + static_cast<std::ptrdiff_t>(block),
+                std::min(sparse_block_height, count - block), static_cast<float_type>(0));
+        }
+    }
+    return result;
+}
+
+fdeep::tensor random_tensor(const fdeep::tensor_shape& shape, std::mt19937& rng)
+{
+    return fdeep::tensor(shape, random_values(shape.volume(), rng));
+}
+
+benchmark layer_benchmark(const std::string& name, const layer_ptr& layer, const fdeep::tensors& inputs)
+{
+    return { name, [layer, inputs]() {
+                const auto result = layer->apply(inputs);
+                if (result.empty()) {
+                    std::abort();
+                }
+            } };
+}
+
+std::vector<benchmark> create_benchmarks()
+{
+    std::mt19937 rng(42);
+    std::vector<benchmark> result;
+
+    const auto conv = [&](const std::string& name, std::size_t size, std::size_t depth,
+                          std::size_t filter_size, std::size_t filters,
+                          std::size_t stride, std::size_t dilation) {
+        const auto layer = std::make_shared<conv_2d_layer>(name,
+            fdeep::tensor_shape(filter_size, filter_size, depth), filters,
+            shape2(stride, stride), padding::same, shape2(dilation, dilation),
+            random_values(filter_size * filter_size * depth * filters, rng),
+            random_values(filters, rng));
+        result.push_back(layer_benchmark(name, layer, { random_tensor(fdeep::tensor_shape(size, size, depth), rng) }));
+    };
+    conv("conv_1x1_56x56x64_256", 56, 64, 1, 256, 1, 1);
+    conv("conv_3x3_56x56x64_64", 56, 64, 3, 64, 1, 1);
+    conv("conv_3x3_14x14x256_256", 14, 256, 3, 256, 1, 1);
+    conv("conv_3x3_s2_112x112x32_64", 112, 32, 3, 64, 2, 1);
+    conv("conv_3x3_d2_28x28x128_128", 28, 128, 3, 128, 1, 2);
+    conv("conv_7x7_s2_224x224x3_64", 224, 3, 7, 64, 2, 1);
+
+    const auto depthwise = [&](const std::string& name, std::size_t size, std::size_t depth, std::size_t stride) {
+        const auto layer = std::make_shared<depthwise_conv_2d_layer>(name, depth,
+            fdeep::tensor_shape(3, 3, 1), shape2(stride, stride), padding::same, shape2(1, 1),
+            random_values(3 * 3 * depth, rng), random_values(depth, rng));
+        result.push_back(layer_benchmark(name, layer, { random_tensor(fdeep::tensor_shape(size, size, depth), rng) }));
+    };
+    depthwise("depthwise_3x3_112x112x32", 112, 32, 1);
+    depthwise("depthwise_3x3_s2_56x56x144", 56, 144, 2);
+
+    {
+        const std::size_t depth = 64;
+        const std::size_t filters = 128;
+        const auto layer = std::make_shared<separable_conv_2d_layer>("separable_3x3_56x56x64_128", depth,
+            fdeep::tensor_shape(3, 3, 1), filters, shape2(1, 1), padding::same, shape2(1, 1),
+            random_values(3 * 3 * depth, rng), random_values(depth * filters, rng),
+            float_vec(depth, 0), random_values(filters, rng));
+        result.push_back(layer_benchmark(layer->name_, layer, { random_tensor(fdeep::tensor_shape(56, 56, depth), rng) }));
+    }
+
+    const auto dense = [&](const std::string& name, const fdeep::tensor_shape& shape, std::size_t units) {
+        const auto layer = std::make_shared<dense_layer>(name, units,
+            random_values(shape.depth_ * units, rng), random_values(units, rng));
+        result.push_back(layer_benchmark(name, layer, { random_tensor(shape, rng) }));
+    };
+    dense("dense_2048_1000", fdeep::tensor_shape(static_cast<std::size_t>(2048)), 1000);
+    dense("dense_128x512_512", fdeep::tensor_shape(128, 512), 512);
+    {
+        const std::size_t depth = 2048;
+        const std::size_t units = 1000;
+        const auto layer = std::make_shared<dense_layer>("dense_2048_1000_pruned_80", units,
+            pruned_values(depth * units, 0.8, rng), random_values(units, rng));
+        result.push_back(layer_benchmark(layer->name_, layer, { random_tensor(fdeep::tensor_shape(depth), rng) }));
+    }
+
+    {
+        const std::size_t depth = 8;
+        const std::size_t filters = 16;
+        const auto layer = std::make_shared<conv_3d_layer>("conv_3d_3x3x3_32x64x64x8_16",
+            shape3(3, 3, 3), filters, shape3(1, 1, 1), padding::same, shape3(1, 1, 1),
+            random_values(3 * 3 * 3 * depth * filters, rng), random_values(filters, rng));
+        result.push_back(layer_benchmark(layer->name_, layer, { random_tensor(fdeep::tensor_shape(32, 64, 64, depth), rng) }));
+    }
+
+    const auto pool_input = random_tensor(fdeep::tensor_shape(112, 112, 64), rng);
+    result.push_back(layer_benchmark("max_pool_2x2_112x112x64",
+        std::make_shared<max_pooling_3d_layer>("max_pool", shape3(1, 2, 2), shape3(1, 2, 2), padding::valid),
+        { pool_input }));
+    result.push_back(layer_benchmark("average_pool_3x3_s1_112x112x64",
+        std::make_shared<average_pooling_3d_layer>("average_pool", shape3(1, 3, 3), shape3(1, 1, 1), padding::same),
+        { pool_input }));
+    result.push_back(layer_benchmark("max_pool_2x2x2_32x64x64x16",
+        std::make_shared<max_pooling_3d_layer>("max_pool", shape3(2, 2, 2), shape3(2, 2, 2), padding::valid),
+        { random_tensor(fdeep::tensor_shape(32, 64, 64, 16), rng) }));
+    result.push_back(layer_benchmark("global_average_pool_7x7x2048",
+        std::make_shared<global_average_pooling_3d_layer>("global_average_pool", false),
+        { random_tensor(fdeep::tensor_shape(7, 7, 2048), rng) }));
+
+    const auto elementwise_input = random_tensor(fdeep::tensor_shape(112, 112, 64), rng);
+    result.push_back(layer_benchmark("relu_112x112x64",
+        std::make_shared<relu_layer>("relu", std::numeric_limits<float_type>::max(), 0, 0),
+        { elementwise_input }));
+    result.push_back(layer_benchmark("sigmoid_112x112x64",
+        std::make_shared<sigmoid_layer>("sigmoid"),
+        { elementwise_input }));
+    result.push_back(layer_benchmark("add_112x112x64",
+        std::make_shared<add_layer>("add"),
+        { elementwise_input, random_tensor(elementwise_input.shape(), rng) }));
+
+    result.push_back(layer_benchmark("softmax_1000",
+        std::make_shared<softmax_layer>("softmax"),
+        { random_tensor(fdeep::tensor_shape(static_cast<std::size_t>(1000)), rng) }));
+    result.push_back(layer_benchmark("softmax_64x64x21",
+        std::make_shared<softmax_layer>("softmax"),
+        { random_tensor(fdeep::tensor_shape(64, 64, 21), rng) }));
+
+    const auto resize_input = random_tensor(fdeep::tensor_shape(64, 64, 32), rng);
+    result.push_back(layer_benchmark("resize_bilinear_64x64x32_128x128",
+        std::make_shared<resizing_layer>("resize", 128, 128, "bilinear", false),
+        { resize_input }));
+    result.push_back(layer_benchmark("resize_area_64x64x32_40x40",
+        std::make_shared<resizing_layer>("resize", 40, 40, "area", false),
+        { resize_input }));
+
+    {
+        fdeep::tensors inputs;
+        for (std::size_t i = 0; i < 4; ++i) {
+            inputs.push_back(random_tensor(fdeep::tensor_shape(28, 28, 64), rng));
+        }
+        result.push_back(layer_benchmark("concatenate_4x28x28x64",
+            std::make_shared<concatenate_layer>("concatenate", -1), inputs));
+    }
+
+    {
+        const std::size_t depth = 128;
+        result.push_back(layer_benchmark("batch_normalization_56x56x128",
+            std::make_shared<batch_normalization_layer>("batch_normalization", -1,
+                random_values(depth, rng), float_vec(depth, 1), random_values(depth, rng),
+                random_values(depth, rng), static_cast<float_type>(0.001)),
+            { random_tensor(fdeep::tensor_shape(56, 56, depth), rng) }));
+    }
+
+    return result;
+}
+
+// Median of the run times in milliseconds,
+// running for at least min_seconds (and at least min_runs times).
+double measure_median_ms(const std::function<void()>& f)
+{
+    const double min_seconds = 0.2;
+    const std::size_t min_runs = 5;
+    const std::size_t max_runs = 1000;
+
+    f(); // warm-up
+    std::vector<double> times;
+    double total = 0;
+    while (times.size() < max_runs && (times.size() < min_runs || total < min_seconds)) {
+        const auto start = std::chrono::steady_clock::now();
+        f();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        times.push_back(elapsed.count() * 1000);
+        total += elapsed.count();
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+std::string get_arg(int argc, char* argv[], const std::string& name, const std::string& default_value)
+{
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (argv[i] == name) {
+            return argv[i + 1];
+        }
+    }
+    return default_value;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    const std::string output_path = get_arg(argc, argv, "--output", "kernel_benchmarks.json");
+    const std::string baseline_path = get_arg(argc, argv, "--baseline", "");
+    const double threshold = std::stod(get_arg(argc, argv, "--threshold", "0.15"));
+    const std::string filter = get_arg(argc, argv, "--filter", "");
+    fdeep::set_huge_page_mode(fdeep::internal::create_huge_page_mode(
+        get_arg(argc, argv, "--huge-pages", "none")));
+
+    const auto simd = fdeep::get_simd_info();
+    std::cout << fdeep::show_simd_info(simd) << std::endl;
+    const std::size_t numa_nodes = fdeep::internal::numa_node_cpus().size();
+    std::cout << "NUMA nodes: " << numa_nodes << std::endl;
+
+    nlohmann::json results;
+    const auto benchmarks = create_benchmarks();
+    for (const auto& b : benchmarks) {
+        if (b.name_.find(filter) == std::string::npos) {
+            continue;
+        }
+        const double median_ms = measure_median_ms(b.run_);
+        results[b.name_] = { { "median_ms", median_ms } };
+        std::cout << b.name_ << ": " << median_ms << " ms" << std::endl;
+    }
+    // Measured while the weights of all benchmarks are still allocated.
+    const auto huge_pages = fdeep::get_huge_page_usage();
+    const auto mode = fdeep::internal::show_huge_page_mode(huge_pages.mode_);
+    std::cout << "Huge pages (" << mode << "): "
+              << huge_pages.mapped_bytes_ / (1024 * 1024) << " MiB mapped, "
+              << huge_pages.anon_huge_page_bytes_ / (1024 * 1024) << " MiB transparent, "
+              << huge_pages.hugetlb_bytes_ / (1024 * 1024) << " MiB reserved" << std::endl;
+
+    nlohmann::json output;
+    output["cpu"] = cpu_model_name();
+    output["simd"] = fdeep::show_simd_info(simd);
+    output["numa_nodes"] = numa_nodes;
+    output["huge_pages"] = { { "mode", mode },
+        { "mapped_bytes", huge_pages.mapped_bytes_ },
+        { "anon_huge_page_bytes", huge_pages.anon_huge_page_bytes_ },
+        { "hugetlb_bytes", huge_pages.hugetlb_bytes_ } };
+    output["results"] = results;
+    std::ofstream(output_path) << output.dump(2) << std::endl;
+    std::cout << "Results written to " << output_path << std::endl;
+
+    if (baseline_path.empty()) {
+        return 0;
+    }
+
+    std::ifstream baseline_stream(baseline_path);
+    if (!baseline_stream.good()) {
+        std::cerr << "Can not open " << baseline_path << std::endl;
+        return 2;
+    }
+    nlohmann::json baseline;
+    baseline_stream >> baseline;
+    if (baseline.value("cpu", "") != output["cpu"]) {
+        std::cout << "Note: the baseline was recorded on a different CPU ("
+                  << baseline.value("cpu", "unknown") << ")." << std::endl;
+    }
+    if (baseline.contains("huge_pages") && baseline["huge_pages"].value("mode", "") != mode) {
+        std::cout << "Note: the baseline was recorded with huge page mode "
+                  << baseline["huge_pages"].value("mode", "") << "." << std::endl;
+    }
+
+    std::size_t regressions = 0;
+    std::size_t missing = 0;
+    for (const auto& entry : results.items()) {
+        if (!baseline["results"].contains(entry.key())) {
+            ++missing;
+            std::cout << "MISSING BASELINE " << entry.key() << std::endl;
+            continue;
+        }
+        const double base_ms = baseline["results"][entry.key()]["median_ms"];
+        const double new_ms = entry.value()["median_ms"];
+        const double change = new_ms / base_ms - 1;
+        if (change > threshold) {
+            ++regressions;
+            std::cout << "REGRESSION " << entry.key() << ": " << base_ms << " ms -> "
+                      << new_ms << " ms (+" << change * 100 << " %)" << std::endl;
+        }
+    }
+    std::cout << regressions << " regression(s) beyond " << threshold * 100 << " %" << std::endl;
+    std::cout << missing << " benchmark(s) without baseline" << std::endl;
+    return regressions == 0 && missing == 0 ? 0 : 1;
+}
@@ -0,0 +1,635 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+// Tests of single layers, kernels and graph rewrites on synthetic weights,
+// i.e., without models exported from Keras.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest/doctest.h"
+#include <fdeep/fdeep.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+using namespace fdeep::internal;
+
+namespace {
+
+fdeep::float_vec random_values(std::size_t count, std::mt19937& rng)
+{
+    std::uniform_real_distribution<fdeep::float_type> dist(-1, 1);
+    fdeep::float_vec values(count);
+    for (auto& value : values) {
+        value = dist(rng);
+    }
+    return values;
+}
+
+fdeep::tensor random_tensor(const fdeep::tensor_shape& shape, std::mt19937& rng)
+{
+    return fdeep::tensor(shape, random_values(shape.volume(), rng));
+}
+
+node_connections connect_to(const std::string& layer_id)
+{
+    return { node_connection(layer_id, 0, 0) };
+}
+
+// Connects every layer to the one before it.
+std::shared_ptr<model_layer> create_sequential_model(const layer_ptrs& layers, bool optimize)
+{
+    for (std::size_t i = 1; i < layers.size(); ++i) {
+        layers[i]->set_nodes({ node(connect_to(layers[i - 1]->name_)) });
+    }
+    auto model_layers = layers;
+    auto outputs = connect_to(layers.back()->name_);
+    const auto graph_rewrites = optimize
+        ? graph_optimizer(model_layers, outputs).run()
+        : std::vector<std::string>();
+    return std::make_shared<model_layer>("model", model_layers,
+        connect_to(layers.front()->name_), outputs, graph_rewrites);
+}
+
+void check_approx_equal(const fdeep::tensor& actual, const fdeep::tensor& expected)
+{
+    REQUIRE(actual.shape() == expected.shape());
+    for (std::size_t i = 0; i < expected.as_vector()->size(); ++i) {
+        CHECK((*actual.as_vector())[i] == doctest::Approx((*expected.as_vector())[i]).epsilon(0.0001));
+    }
+}
+
+}
+
+TEST_CASE("test_layers_test, graph_optimizer")
+{
+    const auto create_model = [](bool optimize) {
+        std::mt19937 rng(1);
+        const std::size_t depth = 3;
+        const std::size_t filters = 4;
+        return create_sequential_model({ std::make_shared<input_layer>("input",
+                                             tensor_shape_variable(fplus::just<std::size_t>(6), fplus::just<std::size_t>(7), fplus::just(depth))),
+                                           std::make_shared<rescaling_layer>("rescaling_1", static_cast<fdeep::float_type>(0.5), static_cast<fdeep::float_type>(0.25)),
+                                           std::make_shared<rescaling_layer>("rescaling_2", static_cast<fdeep::float_type>(3), static_cast<fdeep::float_type>(-1)),
+                                           std::make_shared<normalization_layer>("normalization", std::vector<int>({ -1 }),
+                                               fdeep::float_vec({ 0.1f, -0.2f, 0.3f }), fdeep::float_vec({ 1.5f, 0.5f, 2 })),
+                                           std::make_shared<conv_2d_layer>("conv", fdeep::tensor_shape(3, 3, depth), filters,
+                                               shape2(1, 1), padding::valid, shape2(1, 1),
+                                               random_values(3 * 3 * depth * filters, rng), random_values(filters, rng)),
+                                           std::make_shared<batch_normalization_layer>("batch_normalization", -1,
+                                               random_values(filters, rng), fdeep::float_vec(filters, 2), random_values(filters, rng),
+                                               random_values(filters, rng), static_cast<fdeep::float_type>(0.001)),
+                                           std::make_shared<flatten_layer>("flatten"),
+                                           std::make_shared<dense_layer>("dense", 5,
+                                               random_values(4 * 5 * filters * 5, rng), random_values(5, rng)) },
+            optimize);
+    };
+    const auto plain = create_model(false);
+    const auto optimized = create_model(true);
+    // Rescaling into Rescaling, Normalization and Rescaling into Conv2D, Flatten into Dense.
+    CHECK(optimized->graph_rewrites().size() == 4);
+
+    std::mt19937 rng(2);
+    const auto input = random_tensor(fdeep::tensor_shape(6, 7, 3), rng);
+    check_approx_equal(optimized->apply({ input }).front(), plain->apply({ input }).front());
+}
+
+TEST_CASE("test_layers_test, execution_plan")
+{
+    // Two residual blocks, so intermediate results are needed by several later steps.
+    std::mt19937 rng(8);
+    const std::size_t depth = 6;
+    layer_ptrs layers = { std::make_shared<input_layer>("input",
+        tensor_shape_variable(fplus::nothing<std::size_t>(), fplus::nothing<std::size_t>(), fplus::just(depth))) };
+    std::string block_input = "input";
+    for (const std::string block : { "block_1", "block_2" }) {
+        const auto conv_1 = std::make_shared<conv_2d_layer>(block + "_conv_1", fdeep::tensor_shape(3, 3, depth), depth,
+            shape2(1, 1), padding::same, shape2(1, 1),
+            random_values(3 * 3 * depth * depth, rng), random_values(depth, rng));
+        const auto conv_2 = std::make_shared<conv_2d_layer>(block + "_conv_2", fdeep::tensor_shape(3, 3, depth), depth,
+            shape2(1, 1), padding::same, shape2(1, 1),
+            random_values(3 * 3 * depth * depth, rng), random_values(depth, rng));
+        const auto add = std::make_shared<add_layer>(block + "_add");
+        conv_1->set_nodes({ node(connect_to(block_input)) });
+        conv_2->set_nodes({ node(connect_to(conv_1->name_)) });
+        add->set_nodes({ node({ node_connection(block_input, 0, 0), node_connection(conv_2->name_, 0, 0) }) });
+        layers.insert(layers.end(), { conv_1, conv_2, add });
+        block_input = add->name_;
+    }
+    const model_layer model("model", layers, connect_to("input"),
+        { node_connection("block_1_add", 0, 0), node_connection(block_input, 0, 0) }, std::vector<std::string>());
+
+    const auto input = random_tensor(fdeep::tensor_shape(40, 30, depth), rng);
+    const auto measure = [](const std::function<fdeep::tensors()>& f) {
+        const memory_accounting_scope accounting;
+        const auto outputs = f();
+        return std::make_pair(outputs, accounting.stats().peak_live_bytes_);
+    };
+    // Both run an execution plan, freeing every result after its last use,
+    // so without requested layer outputs they need the same memory.
+    const auto planned = measure([&]() { return model.apply({ input }); });
+    const auto with_layer_outputs = measure([&]() { return model.apply_with_layer_outputs({ input }, {}).first; });
+    REQUIRE(planned.first.size() == 2);
+    REQUIRE(with_layer_outputs.first.size() == 2);
+    for (std::size_t i = 0; i < 2; ++i) {
+        CHECK(*planned.first[i].as_vector() == *with_layer_outputs.first[i].as_vector());
+    }
+    CHECK(planned.second == with_layer_outputs.second);
+
+    // A requested layer output is kept until the end.
+    const auto conv_output = model.apply_with_layer_outputs({ input }, { "block_1_conv_1" });
+    REQUIRE(conv_output.second.size() == 1);
+    CHECK(conv_output.second.front().shape() == input.shape());
+    CHECK(*conv_output.first.back().as_vector() == *planned.first.back().as_vector());
+}
+
+TEST_CASE("test_layers_test, apply_tiled")
+{
+    std::mt19937 rng(4);
+    const auto conv = [&rng](const std::string& name, std::size_t size, std::size_t depth, std::size_t filters,
+                          std::size_t stride, padding pad_type) {
+        return std::make_shared<conv_2d_layer>(name, fdeep::tensor_shape(size, size, depth), filters,
+            shape2(stride, stride), pad_type, shape2(1, 1),
+            random_values(size * size * depth * filters, rng), random_values(filters, rng));
+    };
+    // Stride-1 convolutions (3x3 and pointwise), a pooling and a strided convolution.
+    const auto model = create_sequential_model({ std::make_shared<input_layer>("input",
+                                                     tensor_shape_variable(fplus::nothing<std::size_t>(), fplus::nothing<std::size_t>(), fplus::just<std::size_t>(5))),
+                                                   conv("conv_1", 3, 5, 16, 1, padding::same),
+                                                   std::make_shared<max_pooling_3d_layer>("pool", shape3(1, 2, 2), shape3(1, 2, 2), padding::valid),
+                                                   conv("conv_2", 1, 16, 24, 1, padding::valid),
+                                                   conv("conv_3", 3, 24, 8, 2, padding::same) },
+        false);
+
+    const auto input = random_tensor(fdeep::tensor_shape(37, 29, 5), rng);
+    const auto expected = model->apply({ input }).front();
+    for (std::size_t band_rows : { 1, 2, 7, 100 }) {
+        check_approx_equal(model->apply_tiled({ input }, band_rows, 100).front(), expected);
+    }
+}
+
+TEST_CASE("test_layers_test, pointwise_convolution")
+{
+    const std::size_t depth = 13;
+    const std::size_t filters = 11;
+    std::mt19937 rng(7);
+    const auto filter_mat = generate_im2col_filter_matrix(
+        generate_filters(shape2(1, 1), fdeep::tensor_shape(1, 1, depth), filters,
+            random_values(depth * filters, rng), random_values(filters, rng), false),
+        shape2(1, 1));
+    // 5 * 7 pixels, i.e., not a multiple of the GEMM kernels' column count.
+    const auto input = random_tensor(fdeep::tensor_shape(5, 7, depth), rng);
+    const auto expected = convolve(shape2(1, 1), padding::valid, filter_mat, input, conv_kernel::rows);
+    check_approx_equal(convolve(shape2(1, 1), padding::valid, filter_mat, input, conv_kernel::s1x1), expected);
+    check_approx_equal(convolve(shape2(1, 1), padding::valid, filter_mat, input, conv_kernel::pointwise), expected);
+    check_approx_equal(convolve(shape2(1, 1), padding::same, filter_mat, input), expected);
+}
+
+TEST_CASE("test_layers_test, layer_outputs_and_class_activation_map")
+{
+    const std::size_t depth = 3;
+    const std::size_t filters = 4;
+    const std::size_t classes = 5;
+    std::mt19937 rng(5);
+    const auto dense_weights = random_values(filters * classes, rng);
+    // The first layer_count layers of a conv + GAP + dense classifier,
+    // always with the same weights.
+    const auto create_model = [&](std::size_t layer_count) {
+        std::mt19937 weights_rng(6);
+        const layer_ptrs layers = { std::make_shared<input_layer>("input",
+                                        tensor_shape_variable(fplus::just<std::size_t>(6), fplus::just<std::size_t>(7), fplus::just(depth))),
+            std::make_shared<conv_2d_layer>("features", fdeep::tensor_shape(3, 3, depth), filters,
+                shape2(1, 1), padding::same, shape2(1, 1),
+                random_values(3 * 3 * depth * filters, weights_rng), random_values(filters, weights_rng)),
+            std::make_shared<global_average_pooling_3d_layer>("pool", false),
+            std::make_shared<dense_layer>("dense", classes, dense_weights, random_values(classes, weights_rng)) };
+        return create_sequential_model(fplus::take(layer_count, layers), false);
+    };
+    const auto model = create_model(4);
+    const auto input = random_tensor(fdeep::tensor_shape(6, 7, depth), rng);
+
+    const auto results = model->apply_with_layer_outputs({ input }, { "features", "pool" });
+    check_approx_equal(results.first.front(), model->apply({ input }).front());
+    REQUIRE(results.second.size() == 2);
+    check_approx_equal(results.second[0], create_model(2)->apply({ input }).front());
+    check_approx_equal(results.second[1], create_model(3)->apply({ input }).front());
+
+    const auto dense = std::dynamic_pointer_cast<dense_layer>(model->find_layer("dense"));
+    REQUIRE(dense != nullptr);
+    const auto& feature_map = results.second[0];
+    for (std::size_t unit = 0; unit < classes; ++unit) {
+        const auto weights = dense->unit_weights(unit);
+        REQUIRE(weights.size() == filters);
+        for (std::size_t z = 0; z < filters; ++z) {
+            CHECK(weights[z] == dense_weights[z * classes + unit]);
+        }
+
+        // The weighted sum of the channels, without negative values and scaled to a maximum of 1.
+        fdeep::float_vec expected;
+        for (std::size_t y = 0; y < 6; ++y) {
+            for (std::size_t x = 0; x < 7; ++x) {
+                fdeep::float_type sum = 0;
+                for (std::size_t z = 0; z < filters; ++z) {
+                    sum += feature_map.get(fdeep::tensor_pos(y, x, z)) * weights[z];
+                }
+                expected.push_back(std::max(static_cast<fdeep::float_type>(0), sum));
+            }
+        }
+        const auto expected_max = fplus::maximum(expected);
+        const auto cam = dense->class_activation_map(feature_map, unit);
+        REQUIRE(cam.shape() == fdeep::tensor_shape(6, 7, 1));
+        for (std::size_t i = 0; i < expected.size(); ++i) {
+            CHECK((*cam.as_vector())[i] == doctest::Approx(expected_max > 0 ? expected[i] / expected_max : 0).epsilon(0.0001));
+        }
+    }
+}
+
+TEST_CASE("test_layers_test, apply_until_softmax")
+{
+    std::mt19937 rng(12);
+    const std::size_t depth = 3;
+    const auto create_model = [&](bool with_softmax) {
+        std::mt19937 weights_rng(13);
+        layer_ptrs layers = { std::make_shared<input_layer>("input",
+                                  tensor_shape_variable(fplus::just<std::size_t>(6), fplus::just<std::size_t>(7), fplus::just(depth))),
+            std::make_shared<conv_2d_layer>("features", fdeep::tensor_shape(3, 3, depth), 4,
+                shape2(1, 1), padding::same, shape2(1, 1),
+                random_values(3 * 3 * depth * 4, weights_rng), random_values(4, weights_rng)),
+            std::make_shared<flatten_layer>("flatten"),
+            std::make_shared<dense_layer>("dense", 5, random_values(6 * 7 * 4 * 5, weights_rng), random_values(5, weights_rng)) };
+        if (with_softmax) {
+            layers.push_back(std::make_shared<softmax_layer>("softmax"));
+        }
+        return create_sequential_model(layers, false);
+    };
+    const auto model = create_model(true);
+    const auto input = random_tensor(fdeep::tensor_shape(6, 7, depth), rng);
+    const auto measure = [](const std::function<fdeep::tensors()>& f) {
+        const memory_accounting_scope accounting;
+        const auto outputs = f();
+        return std::make_pair(outputs, accounting.stats().peak_live_bytes_);
+    };
+
+    // The logits are the output of the dense layer, computed on the execution plan,
+    // which stops in front of the softmax.
+    const auto probabilities = measure([&]() { return model->apply({ input }); });
+    const auto logits = measure([&]() -> fdeep::tensors {
+        const auto result = model->apply_until_softmax({ input });
+        REQUIRE(result.is_just());
+        return { result.unsafe_get_just() };
+    });
+    const auto dense_output = model->apply_with_layer_outputs({ input }, { "dense" }).second.front();
+    CHECK(*logits.first.front().as_vector() == *dense_output.as_vector());
+    check_approx_equal(softmax(logits.first.front()), probabilities.first.front());
+    CHECK(logits.second <= probabilities.second);
+
+    CHECK(create_model(false)->apply_until_softmax({ input }).is_nothing());
+}
+
+TEST_CASE("test_layers_test, sparse_weights")
+{
+    // Of the blocks of 8 units (or filters) sharing an input, only every tenth one is not pruned.
+    const auto pruned_weight = [](std::size_t input, std::size_t unit) {
+        return (input * 3 + unit / 8) % 10 != 0 ? 0 : static_cast<fdeep::float_type>((input + unit) % 7) - 3;
+    };
+    const std::size_t n_in = 32;
+    const std::size_t units = 20;
+    fdeep::float_vec weights(n_in * units);
+    fdeep::float_vec filter_weights(n_in * units);
+    for (std::size_t i = 0; i < n_in; ++i) {
+        for (std::size_t unit = 0; unit < units; ++unit) {
+            weights[i * units + unit] = pruned_weight(i, unit);
+            filter_weights[unit * n_in + i] = pruned_weight(i, unit);
+        }
+    }
+    const fdeep::float_vec bias(units, static_cast<fdeep::float_type>(0.5));
+    fdeep::float_vec input_values(5 * 6 * 8);
+    for (std::size_t i = 0; i < input_values.size(); ++i) {
+        input_values[i] = static_cast<fdeep::float_type>(i % 9) / 9;
+    }
+
+    const dense_layer dense("dense", units, weights, bias);
+    const auto dense_output = dense.apply({ fdeep::tensor(fdeep::tensor_shape(n_in),
+                                                fdeep::float_vec(input_values.begin(), input_values.begin() + n_in)) })
+                                  .front();
+    for (std::size_t unit = 0; unit < units; ++unit) {
+        fdeep::float_type expected = bias[unit];
+        for (std::size_t i = 0; i < n_in; ++i) {
+            expected += input_values[i] * weights[i * units + unit];
+        }
+        CHECK(dense_output.get(tensor_pos(unit)) == doctest::Approx(expected));
+    }
+
+    // 20 filters of shape 2x2x8.
+    const auto filters = generate_im2col_filter_matrix(generate_filters(
+        shape2(1, 1), fdeep::tensor_shape(2, 2, 8), units, filter_weights, bias, false));
+    REQUIRE(filters.sparse_filter_mats_.size() == 2);
+    const fdeep::tensor conv_input(fdeep::tensor_shape(5, 6, 8), fdeep::float_vec(input_values));
+    const auto sparse = convolve(shape2(1, 2), padding::same, filters, conv_input, conv_kernel::sparse);
+    const auto dense_gemm = convolve(shape2(1, 2), padding::same, filters, conv_input, conv_kernel::rows);
+    REQUIRE(sparse.shape() == dense_gemm.shape());
+    for (std::size_t i = 0; i < sparse.as_vector()->size(); ++i) {
+        CHECK((*sparse.as_vector())[i] == doctest::Approx((*dense_gemm.as_vector())[i]));
+    }
+}
+
+TEST_CASE("test_layers_test, sparse_weights_time_distributed")
+{
+    // Four of five blocks of 8 units sharing an input are pruned, which is sparse enough
+    // for matrix-vector products only, so the layer must not be folded into one GEMM.
+    const std::size_t n_in = 24;
+    const std::size_t units = 40;
+    std::mt19937 rng(9);
+    auto weights = random_values(n_in * units, rng);
+    for (std::size_t i = 0; i < n_in; ++i) {
+        for (std::size_t unit = 0; unit < units; ++unit) {
+            if ((i + unit / 8) % 5 != 0) {
+                weights[i * units + unit] = 0;
+            }
+        }
+    }
+    const auto dense = std::make_shared<dense_layer>("dense", units, weights, random_values(units, rng));
+    CHECK(!dense->is_slice_wise());
+
+    const time_distributed_layer time_distributed("time_distributed", dense, 2, 2);
+    const auto input = random_tensor(fdeep::tensor_shape(7, n_in), rng);
+    const auto output = time_distributed.apply({ input }).front();
+    REQUIRE(output.shape() == fdeep::tensor_shape(7, units));
+    for (std::size_t step = 0; step < 7; ++step) {
+        const fdeep::tensor step_input(fdeep::tensor_shape(n_in),
+            fdeep::float_vec(input.as_vector()->begin() + static_cast<std::ptrdiff_t>(step * n_in),
+                input.as_vector()->begin() + static_cast<std::ptrdiff_t>((step + 1) * n_in)));
+        const auto step_output = dense->apply({ step_input }).front();
+        for (std::size_t unit = 0; unit < units; ++unit) {
+            CHECK(output.get(tensor_pos(step, unit)) == step_output.get(tensor_pos(unit)));
+        }
+    }
+}
+
+TEST_CASE("test_layers_test, conv_3d")
+{
+    std::mt19937 rng(10);
+
+    // With a filter (and input) of size 1 in dimension 4,
+    // the 3D convolution is the same as the 2D one.
+    const std::size_t depth = 5;
+    const std::size_t filters = 6;
+    const auto weights = random_values(3 * 3 * depth * filters, rng);
+    const auto bias = random_values(filters, rng);
+    const auto input_values = random_values(9 * 11 * depth, rng);
+    const conv_3d_layer conv_3d("conv_3d", shape3(1, 3, 3), filters, shape3(1, 2, 1),
+        padding::same, shape3(1, 1, 2), weights, bias);
+    const conv_2d_layer conv_2d("conv_2d", fdeep::tensor_shape(3, 3, depth), filters, shape2(2, 1),
+        padding::same, shape2(1, 2), weights, bias);
+    const auto out_3d = conv_3d.apply({ fdeep::tensor(fdeep::tensor_shape(1, 9, 11, depth), fdeep::float_vec(input_values)) }).front();
+    const auto out_2d = conv_2d.apply({ fdeep::tensor(fdeep::tensor_shape(9, 11, depth), fdeep::float_vec(input_values)) }).front();
+    REQUIRE(out_3d.shape() == fdeep::tensor_shape(1, 5, 11, filters));
+    for (std::size_t i = 0; i < out_2d.as_vector()->size(); ++i) {
+        CHECK((*out_3d.as_vector())[i] == doctest::Approx((*out_2d.as_vector())[i]));
+    }
+
+    // Strides, dilation and same padding in dimension 4, against a direct computation.
+    const shape3 filter_size(3, 2, 2);
+    const shape3 strides(2, 1, 2);
+    const shape3 dilation(2, 1, 1);
+    const auto volume_weights = random_values(filter_size.volume() * depth * filters, rng);
+    const conv_3d_layer volume_conv("volume_conv", filter_size, filters, strides, padding::same, dilation,
+        volume_weights, bias);
+    const fdeep::tensor_shape in_shape(9, 4, 7, depth);
+    const auto volume = random_tensor(in_shape, rng);
+    const auto out = volume_conv.apply({ volume }).front();
+    // Same padding as in TensorFlow, for the dilated filter size.
+    const auto pad_before = [](std::size_t in_size, std::size_t size, std::size_t stride, std::size_t dilation_rate) {
+        const std::size_t dilated_size = (size - 1) * dilation_rate + 1;
+        const std::size_t covered = in_size % stride == 0 ? stride : in_size % stride;
+        return dilated_size > covered ? (dilated_size - covered) / 2 : 0;
+    };
+    const std::size_t pad_d4 = pad_before(in_shape.size_dim_4_, filter_size.size_dim_4_, strides.size_dim_4_, dilation.size_dim_4_);
+    const std::size_t pad_y = pad_before(in_shape.height_, filter_size.height_, strides.height_, dilation.height_);
+    const std::size_t pad_x = pad_before(in_shape.width_, filter_size.width_, strides.width_, dilation.width_);
+    REQUIRE(out.shape() == fdeep::tensor_shape(5, 4, 4, filters));
+    for (std::size_t d4 = 0; d4 < 5; ++d4) {
+        for (std::size_t y = 0; y < 4; ++y) {
+            for (std::size_t x = 0; x < 4; ++x) {
+                for (std::size_t f = 0; f < filters; ++f) {
+                    fdeep::float_type expected = bias[f];
+                    std::size_t w = f * filter_size.volume() * depth;
+                    for (std::size_t kd = 0; kd < filter_size.size_dim_4_; ++kd) {
+                        for (std::size_t ky = 0; ky < filter_size.height_; ++ky) {
+                            for (std::size_t kx = 0; kx < filter_size.width_; ++kx) {
+                                const auto in_d4 = static_cast<int>(d4 * strides.size_dim_4_ + kd * dilation.size_dim_4_) - static_cast<int>(pad_d4);
+                                const auto in_y = static_cast<int>(y * strides.height_ + ky * dilation.height_) - static_cast<int>(pad_y);
+                                const auto in_x = static_cast<int>(x * strides.width_ + kx * dilation.width_) - static_cast<int>(pad_x);
+                                const bool inside = in_d4 >= 0 && in_d4 < static_cast<int>(in_shape.size_dim_4_)
+                                    && in_y >= 0 && in_y < static_cast<int>(in_shape.height_)
+                                    && in_x >= 0 && in_x < static_cast<int>(in_shape.width_);
+                                for (std::size_t z = 0; z < depth; ++z, ++w) {
+                                    if (inside) {
+                                        expected += volume_weights[w] * volume.get_ignore_rank(tensor_pos(static_cast<std::size_t>(in_d4), static_cast<std::size_t>(in_y), static_cast<std::size_t>(in_x), z));
+                                    }
+                                }
+                            }
+                        }
+                    }
+                    CHECK(out.get_ignore_rank(tensor_pos(d4, y, x, f)) == doctest::Approx(expected).epsilon(0.0001));
+                }
+            }
+        }
+    }
+
+    // Every depth slice of the input has the value of its index.
+    fdeep::tensor pool_input(fdeep::tensor_shape(40, 32, 32, 8), static_cast<fdeep::float_type>(0));
+    for (std::size_t i = 0; i < pool_input.as_vector()->size(); ++i) {
+        (*pool_input.as_vector())[i] = static_cast<fdeep::float_type>(i / (32 * 32 * 8));
+    }
+    const max_pooling_3d_layer pooling("pooling", shape3(2, 2, 2), shape3(2, 2, 2), padding::valid);
+    const auto pooled = pooling.apply({ pool_input }).front();
+    REQUIRE(pooled.shape() == fdeep::tensor_shape(20, 16, 16, 8));
+    for (std::size_t d4 = 0; d4 < 20; ++d4) {
+        CHECK(pooled.get_ignore_rank(tensor_pos(d4, 15, 15, 7)) == static_cast<fdeep::float_type>(2 * d4 + 1));
+    }
+}
+
+TEST_CASE("test_layers_test, for_slices_parallelly")
+{
+    // Every slice runs once, in the part it belongs to.
+    const std::size_t slices = 10;
+    const std::size_t parts = 4;
+    std::vector<std::size_t> part_of_slice(slices, parts);
+    for_slices_parallelly(slices, parts, [&](std::size_t slice, std::size_t part) {
+        CHECK(part_of_slice[slice] == parts);
+        part_of_slice[slice] = part;
+    });
+    for (std::size_t slice = 0; slice < slices; ++slice) {
+        const auto part = part_of_slice[slice];
+        CHECK(slice >= part * slices / parts);
+        CHECK(slice < (part + 1) * slices / parts);
+    }
+    CHECK_THROWS_AS(for_slices_parallelly(slices, parts, [](std::size_t slice, std::size_t) {
+        if (slice == 7) {
+            throw std::runtime_error("slice failed");
+        }
+    }),
+        std::runtime_error);
+
+    // On a thread of a pool with 4 threads, the volume is split into 4 parts,
+    // some of which run on the pool's other threads.
+    std::mt19937 rng(11);
+    const conv_3d_layer conv("conv", shape3(3, 3, 3), 16, shape3(1, 1, 1), padding::same, shape3(1, 1, 1),
+        random_values(3 * 3 * 3 * 8 * 16, rng), random_values(16, rng));
+    const auto input = random_tensor(fdeep::tensor_shape(8, 32, 32, 8), rng);
+    worker_pool pool(4);
+    const auto parallel = pool.submit([&]() {
+                                  CHECK(slice_thread_count(8, 32 * 32 * 3 * 3 * 3 * 8 * 16) == 4);
+                                  return conv.apply({ input }).front();
+                              })
+                              .get();
+    const auto expected = conv.apply({ input }).front();
+    CHECK(*parallel.as_vector() == *expected.as_vector());
+}
+
+#if defined(__linux__)
+TEST_CASE("test_layers_test, run_pipeline_pinning")
+{
+    // With the calling thread restricted to a single CPU,
+    // all pinned stages have to stay on it.
+    const auto cpus = allowed_cpus();
+    REQUIRE(!cpus.empty());
+    std::vector<int> stage_cpus;
+    std::thread([&]() {
+        pin_current_thread_to_cpus({ cpus.back() });
+        const std::vector<std::function<void(int&)>> stages(3, [](int& cpu) { cpu = sched_getcpu(); });
+        stage_cpus = run_pipeline(stages, std::vector<int>(3, -1), 1, true);
+    }).join();
+    REQUIRE(stage_cpus.size() == 3);
+    for (const auto cpu : stage_cpus) {
+        CHECK(cpu == static_cast<int>(cpus.back()));
+    }
+}
+#endif
+
+TEST_CASE("test_layers_test, weight_store")
+{
+    // A buffer is shared as long as one of its owners is alive.
+    weight_store store;
+    auto owner_1 = std::make_shared<int>(1);
+    auto owner_2 = std::make_shared<int>(2);
+    auto store_1 = store.for_owner(owner_1);
+    auto store_2 = store.for_owner(owner_2);
+    const fdeep::float_vec values = { 1, 2, 3 };
+    const auto buffer_1 = store_1.share(fplus::make_shared_ref<fdeep::float_vec>(values));
+    const auto buffer_2 = store_2.share(fplus::make_shared_ref<fdeep::float_vec>(values));
+    CHECK(&*buffer_1 == &*buffer_2);
+    CHECK(store.buffer_count() == 1);
+    CHECK(store.bytes() == 3 * sizeof(fdeep::float_type));
+    owner_1.reset();
+    CHECK(store.bytes() == 3 * sizeof(fdeep::float_type));
+    owner_2.reset();
+    CHECK(store.buffer_count() == 0);
+    CHECK(store.bytes() == 0);
+    CHECK_THROWS_AS(store_1.share(fplus::make_shared_ref<fdeep::float_vec>(values)), std::runtime_error);
+}
+
+TEST_CASE("test_layers_test, kernel_tuning_cache")
+{
+    const std::string path = "kernel_tuning_cache_test.tsv";
+    const std::string foreign_line = "other_model\tother cpu\tkey\tb";
+    std::ofstream(path) << foreign_line << "\n";
+    const std::vector<std::string> candidates = { "a", "b" };
+    std::vector<std::string> calls;
+    const auto run = [&calls](const std::string& kernel) {
+        calls.push_back(kernel);
+        return kernel;
+    };
+
+    std::string winner;
+    {
+        kernel_tuning_cache cache(path, "hash");
+        // Without a tuning scope (i.e., in predictions) nothing is measured.
+        CHECK(cache.run_tuned("key", candidates, "fallback", run) == "fallback");
+        CHECK(calls.size() == 1);
+        CHECK(cache.known_winner("key").is_nothing());
+        {
+            const kernel_tuning_scope tuning;
+            cache.run_tuned("key", candidates, "fallback", run);
+        }
+        // A warm-up run, and two timed runs per candidate.
+        CHECK(calls.size() == 6);
+        REQUIRE(cache.known_winner("key").is_just());
+        winner = cache.known_winner("key").unsafe_get_just();
+        cache.flush();
+    }
+
+    // The result is reused, also when tuning.
+    kernel_tuning_cache reloaded(path, "hash");
+    REQUIRE(reloaded.known_winner("key").is_just());
+    CHECK(reloaded.known_winner("key").unsafe_get_just() == winner);
+    calls.clear();
+    {
+        const kernel_tuning_scope tuning;
+        CHECK(reloaded.run_tuned("key", candidates, "fallback", run) == winner);
+    }
+    CHECK(calls.size() == 1);
+
+    // Entries of other models are kept, but not used.
+    std::ostringstream content;
+    content << std::ifstream(path).rdbuf();
+    CHECK(content.str().find(foreign_line + "\n") != std::string::npos);
+    CHECK(kernel_tuning_cache(path, "other_model").size() == 0);
+    std::remove(path.c_str());
+}
+
+TEST_CASE("test_layers_test, memory_stats")
+{
+    // Both the outer and the inner model have a layer named "dense".
+    std::mt19937 rng(3);
+    const layer_ptr inner_dense_layer = std::make_shared<dense_layer>("dense", 3, random_values(8 * 3, rng), random_values(3, rng));
+    inner_dense_layer->set_nodes({ node(connect_to("inner_input")) });
+    const auto inner = std::make_shared<model_layer>("inner",
+        layer_ptrs({ std::make_shared<input_layer>("inner_input", tensor_shape_variable(fplus::just<std::size_t>(8))),
+            inner_dense_layer }),
+        connect_to("inner_input"), connect_to("dense"), std::vector<std::string>());
+    const auto outer = create_sequential_model({ std::make_shared<input_layer>("input", tensor_shape_variable(fplus::just<std::size_t>(4))),
+                                                   std::make_shared<dense_layer>("dense", 8, random_values(4 * 8, rng), random_values(8, rng)),
+                                                   inner },
+        false);
+
+    const auto input = random_tensor(fdeep::tensor_shape(4), rng);
+    const memory_accounting_scope accounting;
+    outer->apply({ input });
+    const auto stats = accounting.stats();
+
+    const auto find_stats = [&stats](const std::string& layer_path) {
+        const auto found = fplus::find_first_by([&](const fdeep::layer_memory_stats& layer) {
+            return layer.layer_path_ == layer_path;
+        },
+            stats.layers_);
+        REQUIRE(found.is_just());
+        return found.unsafe_get_just();
+    };
+    CHECK(stats.layers_.size() == 4);
+    const auto outer_stats = find_stats("model");
+    const auto outer_dense = find_stats("model/dense");
+    const auto inner_stats = find_stats("model/inner");
+    const auto inner_dense = find_stats("model/inner/dense");
+    CHECK(outer_dense.layer_name_ == "dense");
+    CHECK(inner_dense.layer_name_ == "dense");
+    CHECK(outer_dense.allocated_bytes_ >= 8 * sizeof(fdeep::float_type));
+    CHECK(inner_dense.allocated_bytes_ >= 3 * sizeof(fdeep::float_type));
+
+    // The stats of a layer include the ones of the layers nested in it.
+    CHECK(outer_stats.allocations_ == stats.allocations_);
+    CHECK(outer_stats.allocated_bytes_ == stats.allocated_bytes_);
+    CHECK(outer_stats.peak_live_bytes_ == stats.peak_live_bytes_);
+    CHECK(inner_stats.allocations_ >= inner_dense.allocations_);
+    CHECK(outer_stats.allocations_ >= outer_dense.allocations_ + inner_stats.allocations_);
+    // The live bytes at the peak include the output of the outer dense layer.
+    CHECK(inner_dense.peak_live_bytes_ >= (8 + 3) * sizeof(fdeep::float_type));
+}
@@ -8,6 +8,29 @@
 #include "doctest/doctest.h"
 #include <fdeep/fdeep.hpp>
 
+namespace {
+
+// Sets the huge page mode for its lifetime.
+class huge_page_mode_scope {
+public:
+    explicit huge_page_mode_scope(fdeep::huge_page_mode mode)
+        : previous_(fdeep::get_huge_page_usage().mode_)
+    {
+        fdeep::set_huge_page_mode(mode);
+    }
+    ~huge_page_mode_scope()
+    {
+        fdeep::set_huge_page_mode(previous_);
+    }
+    huge_page_mode_scope(const huge_page_mode_scope&) = delete;
+    huge_page_mode_scope& operator=(const huge_page_mode_scope&) = delete;
+
+private:
+    fdeep::huge_page_mode previous_;
+};
+
+}
+
 TEST_CASE("test_model_sequential_test, load_model")
 {
     const auto model = fdeep::load_model("../test_model_sequential.json",
@@ -18,3 +41,207 @@ TEST_CASE("test_model_sequential_test, load_model")
     model.predict_multi(multi_inputs, false);
     model.predict_multi(multi_inputs, true);
 }
+
+TEST_CASE("test_model_sequential_test, predict_tiled")
+{
+    const auto model = fdeep::load_model("../test_model_sequential.json",
+        false, fdeep::dev_null_logger);
+    const auto shape = model.get_dummy_input_shapes().front();
+    fdeep::float_vec values(shape.volume());
+    for (std::size_t i = 0; i < values.size(); ++i) {
+        values[i] = static_cast<fdeep::float_type>(i % 23) / 23;
+    }
+    const fdeep::tensors inputs = { fdeep::tensor(shape, std::move(values)) };
+    const auto expected = model.predict(inputs);
+    for (std::size_t band_rows : { 1, 3, 16, 100 }) {
+        const auto outputs = model.predict_tiled(inputs, band_rows);
+        REQUIRE(outputs.size() == expected.size());
+        for (std::size_t i = 0; i < outputs.size(); ++i) {
+            REQUIRE(outputs[i].shape() == expected[i].shape());
+            for (std::size_t j = 0; j < expected[i].as_vector()->size(); ++j) {
+                CHECK((*outputs[i].as_vector())[j] == doctest::Approx((*expected[i].as_vector())[j]).epsilon(0.0001));
+            }
+        }
+    }
+}
+
+TEST_CASE("test_model_sequential_test, predict_pipelined")
+{
+    const auto model = fdeep::load_model("../test_model_sequential.json",
+        false, fdeep::dev_null_logger);
+    const auto shape = model.get_dummy_input_shapes().front();
+    std::vector<fdeep::tensors> inputs_vec;
+    for (std::size_t i = 0; i < 7; ++i) {
+        inputs_vec.push_back({ fdeep::tensor(shape, static_cast<fdeep::float_type>(i) / 7) });
+    }
+    for (std::size_t stages : { 1, 2, 3, 100 }) {
+        const auto outputs_vec = model.predict_pipelined(inputs_vec, stages);
+        REQUIRE(outputs_vec.size() == inputs_vec.size());
+        for (std::size_t i = 0; i < inputs_vec.size(); ++i) {
+            const auto expected = model.predict(inputs_vec[i]);
+            REQUIRE(outputs_vec[i].size() == expected.size());
+            for (std::size_t j = 0; j < expected.size(); ++j) {
+                CHECK(*outputs_vec[i][j].as_vector() == *expected[j].as_vector());
+            }
+        }
+    }
+    CHECK(model.test_pipeline_throughput(2, 4).stages_ <= 2);
+}
+
+TEST_CASE("test_model_sequential_test, predict_async")
+{
+    const auto model = fdeep::load_model("../test_model_sequential.json",
+        false, fdeep::dev_null_logger);
+    const auto inputs = model.generate_dummy_inputs();
+    auto outputs = model.predict_async(inputs);
+    CHECK(*outputs.get().front().as_vector() == *model.predict(inputs).front().as_vector());
+    const fdeep::cancellation_token token;
+    token.cancel();
+    CHECK_THROWS_AS(model.predict_async(inputs, token).get(), fdeep::prediction_cancelled);
+}
+
+TEST_CASE("test_model_sequential_test, share_weights")
+{
+    const auto load = []() {
+        return fdeep::load_model("../test_model_sequential.json",
+            false, fdeep::dev_null_logger, static_cast<fdeep::float_type>(0.0001),
+            fdeep::internal::layer_creators(), "", true);
+    };
+    const auto bytes_before = fdeep::shared_weights_bytes();
+    {
+        const auto model_1 = load();
+        const auto bytes = fdeep::shared_weights_bytes();
+        CHECK(bytes > bytes_before);
+        const auto model_2 = load();
+        CHECK(fdeep::shared_weights_bytes() == bytes);
+        const auto inputs = model_1.generate_dummy_inputs();
+        CHECK(*model_1.predict(inputs).front().as_vector() == *model_2.predict(inputs).front().as_vector());
+    }
+    // The weights of destroyed models are not kept.
+    CHECK(fdeep::shared_weights_bytes() == bytes_before);
+}
+
+TEST_CASE("test_model_sequential_test, huge_pages")
+{
+    const auto load = []() {
+        return fdeep::load_model("../test_model_sequential.json",
+            false, fdeep::dev_null_logger);
+    };
+    const auto model = load();
+    const auto inputs = model.generate_dummy_inputs();
+    const auto expected = *model.predict(inputs).front().as_vector();
+
+    const huge_page_mode_scope huge_pages(fdeep::huge_page_mode::transparent);
+    const auto huge_page_model = load();
+    CHECK(*huge_page_model.predict(inputs).front().as_vector() == expected);
+    const fdeep::numa_replicated_model replicated(load);
+    REQUIRE(replicated.node_count() > 0);
+    CHECK(*replicated.replica(0).predict(inputs).front().as_vector() == expected);
+
+    // A 4 MiB tensor is large enough for huge pages, which are unmapped again when it is freed.
+    const auto mapped_bytes = fdeep::get_huge_page_usage().mapped_bytes_;
+    {
+        const fdeep::tensor large(fdeep::tensor_shape(std::size_t(1024 * 1024)), static_cast<fdeep::float_type>(1));
+#if defined(__linux__)
+        CHECK(fdeep::get_huge_page_usage().mapped_bytes_ >= mapped_bytes + 1024 * 1024 * sizeof(fdeep::float_type));
+#endif
+        CHECK(large.get(fdeep::tensor_pos(std::size_t(1024 * 1024 - 1))) == 1);
+    }
+    CHECK(fdeep::get_huge_page_usage().mapped_bytes_ == mapped_bytes);
+}
+
+TEST_CASE("test_model_sequential_test, predict_topk")
+{
+    const auto model = fdeep::load_model("../test_model_sequential.json",
+        false, fdeep::dev_null_logger);
+    const fdeep::tensors inputs = { fdeep::tensor(model.get_dummy_input_shapes().front(), static_cast<fdeep::float_type>(0.3)) };
+    const auto probabilities = *model.predict(inputs).front().as_vector();
+    // The model ends with a softmax, so only its logits are computed.
+    const auto topk = model.predict_topk(inputs, 3);
+    REQUIRE(topk.size() == 3);
+    CHECK(topk.front() == model.predict_class_with_confidence(inputs));
+    for (std::size_t i = 0; i < topk.size(); ++i) {
+        CHECK(topk[i].second == probabilities[topk[i].first]);
+        if (i > 0) {
+            CHECK(topk[i - 1].second >= topk[i].second);
+        }
+    }
+    CHECK(model.predict_topk(inputs, 100).size() == probabilities.size());
+}
+
+TEST_CASE("test_model_sequential_test, predict_with_memory_stats")
+{
+    const auto model = fdeep::load_model("../test_model_sequential.json",
+        false, fdeep::dev_null_logger);
+    const auto inputs = model.generate_dummy_inputs();
+    const auto expected = model.predict(inputs);
+    const auto result = model.predict_with_memory_stats(inputs);
+    CHECK(*result.first.front().as_vector() == *expected.front().as_vector());
+    const auto& stats = result.second;
+    REQUIRE(stats.layers_.size() > 1);
+    CHECK(stats.allocations_ > 0);
+    CHECK(stats.peak_live_bytes_ <= stats.allocated_bytes_);
+    // The model itself runs first, all other layers are nested in it.
+    const auto& model_stats = stats.layers_.front();
+    CHECK(model_stats.layer_path_ == model_stats.layer_name_);
+    CHECK(model_stats.allocated_bytes_ == stats.allocated_bytes_);
+    for (std::size_t i = 1; i < stats.layers_.size(); ++i) {
+        const auto& layer = stats.layers_[i];
+        CHECK(fplus::is_prefix_of(model_stats.layer_path_ + "/", layer.layer_path_));
+        CHECK(fplus::is_suffix_of("/" + layer.layer_name_, layer.layer_path_));
+        CHECK(layer.allocated_bytes_ <= model_stats.allocated_bytes_);
+        CHECK(layer.peak_live_bytes_ <= stats.peak_live_bytes_);
+    }
+}
+
+TEST_CASE("test_model_sequential_test, predict_sliding_window")
+{
+    const auto model = fdeep::load_model("../test_model_sequential.json",
+        false, fdeep::dev_null_logger);
+    const auto window_shape = model.get_dummy_input_shapes().front();
+    const auto check_window = [&model](const fdeep::tensor& heatmap, std::size_t y, std::size_t x,
+                                  const fdeep::tensor& window) {
+        const auto expected = *model.predict({ window }).front().as_vector();
+        REQUIRE(heatmap.shape().depth_ == expected.size());
+        for (std::size_t i = 0; i < expected.size(); ++i) {
+            CHECK(heatmap.get(fdeep::tensor_pos(y, x, i)) == doctest::Approx(expected[i]).epsilon(0.0001));
+        }
+    };
+
+    // A ramp, so every window sees different values.
+    const fdeep::tensor_shape image_shape(window_shape.height_ + 8,
+        window_shape.width_ + 16, window_shape.depth_);
+    fdeep::float_vec values(image_shape.volume());
+    for (std::size_t y = 0; y < image_shape.height_; ++y) {
+        for (std::size_t x = 0; x < image_shape.width_; ++x) {
+            for (std::size_t z = 0; z < image_shape.depth_; ++z) {
+                values[(y * image_shape.width_ + x) * image_shape.depth_ + z] = static_cast<fdeep::float_type>(y + 2 * x + 3 * z) / 100;
+            }
+        }
+    }
+    const fdeep::tensor image(image_shape, std::move(values));
+    const auto window_at = [&](std::size_t y, std::size_t x) {
+        return fdeep::internal::crop_tensor(0, 0,
+            y, image_shape.height_ - window_shape.height_ - y,
+            x, image_shape.width_ - window_shape.width_ - x,
+            image);
+    };
+
+    const auto single = model.predict_sliding_window(window_at(3, 5));
+    REQUIRE(single.shape() == fdeep::tensor_shape(1, 1, 10));
+    check_window(single, 0, 0, window_at(3, 5));
+
+    // The model starts with two unpadded convolutions with strides of 1,
+    // so every pixel of the image is the start of a window.
+    const auto heatmap = model.predict_sliding_window(image);
+    REQUIRE(heatmap.shape() == fdeep::tensor_shape(9, 17, 10));
+    for (const auto& pos : std::vector<std::pair<std::size_t, std::size_t>>({ { 0, 0 }, { 0, 16 }, { 8, 0 }, { 8, 16 }, { 3, 7 }, { 5, 12 } })) {
+        check_window(heatmap, pos.first, pos.second, window_at(pos.first, pos.second));
+    }
+
+    const auto strided_heatmap = model.predict_sliding_window(image, 4);
+    REQUIRE(strided_heatmap.shape() == fdeep::tensor_shape(3, 5, 10));
+    for (const auto& pos : std::vector<std::pair<std::size_t, std::size_t>>({ { 0, 0 }, { 2, 4 }, { 1, 3 } })) {
+        check_window(strided_heatmap, pos.first, pos.second, window_at(4 * pos.first, 4 * pos.second));
+    }
+}
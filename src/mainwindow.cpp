@@ -13,6 +13,7 @@
 #include <QComboBox>
 #include <algorithm>
 #include <vector>
+#include <stdexcept>
 
 MainWindow::MainWindow(UserType userType, const QString &username, QWidget *parent)
     : QMainWindow(parent), ui(new Ui::MainWindow), userType(userType), username(username),
@@ -196,12 +197,14 @@ void MainWindow::on_predictButton_clicked()
     
     // Perform prediction
     try {
-        std::vector<float> probabilities = modelInference->predict(currentImage);
+        std::vector<ClassScore> scores = modelInference->classify(currentImage);
+        if (scores.empty()) {
+            throw std::runtime_error("no classification result");
+        }
         
-        // Find the class with highest probability
-        auto max_it = std::max_element(probabilities.begin(), probabilities.end());
-        size_t max_idx = std::distance(probabilities.begin(), max_it);
-        float confidence = *max_it * 100.0f;
+        // The class with highest probability
+        size_t max_idx = scores.front().classIndex;
+        float confidence = scores.front().probability * 100.0f;
         
         // Classes corresponding to the model output
         std::string classes[] = {"Normal", "COVID-19", "Viral Pneumonia", "Lung Opacity"};
@@ -3,6 +3,7 @@
 #include <QDebug>
 #include <thread>
 #include <chrono>
+#include <algorithm>
 
 ModelInference::ModelInference(const std::string& modelPath, QObject* parent) 
     : QObject(parent),
@@ -25,6 +26,13 @@ ModelInference::~ModelInference()
     if (m_loadingFuture.valid()) {
         m_loadingFuture.wait();
     }
+    
+    // Stop the running prediction at its next layer and wait for all of them
+    std::lock_guard<std::mutex> lock(m_predictionMutex);
+    m_predictionToken.cancel();
+    for (auto& future : m_predictionFutures) {
+        future.wait();
+    }
 }
 
 bool ModelInference::isModelLoaded() const
@@ -106,6 +114,15 @@ fdeep::tensor ModelInference::preprocessImage(const cv::Mat& image) {
 }
 
 std::vector<float> ModelInference::predict(const cv::Mat& image) {
+    return predict(image, fdeep::cancellation_token());
+}
+
+std::vector<float> ModelInference::predict(const cv::Mat& image, const fdeep::cancellation_token& token) {
+    // A superseded image gets no result, not even a dummy one
+    if (token.is_cancelled()) {
+        throw fdeep::prediction_cancelled();
+    }
+    
     // Check if model is loaded
     if (!m_modelLoaded) {
         qDebug() << "Model not loaded, returning dummy predictions";
@@ -129,38 +146,86 @@ std::vector<float> ModelInference::predict(const cv::Mat& image) {
     std::lock_guard<std::mutex> lock(m_modelMutex);
     
     try {
-        // Real prediction logic would be:
-        // auto input = preprocessImage(image);
-        // auto result = model_->predict({input});
-        // const auto& output_tensor = result.front();
-        // 
-        // std::vector<float> probabilities;
-        // const auto& shape = output_tensor.shape();
-        // const auto size = shape.depth_ * shape.height_ * shape.width_;
-        // 
-        // probabilities.reserve(size);
-        // for (std::size_t i = 0; i < size; ++i) {
-        //     probabilities.push_back(output_tensor.get(fdeep::tensor_pos(i)));
-        // }
+        if (model_) {
+            // Runs on fdeep's worker pool and stops between two layers once the token is cancelled
+            const auto result = model_->predict_async({preprocessImage(image)}, token).get();
+            const auto& output_values = *result.front().as_vector();
+            return std::vector<float>(output_values.begin(), output_values.end());
+        }
         
-        // For now, return simulated results
+        // Without a real model, return simulated results
         std::vector<float> probabilities = {0.80f, 0.05f, 0.10f, 0.05f};
         return probabilities;
+    } catch (const fdeep::prediction_cancelled&) {
+        throw;
     } catch (const std::exception& e) {
         qWarning() << "Error during prediction:" << e.what();
         return std::vector<float>{0.25f, 0.25f, 0.25f, 0.25f}; // Equal probabilities on error
     }
 }
 
+std::vector<ClassScore> ModelInference::classify(const cv::Mat& image, std::size_t k) {
+    {
+        // Thread-safe access to the model
+        std::lock_guard<std::mutex> lock(m_modelMutex);
+        if (m_modelLoaded && model_) {
+            try {
+                std::vector<ClassScore> scores;
+                for (const auto& entry : model_->predict_topk({preprocessImage(image)}, k)) {
+                    scores.push_back({entry.first, static_cast<float>(entry.second)});
+                }
+                return scores;
+            } catch (const std::exception& e) {
+                qWarning() << "Error during classification:" << e.what();
+            }
+        }
+    }
+    
+    // Without a real model, rank the (simulated) probabilities of predict
+    std::vector<float> probabilities = predict(image);
+    std::vector<ClassScore> scores;
+    for (std::size_t i = 0; i < probabilities.size(); ++i) {
+        scores.push_back({i, probabilities[i]});
+    }
+    const auto middle = scores.begin() + static_cast<std::ptrdiff_t>(std::min(k, scores.size()));
+    std::partial_sort(scores.begin(), middle, scores.end(),
+                      [](const ClassScore& a, const ClassScore& b) { return a.probability > b.probability; });
+    scores.erase(middle, scores.end());
+    return scores;
+}
+
 void ModelInference::predictAsync(const cv::Mat& image) {
     // Create a copy of the image to ensure it remains valid in the other thread
     cv::Mat imageCopy = image.clone();
     
-    // Process asynchronously
-    std::thread([this, imageCopy = std::move(imageCopy)]() mutable {
-        std::vector<float> result = this->predict(imageCopy);
-        emit predictionCompleted(result);
-    }).detach();
+    std::lock_guard<std::mutex> lock(m_predictionMutex);
+    
+    // A new image supersedes the one still being analysed
+    m_predictionToken.cancel();
+    m_predictionToken = fdeep::cancellation_token();
+    const fdeep::cancellation_token token = m_predictionToken;
+    
+    // Reap the predictions that are done, without waiting for the cancelled one
+    // that is still finishing its current layer
+    m_predictionFutures.erase(
+        std::remove_if(m_predictionFutures.begin(), m_predictionFutures.end(),
+                       [](const std::future<void>& future) {
+                           return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+                       }),
+        m_predictionFutures.end());
+    
+    // Process asynchronously, the destructor waits for it
+    m_predictionFutures.push_back(std::async(std::launch::async, [this, token, imageCopy = std::move(imageCopy)]() {
+        std::vector<float> result;
+        try {
+            result = this->predict(imageCopy, token);
+        } catch (const fdeep::prediction_cancelled&) {
+            return;
+        }
+        if (!token.is_cancelled()) {
+            emit predictionCompleted(result);
+        }
+    }));
 }
 
 void ModelInference::queueImage(const cv::Mat& image) {
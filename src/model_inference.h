@@ -7,10 +7,17 @@
 #include <mutex>
 #include <future>
 #include <functional>
+#include <vector>
 #include <QObject>
 #include <QString>
 #include "xraybuffer.h"
 
+// A class of a classification result with its probability
+struct ClassScore {
+    std::size_t classIndex;
+    float probability;
+};
+
 // ModelInference class that handles X-ray image analysis with background processing
 class ModelInference : public QObject {
     Q_OBJECT
@@ -23,7 +30,18 @@ public:
     // Predict using the model (synchronous version)
     std::vector<float> predict(const cv::Mat& image);
     
-    // Predict asynchronously, will emit predictionCompleted when done
+    // The k most likely classes, most likely first.
+    // This is the default classification path: with a loaded model it uses
+    // fdeep's predict_topk, which does not evaluate the full softmax.
+    std::vector<ClassScore> classify(const cv::Mat& image, std::size_t k = 1);
+    
+    // Predict with a token that can stop the prediction between two layers,
+    // throws fdeep::prediction_cancelled if it does
+    std::vector<float> predict(const cv::Mat& image, const fdeep::cancellation_token& token);
+    
+    // Predict asynchronously, will emit predictionCompleted when done.
+    // Cancels the prediction of the previous image, whose result is not emitted,
+    // without waiting for it to stop.
     void predictAsync(const cv::Mat& image);
     
     // Queue an image for background processing
@@ -61,6 +79,12 @@ private:
     // Background tasks
     std::future<void> m_loadingFuture;
     
+    // Token of the latest predictAsync call and the predictions not reaped yet,
+    // including the cancelled ones that are still finishing their current layer
+    std::mutex m_predictionMutex;
+    fdeep::cancellation_token m_predictionToken;
+    std::vector<std::future<void>> m_predictionFutures;
+    
     // Process images from the buffer in background
     void processImagesInBackground();
     